@@ -1,74 +1,671 @@
-string = """
-PAM_SUCCESS
-PAM_OPEN_ERR
-PAM_SYMBOL_ERR
-PAM_SERVICE_ERRE
-PAM_SYSTEM_ERR
-PAM_BUF_ERR
-PAM_PERM_DENIED
-PAM_AUTH_ERR
-PAM_CRED_INSUFFICIENT
-PAM_AUTHINFO_UNAVAIL
-PAM_USER_UNKNOWN
-PAM_MAXTRIES
-PAM_NEW_AUTHTOK_REQD
-PAM_ACCT_EXPIRED
-PAM_SESSION_ERR
-PAM_CRED_UNAVAIL
-PAM_CRED_EXPIRED
-PAM_CRED_ERR
-PAM_NO_MODULE_DATA
-PAM_CONV_ERR
-PAM_AUTHTOK_ERR
-PAM_AUTHTOK_RECOVERY_ERR
-PAM_AUTHTOK_LOCK_BUSY
-PAM_AUTHTOK_DISABLE_AGING
-PAM_TRY_AGAIN
-PAM_IGNORE
-PAM_ABORT
-PAM_AUTHTOK_EXPIRED
-PAM_MODULE_UNKNOWN
-PAM_BAD_ITEM
-PAM_CONV_AGAIN
-PAM_INCOMPLETE
-PAM_SILENT
-PAM_DISALLOW_NULL_AUTHTOK
-PAM_ESTABLISH_CRED
-PAM_DELETE_CRED
-PAM_REINITIALIZE_CRED
-PAM_REFRESH_CRED
-PAM_CHANGE_EXPIRED_AUTHTOK
-PAM_PRELIM_CHECK
-PAM_UPDATE_AUTHTOK
-PAM_SERVICE
-PAM_USER
-PAM_TTY
-PAM_RHOST
-PAM_CONV
-PAM_AUTHTOK
-PAM_OLDAUTHTOK
-PAM_RUSER
-PAM_USER_PROMPT
-PAM_FAIL_DELAY
-PAM_XDISPLAY
-PAM_XAUTHDATA
-PAM_AUTHTOK_TYPE
-PAM_PROMPT_ECHO_OFF
-PAM_PROMPT_ECHO_ON
-PAM_ERROR_MSG
-PAM_TEXT_INFO
-PAM_RADIO_TYPE
-PAM_BINARY_PROMPT
-PAM_DATA_REPLACE
-PAM_DATA_SILENT
-""".strip()
-
-
-longest = max(len(line) for line in string.split("\n"))
-print(longest)
-
-# out = '\n'.join([f"{line}{((longest+1)-len(line))*' '}= {line}" for line in string.split("\n")])
-# print(out)
-
-out = '\n'.join([f"{line}{((longest+1)-len(line))*' '}: int" for line in string.split("\n")])
-print(out)
+"""Generate the declarations shared by the C and the Python side
+
+The opcodes of the protocol between the PAM host and the Python process
+along with the fields of their payloads, the PAM constants exposed to
+Python and the errors returned for each pam_sm_* function are listed
+once, below. Running
+
+    python make.py
+
+rewrites the regions of the source files between
+
+    BEGIN GENERATED by make.py: <region>
+    END GENERATED: <region>
+
+With --check nothing is written, the exit status tells whether the files
+are up to date.
+"""
+
+import re
+import sys
+from dataclasses import dataclass
+from pathlib import Path
+
+SRC = Path(__file__).parent / "pam_python"
+
+
+# Types of the fields of a payload (see pipe.h for the encoding):
+#   "int"           32-bit native-endian int
+#   "string"        length-prefixed UTF-8, decoded in C into a NUL-terminated copy
+#   "bytes"         length-prefixed bytes, decoded in C as a pointer into the frame
+#   name of RECORDS the fields of the record
+#   Optional(type)  int telling whether the value follows
+#   List(type)      int count followed by the elements, of a type above
+#   Variant(field, cases, default)  the type of the value is picked by an int
+#                   field before it in the same record, cases map the name of
+#                   a constant to a type above
+@dataclass
+class Optional:
+    type: object
+
+
+@dataclass
+class List:
+    type: str
+
+
+@dataclass
+class Variant:
+    field: str
+    cases: dict
+    default: str
+
+
+ITEM_VALUE = Variant("item_type", {"PAM_XAUTHDATA": "xauth"}, "string")
+
+# Records as (Python class or None for a tuple, fields)
+RECORDS = {
+    "xauth": ("XAuthData", [("name", "string"), ("data", "bytes")]),
+    # The value is missing when the item is not set
+    "item": (None, [("item_type", "int"), ("value", Optional(ITEM_VALUE))]),
+    "new_item": (None, [("item_type", "int"), ("value", ITEM_VALUE)]),
+    "prompt": ("Message", [("msg_style", "int"),
+                           ("msg", Variant("msg_style", {"PAM_BINARY_PROMPT": "bytes"}, "string"))]),
+    # A text response is decoded by the handler, which knows the style of its prompt
+    "response": (None, [("resp_retcode", "int"), ("resp", Optional("bytes"))]),
+    "log_record": (None, [("priority", "int"), ("msg", "bytes")]),
+}
+
+# Frames of the protocol (see pipe.h) as (name, opcode, handler, payload sent
+# to the PAM host, payload sent to the Python process). The calls made by the
+# Python process are served by the handler in the PAM host (see pam.h),
+# replies repeat the opcode of the call. REQUEST and RETURN start and end a
+# request. None when the frame is never sent that way.
+OPCODES = [
+    ("GET_ITEM", 1, "ipc_get_item", [("item_type", "int")], [("retval", "int"), ("item", "item")]),
+    ("SET_ITEM", 2, "ipc_set_item", [("items", List("new_item"))], None),
+    ("GET_USER", 3, "ipc_get_user", [("prompt", Optional("string"))],
+     [("retval", "int"), ("user", Optional("string"))]),
+    ("CONVERSE", 4, "ipc_converse", [("msgs", List("prompt"))], [("retval", "int"), ("responses", List("response"))]),
+    ("FAIL_DELAY", 5, "ipc_fail_delay", [("usec", "int")], [("retval", "int")]),
+    ("STRERROR", 6, "ipc_strerror", [("err_num", "int")], [("description", "string")]),
+    ("SYSLOG", 7, "ipc_syslog", [("records", List("log_record"))], None),
+    ("REQUEST", 8, None, None, [("fn_name", "string"), ("flags", "int"), ("log_level", "int"), ("args", List("string")),
+                                ("items", List("item"))]),
+    ("RETURN", 9, None, [("retval", "int")], None),
+]
+
+# Constants of the PAM headers available as PamHandle attributes
+PAM_CONSTANTS = [
+    ("Return values", [
+        "PAM_SUCCESS",
+        "PAM_OPEN_ERR",
+        "PAM_SYMBOL_ERR",
+        "PAM_SERVICE_ERR",
+        "PAM_SYSTEM_ERR",
+        "PAM_BUF_ERR",
+        "PAM_PERM_DENIED",
+        "PAM_AUTH_ERR",
+        "PAM_CRED_INSUFFICIENT",
+        "PAM_AUTHINFO_UNAVAIL",
+        "PAM_USER_UNKNOWN",
+        "PAM_MAXTRIES",
+        "PAM_NEW_AUTHTOK_REQD",
+        "PAM_ACCT_EXPIRED",
+        "PAM_SESSION_ERR",
+        "PAM_CRED_UNAVAIL",
+        "PAM_CRED_EXPIRED",
+        "PAM_CRED_ERR",
+        "PAM_NO_MODULE_DATA",
+        "PAM_CONV_ERR",
+        "PAM_AUTHTOK_ERR",
+        "PAM_AUTHTOK_RECOVERY_ERR",
+        "PAM_AUTHTOK_LOCK_BUSY",
+        "PAM_AUTHTOK_DISABLE_AGING",
+        "PAM_TRY_AGAIN",
+        "PAM_IGNORE",
+        "PAM_ABORT",
+        "PAM_AUTHTOK_EXPIRED",
+        "PAM_MODULE_UNKNOWN",
+        "PAM_BAD_ITEM",
+        "PAM_CONV_AGAIN",
+        "PAM_INCOMPLETE",
+    ]),
+    ("Flags", [
+        "PAM_SILENT",
+        "PAM_DISALLOW_NULL_AUTHTOK",
+        "PAM_ESTABLISH_CRED",
+        "PAM_DELETE_CRED",
+        "PAM_REINITIALIZE_CRED",
+        "PAM_REFRESH_CRED",
+        "PAM_CHANGE_EXPIRED_AUTHTOK",
+    ]),
+    ("Internal flags", [
+        "PAM_PRELIM_CHECK",
+        "PAM_UPDATE_AUTHTOK",
+    ]),
+    ("Item types", [
+        "PAM_SERVICE",
+        "PAM_USER",
+        "PAM_TTY",
+        "PAM_RHOST",
+        "PAM_CONV",
+        "PAM_AUTHTOK",
+        "PAM_OLDAUTHTOK",
+        "PAM_RUSER",
+        "PAM_USER_PROMPT",
+    ]),
+    ("Linux-PAM item type extensions", [
+        "PAM_FAIL_DELAY",
+        "PAM_XDISPLAY",
+        "PAM_XAUTHDATA",
+        "PAM_AUTHTOK_TYPE",
+    ]),
+    ("Message styles (pam_message)", [
+        "PAM_PROMPT_ECHO_OFF",
+        "PAM_PROMPT_ECHO_ON",
+        "PAM_ERROR_MSG",
+        "PAM_TEXT_INFO",
+    ]),
+    ("Linux-PAM message style extensions", [
+        "PAM_RADIO_TYPE",
+        "PAM_BINARY_PROMPT",
+    ]),
+    ("Linux-PAM pam_set_data cleanup error_status", [
+        "PAM_DATA_REPLACE",
+        "PAM_DATA_SILENT",
+    ]),
+]
+
+# pam_sm_* functions as (name, default error, shed error). The default error
+# is returned when the handler is missing or fails (based on pam_deny.so), the
+# shed error when admission control turns the call away (see admission.h):
+# the service is unavailable rather than the credentials wrong.
+PAM_FUNCTIONS = [
+    ("pam_sm_authenticate", "PAM_AUTH_ERR", "PAM_AUTHINFO_UNAVAIL"),
+    ("pam_sm_setcred", "PAM_CRED_ERR", "PAM_CRED_UNAVAIL"),
+    ("pam_sm_acct_mgmt", "PAM_AUTH_ERR", "PAM_AUTHINFO_UNAVAIL"),
+    ("pam_sm_open_session", "PAM_SESSION_ERR", "PAM_SESSION_ERR"),
+    ("pam_sm_close_session", "PAM_SESSION_ERR", "PAM_SESSION_ERR"),
+    ("pam_sm_chauthtok", "PAM_AUTHTOK_ERR", "PAM_TRY_AGAIN"),
+]
+
+
+def opcode_name(name):
+    return f"PAM_PYTHON_{name}"
+
+
+def padded(names):
+    width = max(len(name) for name in names)
+    return lambda name: name.ljust(width)
+
+
+def constant_lines(line):
+    """line(name) for every constant, preceded by the comment of its group"""
+    lines = []
+    for comment, names in PAM_CONSTANTS:
+        lines.append(f"# {comment}")
+        lines += [line(name) for name in names]
+    return lines
+
+
+def c_opcodes():
+    pad = padded([opcode_name(name) for name, *_ in OPCODES])
+    lines = [f"#define {pad(opcode_name(name))} {opcode}" for name, opcode, *_ in OPCODES]
+    count = max(opcode for _, opcode, *_ in OPCODES) + 1
+    return lines + ["", "// One past the largest opcode", f"#define PAM_PYTHON_OPCODE_COUNT {count}"]
+
+
+def c_handlers():
+    lines = ["const ipc_handler ipc_handlers[PAM_PYTHON_OPCODE_COUNT] = {"]
+    lines += [f"  [{opcode_name(name)}] = {handler}," for name, _, handler, *_ in OPCODES if handler]
+    return lines + ["};"]
+
+
+def c_error_function(name, column):
+    lines = [f"int {name}(char *pam_fn_name) {{"]
+    for i, function in enumerate(PAM_FUNCTIONS):
+        branch = "if" if i == 0 else "} else if"
+        lines.append(f'  {branch} (strcmp(pam_fn_name, "{function[0]}") == 0) {{')
+        lines.append(f"    return {function[column]};")
+    return lines + ["  }", "  return PAM_ABORT;", "}"]
+
+
+def c_errors():
+    return c_error_function("get_default_err", 1) + [""] + c_error_function("get_shed_err", 2)
+
+
+BASIC_TYPES = ("int", "string", "bytes")
+
+
+def variant_types(variant):
+    return list(dict.fromkeys([*variant.cases.values(), variant.default]))
+
+
+def records_in(fields):
+    """Names of the records the fields refer to, directly or not"""
+    names = []
+
+    def visit(t):
+        if isinstance(t, (Optional, List)):
+            visit(t.type)
+        elif isinstance(t, Variant):
+            for case in variant_types(t):
+                visit(case)
+        elif t not in BASIC_TYPES and t not in names:
+            for _, field_type in RECORDS[t][1]:
+                visit(field_type)
+            names.append(t)
+
+    for _, t in fields:
+        visit(t)
+    return names
+
+
+def payloads(direction):
+    """(opcode name, fields) of the payloads sent to the PAM host (0) or to the Python process (1)"""
+    return [(name.lower(), payload[direction]) for name, _, _, *payload in OPCODES if payload[direction] is not None]
+
+
+def used_records(direction):
+    """Records of the payloads sent that way, in the order of RECORDS"""
+    used = {record for _, fields in payloads(direction) for record in records_in(fields)}
+    return [name for name in RECORDS if name in used]
+
+
+def min_size(t):
+    """Fewest bytes a value of type t takes"""
+    if isinstance(t, Variant):
+        return min(min_size(case) for case in variant_types(t))
+    elif t in RECORDS:
+        return sum(min_size(field_type) for _, field_type in RECORDS[t][1])
+    return 4
+
+
+def has_type(fields, predicate):
+    def visit(t):
+        if predicate(t):
+            return True
+        elif isinstance(t, (Optional, List)):
+            return visit(t.type)
+        elif isinstance(t, Variant):
+            return any(visit(case) for case in variant_types(t))
+        return False
+
+    return any(visit(t) for _, t in fields)
+
+
+def c_type(t):
+    return {"int": "int", "string": "const char *", "bytes": "struct ipc_bytes"}.get(t, f"struct ipc_{t}")
+
+
+def c_declaration(t, name):
+    ctype = c_type(t)
+    return f"{ctype}{name}" if ctype.endswith("*") else f"{ctype} {name}"
+
+
+def c_members(name, t):
+    if isinstance(t, List):
+        return [f"int {name}_count;", f"{c_declaration(t.type, '*' + name)};"]
+    elif isinstance(t, Optional):
+        return [f"bool has_{name};"] + c_members(name, t.type)
+    elif isinstance(t, Variant):
+        return ["union {"] + [f"  {c_declaration(case, case)};" for case in variant_types(t)] + [f"}} {name};"]
+    return [f"{c_declaration(t, name)};"]
+
+
+def c_struct(name, fields):
+    lines = [f"struct {name} {{"]
+    for field, t in fields:
+        lines += [f"  {line}" for line in c_members(field, t)]
+    return lines + ["};"]
+
+
+def c_block(condition, body, indent):
+    return [f"{indent}if ({condition}) {{"] + body + [f"{indent}}}"]
+
+
+def c_variant(prefix, name, t, indent, value_lines):
+    """value_lines(target, type, indent) for the case picked by the field of t"""
+    lines = []
+    for i, (constant, case) in enumerate(t.cases.items()):
+        branch = "if" if i == 0 else "} else if"
+        lines.append(f"{indent}{branch} ({prefix}{t.field} == {constant}) {{")
+        lines += value_lines(f"{prefix}{name}.{case}", case, indent + "  ")
+    lines.append(f"{indent}}} else {{")
+    lines += value_lines(f"{prefix}{name}.{t.default}", t.default, indent + "  ")
+    return lines + [f"{indent}}}"]
+
+
+def c_checked(call, indent):
+    return [f"{indent}status = {call};", f"{indent}OK(status);"]
+
+
+def c_decode_value(target, t, indent):
+    if t == "int":
+        return c_checked(f"ipc_get_int(frame, &{target})", indent)
+    elif t == "string":
+        return c_checked(f"get_string(arena, frame, &{target})", indent)
+    elif t == "bytes":
+        return c_checked(f"ipc_get_data(frame, &{target}.data, &{target}.length)", indent)
+    return c_checked(f"decode_{t}(frame, arena, &{target})", indent)
+
+
+def c_decode(prefix, name, t, indent):
+    target = f"{prefix}{name}"
+    if isinstance(t, List):
+        # Fewer bytes than the elements take at least is a protocol error, not an allocation
+        too_many = f"(size_t){target}_count > (frame->length - frame->pos) / {min_size(t.type)}"
+        return (c_checked(f"ipc_get_int(frame, &{target}_count)", indent) +
+                c_block(f"{target}_count < 0 || {too_many}", [f"{indent}  return READ_ERR;"], indent) +
+                [f"{indent}{target} = ipc_arena_alloc(arena, (size_t){target}_count * sizeof(*{target}));"] +
+                c_block(f"!{target}", [f"{indent}  return MALLOC_ERR;"], indent) +
+                [f"{indent}for (int i = 0; i < {target}_count; i++) {{"] +
+                c_decode_value(f"{target}[i]", t.type, indent + "  ") + [f"{indent}}}"])
+    elif isinstance(t, Optional):
+        return (c_checked("ipc_get_int(frame, &set)", indent) + [f"{indent}{prefix}has_{name} = set;"] +
+                c_block(f"{prefix}has_{name}", c_decode(prefix, name, t.type, indent + "  "), indent))
+    elif isinstance(t, Variant):
+        return c_variant(prefix, name, t, indent, c_decode_value)
+    return c_decode_value(target, t, indent)
+
+
+def c_encode_value(target, t, indent):
+    if t == "int":
+        return c_checked(f"ipc_put_int(m, {target})", indent)
+    elif t == "string":
+        return c_checked(f"ipc_put_string(m, {target})", indent)
+    elif t == "bytes":
+        return c_checked(f"ipc_put_data(m, {target}.data, {target}.length)", indent)
+    return c_checked(f"encode_{t}(m, &{target})", indent)
+
+
+def c_encode(prefix, name, t, indent):
+    target = f"{prefix}{name}"
+    if isinstance(t, List):
+        return (c_checked(f"ipc_put_int(m, {target}_count)", indent) +
+                [f"{indent}for (int i = 0; i < {target}_count; i++) {{"] +
+                c_encode_value(f"{target}[i]", t.type, indent + "  ") + [f"{indent}}}"])
+    elif isinstance(t, Optional):
+        return (c_checked(f"ipc_put_int(m, {prefix}has_{name})", indent) +
+                c_block(f"{prefix}has_{name}", c_encode(prefix, name, t.type, indent + "  "), indent))
+    elif isinstance(t, Variant):
+        return c_variant(prefix, name, t, indent, c_encode_value)
+    return c_encode_value(target, t, indent)
+
+
+def c_size_value(target, t, indent):
+    if t == "int":
+        return [f"{indent}size += sizeof(int32_t);"]
+    elif t == "string":
+        return [f"{indent}size += sizeof(int32_t) + strlen({target});"]
+    elif t == "bytes":
+        return [f"{indent}size += sizeof(int32_t) + {target}.length;"]
+    return [f"{indent}size += encoded_{t}_size(&{target});"]
+
+
+def c_size(prefix, name, t, indent):
+    target = f"{prefix}{name}"
+    if isinstance(t, List):
+        return ([f"{indent}size += sizeof(int32_t);", f"{indent}for (int i = 0; i < {target}_count; i++) {{"] +
+                c_size_value(f"{target}[i]", t.type, indent + "  ") + [f"{indent}}}"])
+    elif isinstance(t, Optional):
+        return ([f"{indent}size += sizeof(int32_t);"] +
+                c_block(f"{prefix}has_{name}", c_size(prefix, name, t.type, indent + "  "), indent))
+    elif isinstance(t, Variant):
+        return c_variant(prefix, name, t, indent, c_size_value)
+    return c_size_value(target, t, indent)
+
+
+def c_decode_function(signature, fields):
+    lines = [f"{signature} {{", "  int status;"]
+    if has_type(fields, lambda t: isinstance(t, Optional)):
+        lines.append("  int set;")
+    if not has_type(fields, lambda t: t not in ("int", "bytes") and not isinstance(t, (Optional, Variant))):
+        lines.append("  (void)arena;")
+    for name, t in fields:
+        lines += c_decode("r->", name, t, "  ")
+    return lines + ["  return SUCCESS;", "}"]
+
+
+def c_encode_function(signature, fields):
+    lines = [f"{signature} {{", "  int status;"]
+    for name, t in fields:
+        lines += c_encode("r->", name, t, "  ")
+    return lines + ["  return SUCCESS;", "}"]
+
+
+def c_size_function(signature, fields):
+    lines = [f"{signature} {{", "  size_t size = 0;"]
+    if not has_type(fields, lambda t: t != "int"):
+        lines.append("  (void)r;")
+    for name, t in fields:
+        lines += c_size("r->", name, t, "  ")
+    return lines + ["  return size;", "}"]
+
+
+def c_decode_signature(name, struct):
+    return f"int {name}(struct ipc_frame *frame, struct ipc_arena *arena, struct {struct} *r)"
+
+
+def c_encode_signature(name, struct):
+    return f"int {name}(struct ipc_message *m, const struct {struct} *r)"
+
+
+def c_size_signature(name, struct):
+    return f"size_t {name}(const struct {struct} *r)"
+
+
+def c_messages():
+    lines = []
+    for name, (_, fields) in RECORDS.items():
+        lines += c_struct(f"ipc_{name}", fields) + [""]
+
+    for suffix, direction in (("to_host", 0), ("to_python", 1)):
+        for name, fields in payloads(direction):
+            lines += c_struct(f"ipc_{name}_{suffix}", fields) + [""]
+
+    lines.append("// Decode the payloads sent to the PAM host, strings are copied into arena")
+    for name, _ in payloads(0):
+        lines.append(c_decode_signature(f"ipc_decode_{name}", f"ipc_{name}_to_host") + ";")
+    lines += ["", "// Encode the payloads sent to the Python process, _size() is the length of the payload"]
+    for name, _ in payloads(1):
+        lines.append(c_encode_signature(f"ipc_encode_{name}", f"ipc_{name}_to_python") + ";")
+        lines.append(c_size_signature(f"ipc_{name}_size", f"ipc_{name}_to_python") + ";")
+    return lines
+
+
+def c_codec():
+    lines = []
+    for name in used_records(0):
+        lines += c_decode_function("static " + c_decode_signature(f"decode_{name}", f"ipc_{name}"), RECORDS[name][1])
+        lines.append("")
+    for name in used_records(1):
+        lines += c_encode_function("static " + c_encode_signature(f"encode_{name}", f"ipc_{name}"), RECORDS[name][1])
+        lines.append("")
+        lines += c_size_function("static " + c_size_signature(f"encoded_{name}_size", f"ipc_{name}"), RECORDS[name][1])
+        lines.append("")
+    for name, fields in payloads(0):
+        lines += c_decode_function(c_decode_signature(f"ipc_decode_{name}", f"ipc_{name}_to_host"), fields) + [""]
+    for name, fields in payloads(1):
+        lines += c_encode_function(c_encode_signature(f"ipc_encode_{name}", f"ipc_{name}_to_python"), fields) + [""]
+        lines += c_size_function(c_size_signature(f"ipc_{name}_size", f"ipc_{name}_to_python"), fields) + [""]
+    return lines[:-1]
+
+
+def py_variant(t, indent, value_lines, target):
+    lines = []
+    for i, (constant, case) in enumerate(t.cases.items()):
+        branch = "if" if i == 0 else "elif"
+        lines.append(f"{indent}{branch} {t.field} == {constant}:")
+        lines += value_lines(target, case, indent + "    ")
+    lines.append(f"{indent}else:")
+    return lines + value_lines(target, t.default, indent + "    ")
+
+
+def py_encode_value(expr, t, indent):
+    if t == "int":
+        return [f"{indent}payload.put_int({expr})"]
+    elif t == "string":
+        return [f"{indent}payload.put_string({expr})"]
+    elif t == "bytes":
+        return [f"{indent}payload.put_bytes({expr})"]
+    return [f"{indent}_encode_{t}(payload, {expr})"]
+
+
+def py_encode(expr, t, indent):
+    if isinstance(t, List):
+        return ([f"{indent}payload.put_int(len({expr}))", f"{indent}for element in {expr}:"] +
+                py_encode_value("element", t.type, indent + "    "))
+    elif isinstance(t, Optional):
+        return ([f"{indent}payload.put_int({expr} is not None)", f"{indent}if {expr} is not None:"] +
+                py_encode(expr, t.type, indent + "    "))
+    elif isinstance(t, Variant):
+        return py_variant(t, indent, py_encode_value, expr)
+    return py_encode_value(expr, t, indent)
+
+
+def py_decoded_value(t):
+    if t in BASIC_TYPES:
+        return f"reader.get_{t}()"
+    return f"_decode_{t}(reader)"
+
+
+def py_decode_value(target, t, indent):
+    return [f"{indent}{target} = {py_decoded_value(t)}"]
+
+
+def py_decode(target, t, indent):
+    if isinstance(t, List):
+        return [f"{indent}{target} = [{py_decoded_value(t.type)} for _ in range(reader.get_int())]"]
+    elif isinstance(t, Optional):
+        return ([f"{indent}{target} = None", f"{indent}if reader.get_int():"] +
+                py_decode(target, t.type, indent + "    "))
+    elif isinstance(t, Variant):
+        return py_variant(t, indent, py_decode_value, target)
+    return py_decode_value(target, t, indent)
+
+
+def py_encode_body(fields):
+    lines = ["    cdef Payload payload = Payload()"]
+    for name, t in fields:
+        lines += py_encode(name, t, "    ")
+    return lines + ["    return payload"]
+
+
+def py_decode_body(fields):
+    lines = []
+    for name, t in fields:
+        lines += py_decode(name, t, "    ")
+    return lines
+
+
+def pyx_codec():
+    lines = []
+    for name in used_records(0):
+        cls, fields = RECORDS[name]
+        lines.append(f"cdef _encode_{name}(Payload payload, record):")
+        if cls:
+            lines += [f"    {field} = record.{field}" for field, _ in fields]
+        else:
+            lines.append(f"    {', '.join(field for field, _ in fields)} = record")
+        lines += py_encode_body(fields)[1:-1] + ["", ""]
+    for name in used_records(1):
+        cls, fields = RECORDS[name]
+        lines.append(f"cdef _decode_{name}(PayloadReader reader):")
+        lines += py_decode_body(fields)
+        if cls:
+            lines.append(f"    return {cls}({', '.join(f'{field}={field}' for field, _ in fields)})")
+        else:
+            lines.append(f"    return {', '.join(field for field, _ in fields)}")
+        lines += ["", ""]
+
+    for name, fields in payloads(0):
+        lines.append(f"def encode_{name}({', '.join(field for field, _ in fields)}):")
+        lines += py_encode_body(fields) + ["", ""]
+    for name, fields in payloads(1):
+        lines.append(f"def decode_{name}(PayloadReader reader):")
+        lines += py_decode_body(fields)
+        lines.append(f"    return {', '.join(field for field, _ in fields)}")
+        lines += ["", ""]
+    return lines[:-2]
+
+
+def pyx_opcodes():
+    return [f"cdef int {opcode_name(name)}" for name, *_ in OPCODES]
+
+
+def pyx_constants():
+    return constant_lines(lambda name: f"cdef int {name}")
+
+
+def pyx_constant_table():
+    return ["_pam_constants = {"] + [f'    "{name}": {name},' for _, names in PAM_CONSTANTS for name in names] + ["}"]
+
+
+def pyx_class_constants():
+    pad = padded([name for _, names in PAM_CONSTANTS for name in names])
+    return constant_lines(lambda name: f'{pad(name)} = _pam_constants["{name}"]')
+
+
+def pyx_default_errors():
+    return ["default_errors = {"] + [f'    "{name}": {default},' for name, default, _ in PAM_FUNCTIONS] + ["}"]
+
+
+def pyi_class_constants():
+    pad = padded([name for _, names in PAM_CONSTANTS for name in names])
+    return constant_lines(lambda name: f"{pad(name)} : int")
+
+
+# File: {region: generator}
+TARGETS = {
+    "pam.h": {"opcodes": c_opcodes, "messages": c_messages},
+    "pam.c": {"errors": c_errors, "codec": c_codec, "handlers": c_handlers},
+    "pam_python.pyx": {
+        "constants": pyx_constants,
+        "opcodes": pyx_opcodes,
+        "codec": pyx_codec,
+        "constant table": pyx_constant_table,
+        "class constants": pyx_class_constants,
+        "default errors": pyx_default_errors,
+    },
+    "pam_python.pyi": {"class constants": pyi_class_constants},
+}
+
+
+def generate(text, path, regions):
+    comment = "//" if path.suffix in (".c", ".h") else "#"
+
+    for region, generator in regions.items():
+        pattern = re.compile(
+            rf"^(?P<indent>[ \t]*){comment} BEGIN GENERATED by make\.py: {re.escape(region)}\n"
+            rf".*?"
+            rf"^[ \t]*{comment} END GENERATED: {re.escape(region)}\n",
+            re.M | re.S)
+
+        def render(match):
+            indent = match["indent"]
+            lines = [f"{comment} BEGIN GENERATED by make.py: {region}"]
+            lines += generator()
+            lines += [f"{comment} END GENERATED: {region}"]
+            return "".join(f"{indent}{line}\n" if line else "\n" for line in lines)
+
+        text, count = pattern.subn(render, text)
+        if count != 1:
+            raise SystemExit(f"{path}: expected one region '{region}', found {count}")
+    return text
+
+
+def main():
+    check = "--check" in sys.argv[1:]
+    outdated = []
+
+    for name, regions in TARGETS.items():
+        path = SRC / name
+        text = path.read_text()
+        new_text = generate(text, path, regions)
+        if new_text != text:
+            outdated.append(name)
+            if not check:
+                path.write_text(new_text)
+
+    if check and outdated:
+        print(f"Out of date, run make.py: {', '.join(outdated)}", file=sys.stderr)
+        return 1
+    for name in outdated:
+        print(f"Updated {name}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
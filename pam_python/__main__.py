@@ -0,0 +1,82 @@
+from pathlib import Path
+
+import click
+
+from pam_python import _get_lib_path
+from pam_python.daemon import DEFAULT_SOCKET
+
+
+@click.group()
+def cli():
+    pass
+
+
+@cli.command()
+def libpath():
+    """Get the shared lib path."""
+    click.echo(_get_lib_path())
+
+
+@cli.command("print-config")
+@click.argument("filename", type=click.Path(exists=True))
+def config(filename):
+    """Create and print a dummy PAM config file."""
+    lib_path = _get_lib_path()
+    file_path = Path(filename).resolve()
+    click.echo(f"account\trequired\t{lib_path} {file_path}")
+    click.echo(f"auth\trequired\t{lib_path} {file_path}")
+    click.echo(f"session\trequired\t{lib_path} {file_path}")
+    click.echo(f"password\trequired\t{lib_path} {file_path}")
+
+
+@cli.command("compile")
+@click.argument("modules", nargs=-1, required=True, type=click.Path(exists=True, dir_okay=False))
+@click.option("--no-import", "no_import", is_flag=True,
+              help="Only compile, the first worker importing a module records its handlers")
+def compile_modules(modules, no_import):
+    """Compile Python PAM modules into the bytecode cache.
+
+    The modules are also imported to record which handlers they define:
+    their top-level code runs in this process, as root. Pass --no-import
+    to compile them without running anything.
+    """
+    from pam_python.cache import compile_module
+    from pam_python.pam_python import _load_module
+    for module_path in modules:
+        try:
+            entry = compile_module(str(Path(module_path).resolve()))
+            if not no_import:
+                _load_module(str(Path(module_path).resolve()))
+        except Exception as e:
+            raise click.ClickException(f"{module_path}: {e}")
+        click.echo(f"{module_path} -> {entry}")
+
+
+@cli.command()
+@click.option("--socket", "socket_path", default=DEFAULT_SOCKET, show_default=True,
+              help="Path of the Unix socket to listen on")
+@click.option("--preload", multiple=True, type=click.Path(exists=True),
+              help="Python PAM module to import at startup, can be repeated")
+def daemon(socket_path, preload):
+    """Serve PAM modules configured with mode=daemon."""
+    from pam_python.daemon import serve
+    serve(socket_path, [str(Path(module_path).resolve()) for module_path in preload])
+
+
+@cli.command()
+@click.option("--uid", type=int, help="User the PAM hosts run as, defaults to the current one")
+def stats(uid):
+    """Print the admission control counters (max_inflight=)."""
+    from pam_python.admission import read_stats, region_path
+    path = region_path(uid)
+    try:
+        counters = read_stats(path)
+    except FileNotFoundError:
+        raise click.ClickException(f"{path} does not exist, no call with max_inflight= was made yet")
+    except (OSError, ValueError) as e:
+        raise click.ClickException(str(e))
+    for name, value in counters.items():
+        click.echo(f"{name}\t{value}")
+
+
+cli()
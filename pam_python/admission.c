@@ -0,0 +1,208 @@
+#include "admission.h"
+
+#include <limits.h>
+
+// How often a waiting call looks for slots of processes which died holding them
+#define RECLAIM_CHECK_MS 100
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct admission_region *region;
+static bool map_failed;
+
+// The call running on this thread, its slot is handed back while it converses
+static __thread int current_slot = ADMISSION_UNLIMITED;
+static __thread const struct pam_python_options *current_opts;
+static __thread bool paused;
+
+static void futex_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void futex_wait(uint32_t *word, uint32_t expected, long timeout_ms) {
+  struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  // Not FUTEX_WAIT_PRIVATE, the waiters are in other processes
+  syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static struct admission_region *map_region(pam_handle_t *pamh) {
+  char path[PATH_MAX];
+  struct stat st;
+
+  if (!runtime_dir_ok(pamh)) {
+    return NULL;
+  }
+  snprintf(path, sizeof(path), "%s/admission-%u", PAM_PYTHON_RUNTIME_DIR, (unsigned)geteuid());
+
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to open %s: %m", path);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & 077)) {
+    pam_syslog(pamh, LOG_ERR, "Refusing to use %s, it is accessible by other users", path);
+    close(fd);
+    return NULL;
+  }
+  // Processes creating the file at the same time all extend it to the same size
+  if (st.st_size < (off_t)sizeof(struct admission_region) && ftruncate(fd, sizeof(struct admission_region)) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to resize %s: %m", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct admission_region *r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (r == MAP_FAILED) {
+    pam_syslog(pamh, LOG_ERR, "Failed to map %s: %m", path);
+    return NULL;
+  }
+
+  uint32_t fresh = 0;
+  __atomic_compare_exchange_n(&r->magic, &fresh, ADMISSION_MAGIC, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  if (r->magic != ADMISSION_MAGIC) {
+    pam_syslog(pamh, LOG_ERR, "%s is not an admission region", path);
+    munmap(r, sizeof(*r));
+    return NULL;
+  }
+  return r;
+}
+
+// The region of the process, mapped by the first call with a limit. Calls are
+// admitted without a slot when it cannot be used, admission control only
+// protects the host and must not lock users out.
+static struct admission_region *get_region(pam_handle_t *pamh) {
+  pthread_mutex_lock(&map_lock);
+  if (!region && !map_failed) {
+    region = map_region(pamh);
+    map_failed = region == NULL;
+  }
+  pthread_mutex_unlock(&map_lock);
+  return region;
+}
+
+static void notify(struct admission_region *r) {
+  __atomic_add_fetch(&r->releases, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&r->releases);
+  }
+}
+
+static int claim(struct admission_region *r, int limit, int32_t pid) {
+  for (int i = 0; i < limit; i++) {
+    int32_t free_slot = 0;
+    if (__atomic_load_n(&r->slots[i], __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&r->slots[i], &free_slot, pid, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Free the slots of PAM hosts which died in the middle of a call (killed by
+// the OOM killer, say), they would otherwise lower the limit for good
+static void reclaim(struct admission_region *r, int limit) {
+  for (int i = 0; i < limit; i++) {
+    int32_t pid = __atomic_load_n(&r->slots[i], __ATOMIC_RELAXED);
+    if (pid != 0 && kill(pid, 0) != 0 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&r->slots[i], &pid, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      notify(r);
+    }
+  }
+}
+
+static int admitted(struct admission_region *r, int slot) {
+  __atomic_add_fetch(&r->admitted, 1, __ATOMIC_RELAXED);
+  return slot;
+}
+
+static int shed(struct admission_region *r) {
+  __atomic_add_fetch(&r->shed, 1, __ATOMIC_RELAXED);
+  return ADMISSION_SHED;
+}
+
+// Take a slot, waiting up to queue_wait milliseconds. -1 when none became free.
+static int wait_for_slot(struct admission_region *r, const struct pam_python_options *opts, int32_t pid) {
+  long deadline = now_ms() + opts->queue_wait;
+  for (;;) {
+    // A slot freed after this load changes releases, the wait then returns right away
+    uint32_t seen = __atomic_load_n(&r->releases, __ATOMIC_SEQ_CST);
+    int slot = claim(r, opts->max_inflight, pid);
+    if (slot >= 0) {
+      return slot;
+    }
+
+    long remaining = deadline - now_ms();
+    if (remaining <= 0) {
+      return -1;
+    }
+    __atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&r->releases, seen, remaining < RECLAIM_CHECK_MS ? remaining : RECLAIM_CHECK_MS);
+    __atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    reclaim(r, opts->max_inflight);
+  }
+}
+
+static void free_slot(int slot) {
+  __atomic_store_n(&region->slots[slot], 0, __ATOMIC_SEQ_CST);
+  notify(region);
+}
+
+int admission_acquire(pam_handle_t *pamh, const struct pam_python_options *opts) {
+  if (opts->max_inflight == 0) {
+    return ADMISSION_UNLIMITED;
+  }
+  struct admission_region *r = get_region(pamh);
+  if (!r) {
+    return ADMISSION_UNLIMITED;
+  }
+
+  int32_t pid = getpid();
+  int slot = claim(r, opts->max_inflight, pid);
+  if (slot < 0) {
+    reclaim(r, opts->max_inflight);
+    if (opts->queue_wait > 0) {
+      __atomic_add_fetch(&r->queued, 1, __ATOMIC_RELAXED);
+    }
+    slot = wait_for_slot(r, opts, pid);
+  }
+  if (slot < 0) {
+    return shed(r);
+  }
+  current_slot = slot;
+  current_opts = opts;
+  return admitted(r, slot);
+}
+
+void admission_release(void) {
+  if (current_slot >= 0) {
+    free_slot(current_slot);
+  }
+  current_slot = ADMISSION_UNLIMITED;
+  current_opts = NULL;
+  paused = false;
+}
+
+void admission_pause(void) {
+  if (current_slot >= 0) {
+    free_slot(current_slot);
+    current_slot = ADMISSION_UNLIMITED;
+    paused = true;
+  }
+}
+
+void admission_resume(void) {
+  if (!paused) {
+    return;
+  }
+  paused = false;
+  // The call was admitted already, the user who just answered is not turned
+  // away: without a free slot within queue_wait it goes on over the limit
+  int slot = wait_for_slot(region, current_opts, getpid());
+  current_slot = slot >= 0 ? slot : ADMISSION_UNLIMITED;
+}
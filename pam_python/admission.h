@@ -0,0 +1,70 @@
+#ifndef _PAM_PYTHON_ADMISSION_H
+#define _PAM_PYTHON_ADMISSION_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "sock.h"
+
+// Admission control (max_inflight= option): a limit on the pam_sm_* calls
+// executing Python at the same time, shared by every PAM host process of the
+// user through a small file in PAM_PYTHON_RUNTIME_DIR. A call over the limit
+// waits for up to queue_wait= milliseconds, then it is shed.
+//
+// A call gives its slot back while it waits for the user to answer a
+// conversation (see admission_pause()), so clients idling at a prompt do not
+// use up the limit for everyone else.
+//
+// The region is read by `python -m pam_python stats`, keep admission.py in sync.
+
+#define ADMISSION_MAGIC 0x70796d32
+
+struct admission_region {
+  uint32_t magic;
+  // Bumped whenever a slot is freed, futex word of the waiting calls
+  uint32_t releases;
+  // Number of calls sleeping on releases, saves the wake-up syscall otherwise
+  uint32_t waiting;
+  uint32_t reserved;
+  uint64_t admitted;
+  // Admitted or shed after waiting
+  uint64_t queued;
+  uint64_t shed;
+  // Process holding each slot, 0 when it is free
+  int32_t slots[PAM_PYTHON_ADMISSION_SLOTS];
+};
+
+// Returned instead of a slot when there is no limit (or the region is not usable)
+#define ADMISSION_UNLIMITED -1
+// The call was shed
+#define ADMISSION_SHED -2
+
+// Take a slot for the call running on this thread, waiting as configured.
+// Returns ADMISSION_SHED when the call has to be turned away.
+// opts must stay valid until admission_release().
+int admission_acquire(pam_handle_t *pamh, const struct pam_python_options *opts);
+
+// Give back the slot of the call running on this thread, if it has one
+void admission_release(void);
+
+// Around a conversation: give the slot back, then take one again. A call which
+// finds no free slot within queue_wait afterwards goes on without one.
+void admission_pause(void);
+void admission_resume(void);
+
+#endif
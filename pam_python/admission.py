@@ -0,0 +1,40 @@
+"""Counters of the admission control of the PAM module (max_inflight= option)
+
+Every PAM host process of a user shares one region in RUNTIME_DIR, the layout
+is struct admission_region of admission.h.
+"""
+
+import os
+import struct
+
+
+RUNTIME_DIR = "/run/pam_python"
+MAX_SLOTS = 1024
+
+_MAGIC = 0x70796D32
+# magic, releases, waiting, reserved, admitted, queued, shed
+_HEADER = struct.Struct("=IIIIQQQ")
+_SLOTS = struct.Struct(f"={MAX_SLOTS}i")
+
+
+def region_path(uid=None):
+    return os.path.join(RUNTIME_DIR, f"admission-{os.geteuid() if uid is None else uid}")
+
+
+def read_stats(path):
+    """Counters of the region at path, inflight is the number of taken slots"""
+    with open(path, "rb") as f:
+        data = f.read(_HEADER.size + _SLOTS.size)
+    if len(data) < _HEADER.size + _SLOTS.size:
+        raise ValueError(f"{path} is too short")
+    magic, _, waiting, _, admitted, queued, shed = _HEADER.unpack_from(data)
+    if magic != _MAGIC:
+        raise ValueError(f"{path} is not an admission region")
+    slots = _SLOTS.unpack_from(data, _HEADER.size)
+    return {
+        "inflight": sum(1 for pid in slots if pid != 0),
+        "waiting": waiting,
+        "admitted": admitted,
+        "queued": queued,
+        "shed": shed,
+    }
@@ -0,0 +1,172 @@
+"""Bytecode cache for the Python PAM modules
+
+PAM modules usually live in root-owned directories like /etc/security where
+__pycache__ is never written, so every worker would parse and compile the
+module again. Their bytecode is kept in CACHE_DIR instead, one entry per
+module. An entry is used when the size and mtime of the module match, or when
+its content hash still matches after the file was touched, its header then
+gets the new mtime without compiling the module again.
+
+Only root writes entries and the cache is only used when CACHE_DIR is a
+root-owned directory nobody else can write to. `python -m pam_python compile`
+fills it at deploy time.
+
+Next to the bytecode, a manifest of the handlers the module defines lets the
+PAM module answer calls of undefined handlers without starting Python (see
+manifest.h).
+"""
+
+import importlib.util
+import marshal
+import os
+import stat
+import struct
+import sys
+
+
+CACHE_DIR = "/var/cache/pam_python"
+
+# Bytecode magic number, mtime_ns and size of the module, SHA-256 of the module
+_HEADER = struct.Struct("<4sQQ32s")
+
+
+def _trusted(st):
+    return st.st_uid == 0 and not st.st_mode & (stat.S_IWGRP | stat.S_IWOTH)
+
+
+def _cache_usable():
+    try:
+        st = os.stat(CACHE_DIR)
+    except OSError:
+        return False
+    return stat.S_ISDIR(st.st_mode) and _trusted(st)
+
+
+def _cache_name(file_path):
+    real_path = os.path.realpath(file_path)
+    return os.path.join(CACHE_DIR, real_path.replace("%", "%25").replace("/", "%2F"))
+
+
+def _entry_path(file_path):
+    # Like __pycache__, different Python versions keep separate entries
+    return f"{_cache_name(file_path)}.{sys.implementation.cache_tag}.pyc"
+
+
+def _digest(source):
+    # Imported lazily, it is only needed when a module changed or was touched
+    import hashlib
+    return hashlib.sha256(source).digest()
+
+
+def _read_source(file_path):
+    with open(file_path, "rb") as f:
+        return f.read(), os.fstat(f.fileno())
+
+
+def _read_entry(entry, file_path, source_st):
+    """Return the cached code object and the entry to write back, if any
+
+    The code object is None when the entry can't be used. An entry whose module
+    was only touched is written back with the new mtime in its header.
+    """
+    try:
+        with open(entry, "rb") as f:
+            st = os.fstat(f.fileno())
+            if not _trusted(st) or st.st_size < _HEADER.size:
+                return None, None
+            data = f.read()
+
+        magic, mtime_ns, size, digest = _HEADER.unpack_from(data)
+        if magic != importlib.util.MAGIC_NUMBER or size != source_st.st_size:
+            return None, None
+
+        stale = mtime_ns != source_st.st_mtime_ns
+        if stale and _digest(_read_source(file_path)[0]) != digest:
+            return None, None
+
+        with memoryview(data) as view, view[_HEADER.size:] as body:
+            code = marshal.loads(body)
+        if not stale:
+            return code, None
+        return code, _HEADER.pack(magic, source_st.st_mtime_ns, size, digest) + data[_HEADER.size:]
+    except (OSError, ValueError, EOFError, TypeError):
+        return None, None
+
+
+def _compile(file_path):
+    source, st = _read_source(file_path)
+    code = compile(source, file_path, "exec", dont_inherit=True)
+    header = _HEADER.pack(importlib.util.MAGIC_NUMBER, st.st_mtime_ns, st.st_size, _digest(source))
+    return code, header
+
+
+def _write_file(path, data):
+    # Readers never see a partially written file
+    tmp = f"{path}.{os.getpid()}.tmp"
+    try:
+        fd = os.open(tmp, os.O_WRONLY | os.O_CREAT | os.O_EXCL | os.O_CLOEXEC, 0o600)
+        with os.fdopen(fd, "wb") as f:
+            f.write(data)
+        os.replace(tmp, path)
+    except OSError:
+        try:
+            os.unlink(tmp)
+        except OSError:
+            pass
+        raise
+
+
+def load_code(file_path):
+    """Return the code object of the module, or None if the cache can't be used"""
+    if not _cache_usable():
+        return None
+
+    entry = _entry_path(file_path)
+    code, update = _read_entry(entry, file_path, os.stat(file_path))
+    if os.geteuid() != 0 or (code is not None and update is None):
+        return code
+
+    if code is None:
+        code, header = _compile(file_path)
+        update = header + marshal.dumps(code)
+    try:
+        _write_file(entry, update)
+    except OSError:
+        pass
+    return code
+
+
+def store_manifest(file_path, identity, handlers):
+    """Record which handlers the module (as identified by _file_identity()) defines"""
+    if os.geteuid() != 0 or not _cache_usable():
+        return
+
+    dev, ino, size, mtime_ns = identity
+    data = f"{dev} {ino} {size} {mtime_ns}\n{' '.join(handlers)}\n".encode()
+    path = _cache_name(file_path) + ".handlers"
+    try:
+        with open(path, "rb") as f:
+            if f.read() == data:
+                return
+    except OSError:
+        pass
+
+    try:
+        _write_file(path, data)
+    except OSError:
+        pass
+
+
+def compile_module(file_path):
+    """Compile the module into the cache and return the path of its entry"""
+    if os.geteuid() != 0:
+        raise PermissionError("Only root can write the bytecode cache")
+
+    os.makedirs(CACHE_DIR, mode=0o700, exist_ok=True)
+    if not _cache_usable():
+        raise PermissionError(f"{CACHE_DIR} must be owned by root and not writable by anyone else")
+
+    entry = _entry_path(file_path)
+    code, header = _compile(file_path)
+    _write_file(entry, header + marshal.dumps(code))
+    return entry
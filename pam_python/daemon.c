@@ -0,0 +1,8 @@
+#include "daemon.h"
+
+int daemon_connect(pam_handle_t *pamh, const struct pam_python_options *opts) {
+  if (!socket_dir_ok(pamh, opts->daemon_socket)) {
+    return -1;
+  }
+  return connect_socket(opts->daemon_socket);
+}
@@ -0,0 +1,17 @@
+#ifndef _PAM_PYTHON_DAEMON_H
+#define _PAM_PYTHON_DAEMON_H
+
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <syslog.h>
+
+#include "options.h"
+#include "sock.h"
+
+// The daemon is started separately with `python -m pam_python daemon` and hosts
+// the interpreter and the user modules of every PAM service on the machine.
+//
+// Returns a socket connected to the daemon or -1 if it is not running.
+int daemon_connect(pam_handle_t *pamh, const struct pam_python_options *opts);
+
+#endif
@@ -0,0 +1,92 @@
+"""Daemon hosting the interpreter and the Python PAM modules
+
+pam_python.so configured with mode=daemon connects to it over a Unix socket
+instead of starting an interpreter in (a fork of) the PAM host. Every
+connection is served by a child forked off the daemon. Modules given with
+--preload are imported by the daemon itself, so every request for them
+starts from the same warm state; other modules are imported by each child.
+"""
+
+import os
+import signal
+import socket
+import struct
+import sys
+
+from pam_python.pam_python import IPCWrapper, _load_module, receive_request, serve_requests, stream_transport
+
+
+DEFAULT_SOCKET = "/run/pam_python/daemon.sock"
+# Seconds a client has to send its request before we give up on it
+REQUEST_TIMEOUT = 5
+
+
+def _peer_allowed(conn):
+    creds = conn.getsockopt(socket.SOL_SOCKET, socket.SO_PEERCRED, struct.calcsize("3i"))
+    _, uid, _ = struct.unpack("3i", creds)
+    return uid == 0 or uid == os.geteuid()
+
+
+def _set_timeout(conn, seconds):
+    # The descriptor is read directly, so use SO_RCVTIMEO rather than socket.settimeout()
+    conn.setsockopt(socket.SOL_SOCKET, socket.SO_RCVTIMEO, struct.pack("ll", seconds, 0))
+
+
+def _serve_connection(conn):
+    _set_timeout(conn, REQUEST_TIMEOUT)
+    ipc = IPCWrapper(stream_transport(conn.fileno()))
+    try:
+        request = receive_request(ipc)
+    except (OSError, ValueError) as e:
+        print(f"Failed to read request: {e}", file=sys.stderr)
+        return 1
+
+    if request is None:
+        return 0
+
+    # Conversations wait for the user, there is no upper bound on those
+    _set_timeout(conn, 0)
+    return serve_requests(ipc, 0, request)
+
+
+def _handle_connection(listener, conn):
+    if not _peer_allowed(conn):
+        return
+
+    # The request is read in the child, a client which sends nothing (or a
+    # module which is slow to import) only holds up its own connection
+    if os.fork() != 0:
+        return
+
+    status = 1
+    try:
+        # Handlers may wait for their own subprocesses
+        signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+        listener.close()
+        status = _serve_connection(conn)
+    finally:
+        os._exit(status)
+
+
+def serve(socket_path, preload=()):
+    for module_path in preload:
+        _load_module(module_path)
+
+    os.makedirs(os.path.dirname(socket_path), mode=0o700, exist_ok=True)
+    try:
+        os.unlink(socket_path)
+    except FileNotFoundError:
+        pass
+
+    os.umask(0o077)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(socket_path)
+    listener.listen(socket.SOMAXCONN)
+
+    # Children are never waited for, let the kernel reap them
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+
+    while True:
+        conn, _ = listener.accept()
+        with conn:
+            _handle_connection(listener, conn)
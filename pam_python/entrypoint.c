@@ -4,19 +4,26 @@
 #define PAM_SM_SESSION
 #define PAM_SM_PASSWORD
 
-#include "pam_python.h"
 #include "pam.h"
+#include "admission.h"
+#include "daemon.h"
+#include "manifest.h"
+#include "options.h"
+#include "pool.h"
+#include "runtime.h"
+#include "spawn.h"
+#include "transaction.h"
+#include "watch.h"
+#include "zygote.h"
 
-static char libpython_so[] = LIBPYTHON_SO;
+// The terminal is shared by the threads of the PAM host and getpass() returns a static buffer
+static pthread_mutex_t terminal_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int _converse(int n, const struct pam_message **msg, struct pam_response **resp, void *data) {
+static int converse_locked(int n, const struct pam_message **msg, struct pam_response **resp) {
   struct pam_response *aresp;
   char buf[PAM_MAX_RESP_SIZE];
   int i;
 
-  data = data;
-  if (n <= 0 || n > PAM_MAX_NUM_MSG)
-    return (PAM_CONV_ERR);
   if ((aresp = calloc(n, sizeof *aresp)) == NULL)
     return (PAM_BUF_ERR);
   for (i = 0; i < n; ++i) {
@@ -66,115 +73,262 @@ fail:
   return (PAM_CONV_ERR);
 }
 
-static void execute_child(struct ipc_pipe child, int flags, int argc, char const **argv, char *pam_fn_name) {
-  const int err_return = get_default_err(pam_fn_name);
-  // ??? why do I need to acquire the gil????
-  PyGILState_STATE gil_state;
-  if (Py_IsInitialized()) {
-    PyGILState_Ensure();
-    Py_FinalizeEx();
-  }
+static int _converse(int n, const struct pam_message **msg, struct pam_response **resp, void *data) {
+  data = data;
+  if (n <= 0 || n > PAM_MAX_NUM_MSG)
+    return (PAM_CONV_ERR);
 
-  PyImport_AppendInittab("pam_python", PyInit_pam_python);
-  Py_Initialize();
-  gil_state = PyGILState_Ensure();
+  // A user taking their time to answer does not hold an admission slot
+  admission_pause();
+  pthread_mutex_lock(&terminal_lock);
+  int retval = converse_locked(n, msg, resp);
+  pthread_mutex_unlock(&terminal_lock);
+  admission_resume();
+  return retval;
+}
 
-  printf("PyImport_ImportModule\n");
-  PyObject *module = PyImport_ImportModule("pam_python");
-  if (module == NULL) {
-    printf("PyImport_ImportModule failed..\n");
-    PyGILState_Release(gil_state);
-    _exit(err_return);
+// Tells apart the frames of a request from leftovers of an earlier one
+static uint32_t next_request_id(void) {
+  static uint32_t counter = 0;
+  return __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+static int dispatch_call(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch,
+                         struct ipc_queue *q) {
+  if (call->opcode >= 0 && call->opcode < PAM_PYTHON_OPCODE_COUNT && ipc_handlers[call->opcode] != NULL) {
+    return ipc_handlers[call->opcode](pamh, call, scratch, q);
   }
+  pam_syslog(pamh, LOG_ERR, "Unknown method type: %d", call->opcode);
+  return READ_ERR;
+}
 
-  int retval = python_handle_request(child.read_end, child.write_end, flags, argc, argv, pam_fn_name);
-  if (PyErr_Occurred()) {
-    retval = err_return;
+// Serve the callbacks of the Python process until it returns a value or the
+// timeout (in seconds, 0 for none) passes.
+// On failure, *retval is set to the default error of the PAM function.
+static int execute_parent(pam_handle_t *pamh, const struct worker_process *worker, uint32_t request_id,
+                          char *pam_fn_name, int timeout, int *retval) {
+  struct worker_watch watch;
+  struct ipc_reader reader;
+  struct ipc_queue replies;
+  struct ipc_scratch scratch;
+  struct ipc_frame frame;
+  int status;
+
+  *retval = get_default_err(pam_fn_name);
+  if (watch_init(&watch, worker, timeout) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to watch the python process: %m");
+    return READ_ERR;
   }
 
-  PyGILState_Release(gil_state);
-  Py_FinalizeEx();
-  _exit(retval);
-}
+  // Both may hold authentication tokens, on their way to and from the Python process
+  ipc_reader_init(&reader, worker->pipe, true);
+  ipc_queue_init(&replies, worker->pipe, true);
+  ipc_arena_init(&scratch.plain, false);
+  ipc_arena_init(&scratch.secret, true);
 
-static int execute_parent(pam_handle_t *pamh, struct ipc_pipe parent, char *pam_fn_name) {
-  const int err_return = get_default_err(pam_fn_name);
   while (true) {
-    int status, method_type;
+    // Calls the Python process sent without waiting are answered all at once
+    if (!ipc_reader_ready(&reader)) {
+      status = ipc_queue_flush(&replies);
+      if (status != SUCCESS) {
+        pam_syslog(pamh, LOG_ERR, "Failed to write to the python process");
+        break;
+      }
 
-    status = read_int(parent.read_end, &method_type);
+      int event = watch_wait(&watch);
+      if (event == WATCH_TIMEOUT) {
+        pam_syslog(pamh, LOG_ERR, "Python process did not finish %s within %d seconds", pam_fn_name, timeout);
+        status = TIMEOUT_ERR;
+        break;
+      } else if (event == WATCH_EXITED) {
+        pam_syslog(pamh, LOG_ERR, "Python process exited without returning a value");
+        status = READ_EOF;
+        break;
+      } else if (event != WATCH_READY) {
+        pam_syslog(pamh, LOG_ERR, "Failed to wait for the python process: %m");
+        status = READ_ERR;
+        break;
+      }
+    }
 
+    status = ipc_read_frame(&reader, &frame);
     if (status == READ_EOF) {
-      return PAM_SUCCESS;
+      pam_syslog(pamh, LOG_ERR, "Python process exited without returning a value");
+      break;
     } else if (status != SUCCESS) {
-      return err_return;
+      pam_syslog(pamh, LOG_ERR, "Failed to read from the python process");
+      break;
     }
 
-    if (method_type == PAM_PYTHON_GET_ITEM) {
-      status = ipc_get_item(pamh, parent);
-    } else if (method_type == PAM_PYTHON_SET_ITEM) {
-      status = ipc_set_item(pamh, parent);
-    } else if (method_type == PAM_PYTHON_FAIL_DELAY) {
-      status = ipc_fail_delay(pamh, parent);
-    } else if (method_type == PAM_PYTHON_CONVERSE) {
-      status = ipc_converse(pamh, parent);
-    } else if (method_type == PAM_PYTHON_STRERROR) {
-      status = ipc_strerror(pamh, parent);
-    } else if (method_type == PAM_PYTHON_SYSLOG) {
-      status = ipc_syslog(pamh, parent);
-    } else {
-      pam_syslog(pamh, LOG_ERR, "Unknown method type: %d", method_type);
-      return err_return;
+    if (frame.request_id != request_id) {
+      pam_syslog(pamh, LOG_ERR, "Python process sent a frame of another request");
+      status = READ_ERR;
+      break;
     }
 
+    if (frame.opcode == PAM_PYTHON_RETURN) {
+      struct ipc_return_to_host returned;
+      status = ipc_decode_return(&frame, &scratch.plain, &returned);
+      if (status == SUCCESS) {
+        *retval = returned.retval;
+      }
+      break;
+    }
+
+    status = dispatch_call(pamh, &frame, &scratch, &replies);
+    ipc_arena_reset(&scratch.plain);
+    ipc_arena_reset(&scratch.secret);
     if (status != SUCCESS) {
-      return err_return;
+      break;
     }
   }
+
+  ipc_arena_free(&scratch.plain);
+  ipc_arena_free(&scratch.secret);
+  ipc_queue_free(&replies);
+  ipc_reader_free(&reader);
+  watch_free(&watch);
+  return status;
 }
 
-int handle_request(char *pam_fn_name, pam_handle_t *pamh, int flags, int argc, char const **argv) {
-  const int err_return = get_default_err(pam_fn_name);
-  struct pam_conv pamc;
-  pamc.conv = _converse;
+// Send the request to a Python process and serve its callbacks until it returns.
+// On failure the caller stops the worker, which kills it when it is our child.
+static int run_request(pam_handle_t *pamh, const struct worker_process *worker, char *pam_fn_name, int flags,
+                       const struct pam_python_options *opts, int *retval) {
+  uint32_t request_id = next_request_id();
 
-  pam_set_item(pamh, PAM_CONV, &pamc);
+  int status = ipc_send_request(worker->pipe, request_id, pamh, pam_fn_name, flags, opts->log_level, opts->argc,
+                                opts->argv);
+  if (status != SUCCESS) {
+    pam_syslog(pamh, LOG_ERR, "Failed to send request to the python process");
+    *retval = get_default_err(pam_fn_name);
+    return status;
+  }
+  return execute_parent(pamh, worker, request_id, pam_fn_name, opts->timeout, retval);
+}
 
-  int parent_child[2];
-  int child_parent[2];
+static int handle_pool_request(char *pam_fn_name, pam_handle_t *pamh, int flags,
+                               const struct pam_python_options *opts, int *retval) {
+  struct pool_worker *worker = pool_acquire(pamh, opts);
+  if (!worker) {
+    return -1;
+  }
 
-  pipe(parent_child);
-  pipe(child_parent);
+  int status = run_request(pamh, &worker->proc, pam_fn_name, flags, opts, retval);
+  pool_release(pamh, worker, status == SUCCESS);
+  return 0;
+}
 
-  struct ipc_pipe parent = {child_parent[0], parent_child[1]};
-  struct ipc_pipe child = {parent_child[0], child_parent[1]};
+// Get a Python process for the request according to the configured mode
+static int start_worker(pam_handle_t *pamh, const struct pam_python_options *opts, struct worker_process *worker) {
+  if (opts->mode == PAM_PYTHON_MODE_ZYGOTE || opts->mode == PAM_PYTHON_MODE_DAEMON) {
+    int fd = opts->mode == PAM_PYTHON_MODE_DAEMON ? daemon_connect(pamh, opts) : zygote_connect(pamh, opts);
+    if (fd >= 0) {
+      worker->pid = -1;
+      worker->pipe = (struct ipc_pipe){.read_end = fd, .write_end = fd};
+      return 0;
+    }
+
+    if (opts->mode == PAM_PYTHON_MODE_DAEMON) {
+      pam_syslog(pamh, LOG_WARNING, "Daemon is not reachable at %s, falling back to fork", opts->daemon_socket);
+    } else {
+      pam_syslog(pamh, LOG_WARNING, "Zygote for %s is not available, falling back to fork", opts->argv[0]);
+    }
+  }
+
+  // A worker kept for the whole transaction serves any number of requests
+  return spawn_worker(pamh, opts->argv[0], opts->startup, opts->transport, opts->reuse ? 0 : 1, worker);
+}
+
+// opts is a copy, falling back to another mode changes it
+static int dispatch_request(char *pam_fn_name, pam_handle_t *pamh, int flags, struct pam_python_options opts) {
+  const int err_return = get_default_err(pam_fn_name);
+  struct worker_process worker;
+  int status, retval;
+
+  if (opts.mode == PAM_PYTHON_MODE_INPROCESS) {
+    const struct python_runtime *python = runtime_load(pamh);
+    if (python && python->inprocess_request(pamh, pam_fn_name, flags, &opts, &retval) == SUCCESS) {
+      return retval;
+    }
+    pam_syslog(pamh, LOG_WARNING, "Python is not usable in the PAM host, falling back to fork");
+    opts.mode = PAM_PYTHON_MODE_FORK;
+  }
+
+  if (opts.mode == PAM_PYTHON_MODE_POOL) {
+    if (handle_pool_request(pam_fn_name, pamh, flags, &opts, &retval) == 0) {
+      return retval;
+    }
+    // An autoscaled pool runs out of idle workers by design while it grows, it
+    // counts these calls as cold starts in its scaling messages instead
+    pam_syslog(pamh, opts.max_workers > 0 ? LOG_DEBUG : LOG_WARNING,
+               "No idle python worker for %s, falling back to fork", opts.argv[0]);
+    opts.mode = PAM_PYTHON_MODE_FORK;
+  }
+
+  if (opts.reuse) {
+    struct worker_process *kept = transaction_get(pamh, opts.argv[0]);
+    if (kept && !worker_idle(kept)) {
+      pam_syslog(pamh, LOG_WARNING, "Python worker of this transaction exited, starting a new one");
+      transaction_drop(pamh, opts.argv[0]);
+    } else if (kept) {
+      status = run_request(pamh, kept, pam_fn_name, flags, &opts, &retval);
+      if (status != SUCCESS) {
+        transaction_drop(pamh, opts.argv[0]);
+      }
+      return retval;
+    }
+  }
 
-  int pid = fork();
-  if (pid == -1) {
-    pam_syslog(pamh, LOG_ERR, "Failed to fork: %s", strerror(errno));
+  if (start_worker(pamh, &opts, &worker) != 0) {
     return err_return;
   }
 
-  if (pid == 0) {
-    close(parent_child[1]);
-    close(child_parent[0]);
+  status = run_request(pamh, &worker, pam_fn_name, flags, &opts, &retval);
 
-    execute_child(child, flags, argc, argv, pam_fn_name);
-  } else {
-    close(parent_child[0]);
-    close(child_parent[1]);
+  if (opts.reuse && status == SUCCESS && transaction_keep(pamh, opts.argv[0], &worker) == 0) {
+    return retval;
+  }
+  stop_worker(&worker, status != SUCCESS);
+  return retval;
+}
 
-    const ret_parent = execute_parent(pamh, parent);
+int handle_request(char *pam_fn_name, pam_handle_t *pamh, int flags, int argc, char const **argv) {
+  const int err_return = get_default_err(pam_fn_name);
+  struct pam_python_options opts;
+  struct pam_conv pamc;
+  pamc.conv = _converse;
 
-    int ret_child;
-    waitpid(0, &ret_child, 0);
+  pam_set_item(pamh, PAM_CONV, &pamc);
 
-    if (ret_parent != PAM_SUCCESS) {
-      return ret_parent;
-    } else {
-      return ret_child;
+  if (parse_options(pamh, argc, argv, &opts) != SUCCESS) {
+    return err_return;
+  }
+
+  // Nothing to run, don't start Python for it
+  int manifest = manifest_lookup(opts.argv[0], pam_fn_name);
+  if (manifest == MANIFEST_UNDEFINED) {
+    if (opts.ignore_undefined) {
+      return PAM_IGNORE;
     }
+    pam_syslog(pamh, LOG_ERR, "No python handler provided for %s", pam_fn_name);
+    return err_return;
+  }
+
+  // Shed calls are only counted (see `python -m pam_python stats`), logging
+  // each of them would flood syslog during the very storm being shed
+  if (admission_acquire(pamh, &opts) == ADMISSION_SHED) {
+    return get_shed_err(pam_fn_name);
+  }
+  int retval = dispatch_request(pam_fn_name, pamh, flags, opts);
+  admission_release();
+
+  // The module was imported for the first time and has just written its manifest
+  if (manifest == MANIFEST_UNKNOWN && opts.ignore_undefined && retval == err_return &&
+      manifest_lookup(opts.argv[0], pam_fn_name) == MANIFEST_UNDEFINED) {
+    return PAM_IGNORE;
   }
+  return retval;
 }
 
 int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
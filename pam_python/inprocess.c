@@ -0,0 +1,212 @@
+#include "inprocess.h"
+
+#include "pam.h"
+#include "pam_python.h"
+#include "worker.h"
+
+#define INTERPRETER_DATA_PREFIX "pam_python_interpreter:"
+
+// Guarded by python_lock (see worker.h)
+static bool python_tried = false;
+
+// There is a single interpreter per process, the startup profile of the first request wins
+static bool init_python(int startup) {
+  pthread_mutex_lock(&python_lock);
+  if (!python_tried && !Py_IsInitialized()) {
+    // Signal handlers belong to the host
+    if (start_interpreter(startup, 0) == SUCCESS) {
+      // Requests take the GIL with PyGILState_Ensure() from whichever thread they run on
+      PyEval_SaveThread();
+    }
+  }
+  python_tried = true;
+  pthread_mutex_unlock(&python_lock);
+  return Py_IsInitialized();
+}
+
+// Called with the GIL of the interpreter the request runs in
+static int run_handler(pam_handle_t *pamh, char *pam_fn_name, int flags,
+                       const struct pam_python_options *opts, int *retval) {
+  PyObject *module = PyImport_ImportModule("pam_python.pam_python");
+  if (module == NULL) {
+    PyErr_Print();
+    pam_syslog(pamh, LOG_ERR, "Failed to import pam_python in the PAM host");
+    return READ_ERR;
+  }
+
+  *retval = python_handle_inprocess(pamh, pam_fn_name, flags, opts->log_level, opts->argc, opts->argv);
+  if (PyErr_Occurred()) {
+    // Not PyErr_Print(), it exits the PAM host on SystemExit
+    PyErr_WriteUnraisable(module);
+    *retval = get_default_err(pam_fn_name);
+  }
+
+  Py_DECREF(module);
+  return SUCCESS;
+}
+
+#if PY_VERSION_HEX >= 0x030C0000
+
+// Thread states are bound to the OS thread which created them, while the calls
+// of a transaction may come from any thread of the host. Only the interpreter
+// is kept, each call attaches to it with a thread state of its own.
+struct kept_interpreter {
+  PyInterpreterState *interp;
+  // The PAM host might fork afterwards, the copy of the interpreter is unusable there
+  pid_t owner;
+};
+
+// Every module gets its own interpreter
+static void data_name(const char *module_path, char *name, size_t size) {
+  snprintf(name, size, "%s%s", INTERPRETER_DATA_PREFIX, module_path);
+}
+
+// Returns a new isolated interpreter without any thread state
+static PyInterpreterState *interpreter_create(void) {
+  const PyInterpreterConfig config = {
+      .use_main_obmalloc = 0,
+      .allow_fork = 0,
+      .allow_exec = 0,
+      .allow_threads = 1,
+      .allow_daemon_threads = 0,
+      .check_multi_interp_extensions = 1,
+      .gil = PyInterpreterConfig_OWN_GIL,
+  };
+  PyThreadState *tstate = NULL;
+
+  // Creating an interpreter needs a current thread state
+  PyGILState_STATE gil = PyGILState_Ensure();
+  PyThreadState *main_tstate = PyThreadState_Get();
+
+  PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+  if (PyStatus_Exception(status)) {
+    // The main thread state is current again
+    PyGILState_Release(gil);
+    return NULL;
+  }
+
+  // Drop the thread state of the creating thread (releasing the new GIL) and
+  // switch back to the main interpreter
+  PyInterpreterState *interp = PyThreadState_GetInterpreter(tstate);
+  PyThreadState_Clear(tstate);
+  PyThreadState_DeleteCurrent();
+  PyEval_RestoreThread(main_tstate);
+  PyGILState_Release(gil);
+  return interp;
+}
+
+// Returns the thread state of the calling thread in interp, holding its GIL
+static PyThreadState *interpreter_attach(PyInterpreterState *interp) {
+  PyThreadState *tstate = PyThreadState_New(interp);
+  if (tstate) {
+    PyEval_RestoreThread(tstate);
+  }
+  return tstate;
+}
+
+static void interpreter_detach(PyThreadState *tstate) {
+  PyThreadState_Clear(tstate);
+  PyThreadState_DeleteCurrent();
+}
+
+// Ends the interpreter from the calling thread, tstate is its attached thread state (or NULL)
+static void interpreter_destroy(PyInterpreterState *interp, PyThreadState *tstate) {
+  if (!tstate) {
+    tstate = interpreter_attach(interp);
+  }
+  if (tstate) {
+    Py_EndInterpreter(tstate);
+  }
+}
+
+static void interpreter_cleanup(pam_handle_t *pamh, void *data, int error_status) {
+  struct kept_interpreter *kept = data;
+  (void)pamh;
+  (void)error_status;
+
+  if (kept->owner == getpid()) {
+    interpreter_destroy(kept->interp, NULL);
+  }
+  free(kept);
+}
+
+static PyInterpreterState *interpreter_get(pam_handle_t *pamh, const char *module_path) {
+  char name[PATH_MAX + sizeof(INTERPRETER_DATA_PREFIX)];
+  const struct kept_interpreter *kept;
+
+  data_name(module_path, name, sizeof(name));
+  if (pam_get_data(pamh, name, (const void **)&kept) != PAM_SUCCESS || !kept || kept->owner != getpid()) {
+    return NULL;
+  }
+  return kept->interp;
+}
+
+static int interpreter_keep(pam_handle_t *pamh, const char *module_path, PyInterpreterState *interp) {
+  char name[PATH_MAX + sizeof(INTERPRETER_DATA_PREFIX)];
+
+  struct kept_interpreter *kept = malloc(sizeof(struct kept_interpreter));
+  if (!kept) {
+    return -1;
+  }
+  kept->interp = interp;
+  kept->owner = getpid();
+
+  data_name(module_path, name, sizeof(name));
+  if (pam_set_data(pamh, name, kept, interpreter_cleanup) != PAM_SUCCESS) {
+    pam_syslog(pamh, LOG_ERR, "Failed to store the python interpreter on the pam handle");
+    free(kept);
+    return -1;
+  }
+  return 0;
+}
+
+int inprocess_request(pam_handle_t *pamh, char *pam_fn_name, int flags,
+                      const struct pam_python_options *opts, int *retval) {
+  if (!init_python(opts->startup)) {
+    return READ_ERR;
+  }
+
+  PyInterpreterState *interp = opts->reuse ? interpreter_get(pamh, opts->argv[0]) : NULL;
+  bool kept = interp != NULL;
+  if (!interp) {
+    interp = interpreter_create();
+    if (!interp) {
+      pam_syslog(pamh, LOG_ERR, "Failed to create a python subinterpreter");
+      return READ_ERR;
+    }
+  }
+
+  PyThreadState *tstate = interpreter_attach(interp);
+  if (!tstate) {
+    pam_syslog(pamh, LOG_ERR, "Failed to attach to the python subinterpreter");
+    if (!kept) {
+      interpreter_destroy(interp, NULL);
+    }
+    return READ_ERR;
+  }
+  int status = run_handler(pamh, pam_fn_name, flags, opts, retval);
+
+  if (kept || (status == SUCCESS && opts->reuse && interpreter_keep(pamh, opts->argv[0], interp) == 0)) {
+    interpreter_detach(tstate);
+    return status;
+  }
+  interpreter_destroy(interp, tstate);
+  return status;
+}
+
+#else
+
+int inprocess_request(pam_handle_t *pamh, char *pam_fn_name, int flags,
+                      const struct pam_python_options *opts, int *retval) {
+  if (!init_python(opts->startup)) {
+    return READ_ERR;
+  }
+
+  // No per-interpreter GIL, requests share the main interpreter
+  PyGILState_STATE gil = PyGILState_Ensure();
+  int status = run_handler(pamh, pam_fn_name, flags, opts, retval);
+  PyGILState_Release(gil);
+  return status;
+}
+
+#endif
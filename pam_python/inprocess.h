@@ -0,0 +1,36 @@
+#ifndef _PAM_PYTHON_INPROCESS_H
+#define _PAM_PYTHON_INPROCESS_H
+
+#include <Python.h>
+#include <limits.h>
+#include <pthread.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "pipe.h"
+
+// Run the request inside the PAM host without forking. The handler calls
+// libpam directly instead of going through the pipe protocol.
+//
+// With Python 3.12+ every request runs in a fresh subinterpreter with its own
+// GIL, so concurrent authentications of a multithreaded host run in parallel.
+// With reuse=transaction the subinterpreter is kept on the pam handle and
+// destroyed in pam_end(). Older versions run every request in the main
+// interpreter.
+//
+// A host which already embeds Python keeps its interpreter, otherwise one is
+// initialized on first use and lives as long as the host process (the runtime
+// is never unloaded, see runtime.h).
+//
+// Returns SUCCESS once the handler ran and set *retval. Any other status means
+// Python is not usable in this process and nothing was run.
+int inprocess_request(pam_handle_t *pamh, char *pam_fn_name, int flags,
+                      const struct pam_python_options *opts, int *retval);
+
+#endif
@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+
+#include "manifest.h"
+
+// Only root may have written the file
+static bool is_trusted(const struct stat *st) {
+  return st->st_uid == 0 && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Same name as cache.py gives it: the real path with '%' and '/' escaped
+static int manifest_path(const char *real_path, char *path, size_t size) {
+  size_t len = snprintf(path, size, "%s/", PAM_PYTHON_CACHE_DIR);
+
+  for (const char *c = real_path; *c; c++) {
+    const char *escaped = *c == '%' ? "%25" : *c == '/' ? "%2F" : NULL;
+    if (len + 4 >= size) return -1;
+    if (escaped) {
+      memcpy(path + len, escaped, 3);
+      len += 3;
+    } else {
+      path[len++] = *c;
+    }
+  }
+
+  int n = snprintf(path + len, size - len, ".handlers");
+  return n >= 0 && (size_t)n < size - len ? 0 : -1;
+}
+
+static bool has_word(const char *line, const char *word) {
+  size_t word_len = strlen(word);
+  for (const char *p = strstr(line, word); p; p = strstr(p + 1, word)) {
+    bool start = p == line || p[-1] == ' ';
+    bool end = p[word_len] == ' ' || p[word_len] == '\n' || p[word_len] == '\0';
+    if (start && end) return true;
+  }
+  return false;
+}
+
+int manifest_lookup(const char *module_path, const char *pam_fn_name) {
+  char real_path[PATH_MAX], path[PATH_MAX * 3];
+  char handlers[512];
+  struct stat module_st, dir_st, st;
+  unsigned long long dev, ino, size, mtime_ns;
+  int result = MANIFEST_UNKNOWN;
+
+  if (!realpath(module_path, real_path) || stat(real_path, &module_st) != 0 ||
+      manifest_path(real_path, path, sizeof(path)) != 0) {
+    return MANIFEST_UNKNOWN;
+  }
+  if (stat(PAM_PYTHON_CACHE_DIR, &dir_st) != 0 || !S_ISDIR(dir_st.st_mode) || !is_trusted(&dir_st)) {
+    return MANIFEST_UNKNOWN;
+  }
+
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    return MANIFEST_UNKNOWN;
+  }
+  if (fstat(fileno(f), &st) != 0 || !is_trusted(&st)) {
+    goto cleanup;
+  }
+
+  if (fscanf(f, "%llu %llu %llu %llu\n", &dev, &ino, &size, &mtime_ns) != 4) {
+    goto cleanup;
+  }
+  unsigned long long module_mtime_ns = module_st.st_mtim.tv_sec * 1000000000ULL + module_st.st_mtim.tv_nsec;
+  if (dev != module_st.st_dev || ino != module_st.st_ino || size != (unsigned long long)module_st.st_size ||
+      mtime_ns != module_mtime_ns) {
+    // The module changed since, the next import writes a new manifest
+    goto cleanup;
+  }
+
+  if (!fgets(handlers, sizeof(handlers), f)) {
+    handlers[0] = '\0';
+  }
+  result = has_word(handlers, pam_fn_name) ? MANIFEST_DEFINED : MANIFEST_UNDEFINED;
+
+cleanup:
+  fclose(f);
+  return result;
+}
@@ -0,0 +1,31 @@
+#ifndef _PAM_PYTHON_MANIFEST_H
+#define _PAM_PYTHON_MANIFEST_H
+
+#include <limits.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Directory of the bytecode cache and of the handler manifests, see cache.py
+#define PAM_PYTHON_CACHE_DIR "/var/cache/pam_python"
+
+#define MANIFEST_UNKNOWN   0
+#define MANIFEST_DEFINED   1
+#define MANIFEST_UNDEFINED 2
+
+// A manifest records which pam_sm_* handlers a module defines. It is written
+// (by root) when the module is imported or by `python -m pam_python compile`:
+//
+//   <st_dev> <st_ino> <st_size> <st_mtime in ns>
+//   pam_sm_authenticate pam_sm_acct_mgmt
+//
+// Calls of handlers the module does not define are answered without starting
+// a worker. Returns MANIFEST_UNKNOWN when there is no trusted manifest for the
+// current version of the module.
+int manifest_lookup(const char *module_path, const char *pam_fn_name);
+
+#endif
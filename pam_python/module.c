@@ -0,0 +1,22 @@
+#define _GNU_SOURCE
+
+#include "module.h"
+
+void pin_module(void) {
+  Dl_info info;
+  if (dladdr((void *)pin_module, &info) && info.dli_fname) {
+    dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+  }
+}
+
+int module_sibling(const char *name, char *path, size_t size) {
+  Dl_info info;
+  if (!dladdr((void *)module_sibling, &info) || !info.dli_fname) {
+    return -1;
+  }
+
+  const char *slash = strrchr(info.dli_fname, '/');
+  int dir_len = slash ? slash - info.dli_fname + 1 : 0;
+  int len = snprintf(path, size, "%.*s%s", dir_len, info.dli_fname, name);
+  return len >= 0 && (size_t)len < size ? 0 : -1;
+}
@@ -0,0 +1,16 @@
+#ifndef _PAM_PYTHON_MODULE_H
+#define _PAM_PYTHON_MODULE_H
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+
+// Linux-PAM dlclose()s the module in pam_end(). State which outlives a PAM
+// transaction (worker pools) needs the module to stay loaded for good.
+void pin_module(void);
+
+// Path of a file installed next to the PAM module (pam-python-worker,
+// the extension module). Returns 0 on success.
+int module_sibling(const char *name, char *path, size_t size);
+
+#endif
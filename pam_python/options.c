@@ -0,0 +1,240 @@
+#include "options.h"
+
+#include <stdint.h>
+
+static bool is_key(const char *arg, size_t key_len, const char *key) {
+  return key_len == strlen(key) && strncmp(arg, key, key_len) == 0;
+}
+
+// Option names are lowercase words joined by '_', anything else before '=' belongs to a path
+static bool is_option(const char *arg, const char *eq) {
+  if (eq == NULL || eq == arg) {
+    return false;
+  }
+  for (const char *c = arg; c < eq; c++) {
+    if ((*c < 'a' || *c > 'z') && *c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int parse_int(pam_handle_t *pamh, const char *key, const char *value, int *out) {
+  char *end;
+  long n = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || n < 0 || n > INT32_MAX) {
+    pam_syslog(pamh, LOG_ERR, "Invalid value for option %s: %s", key, value);
+    return OPTIONS_ERR;
+  }
+  *out = (int)n;
+  return SUCCESS;
+}
+
+static int parse_mode(pam_handle_t *pamh, const char *value, int *out) {
+  if (strcmp(value, "fork") == 0) {
+    *out = PAM_PYTHON_MODE_FORK;
+  } else if (strcmp(value, "zygote") == 0) {
+    *out = PAM_PYTHON_MODE_ZYGOTE;
+  } else if (strcmp(value, "pool") == 0) {
+    *out = PAM_PYTHON_MODE_POOL;
+  } else if (strcmp(value, "daemon") == 0) {
+    *out = PAM_PYTHON_MODE_DAEMON;
+  } else if (strcmp(value, "inprocess") == 0) {
+    *out = PAM_PYTHON_MODE_INPROCESS;
+  } else {
+    pam_syslog(pamh, LOG_ERR, "Unknown mode: %s", value);
+    return OPTIONS_ERR;
+  }
+  return SUCCESS;
+}
+
+static int parse_reuse(pam_handle_t *pamh, const char *value, bool *out) {
+  if (strcmp(value, "none") == 0) {
+    *out = false;
+  } else if (strcmp(value, "transaction") == 0) {
+    *out = true;
+  } else {
+    pam_syslog(pamh, LOG_ERR, "Invalid value for option reuse: %s", value);
+    return OPTIONS_ERR;
+  }
+  return SUCCESS;
+}
+
+static int parse_undefined(pam_handle_t *pamh, const char *value, bool *out) {
+  if (strcmp(value, "error") == 0) {
+    *out = false;
+  } else if (strcmp(value, "ignore") == 0) {
+    *out = true;
+  } else {
+    pam_syslog(pamh, LOG_ERR, "Invalid value for option undefined: %s", value);
+    return OPTIONS_ERR;
+  }
+  return SUCCESS;
+}
+
+static int parse_startup(pam_handle_t *pamh, const char *value, int *out) {
+  if (strcmp(value, "compat") == 0) {
+    *out = PAM_PYTHON_STARTUP_COMPAT;
+  } else if (strcmp(value, "minimal") == 0) {
+    *out = PAM_PYTHON_STARTUP_MINIMAL;
+  } else {
+    pam_syslog(pamh, LOG_ERR, "Invalid value for option startup: %s", value);
+    return OPTIONS_ERR;
+  }
+  return SUCCESS;
+}
+
+static int parse_transport(pam_handle_t *pamh, const char *value, int *out) {
+  if (strcmp(value, "socket") == 0) {
+    *out = PAM_PYTHON_TRANSPORT_SOCKET;
+  } else if (strcmp(value, "pipe") == 0) {
+    *out = PAM_PYTHON_TRANSPORT_PIPE;
+  } else if (strcmp(value, "shm") == 0) {
+    *out = PAM_PYTHON_TRANSPORT_SHM;
+  } else {
+    pam_syslog(pamh, LOG_ERR, "Invalid value for option transport: %s", value);
+    return OPTIONS_ERR;
+  }
+  return SUCCESS;
+}
+
+static int parse_log_level(pam_handle_t *pamh, const char *value, int *out) {
+  static const char *const names[] = {"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"};
+
+  // Indexed by priority, LOG_EMERG is 0 and LOG_DEBUG is 7
+  for (int i = LOG_EMERG; i <= LOG_DEBUG; i++) {
+    if (strcmp(value, names[i]) == 0) {
+      *out = i;
+      return SUCCESS;
+    }
+  }
+  pam_syslog(pamh, LOG_ERR, "Invalid value for option log_level: %s", value);
+  return OPTIONS_ERR;
+}
+
+int parse_options(pam_handle_t *pamh, int argc, const char **argv, struct pam_python_options *opts) {
+  int status;
+
+  opts->mode = PAM_PYTHON_MODE_FORK;
+  opts->zygote_idle = PAM_PYTHON_ZYGOTE_IDLE;
+  opts->workers = PAM_PYTHON_POOL_WORKERS;
+  opts->max_requests = PAM_PYTHON_MAX_REQUESTS;
+  opts->max_rss = PAM_PYTHON_MAX_RSS;
+  opts->max_age = PAM_PYTHON_MAX_AGE;
+  opts->idle_timeout = PAM_PYTHON_IDLE_TIMEOUT;
+  opts->max_workers = PAM_PYTHON_MAX_WORKERS;
+  opts->min_spare = PAM_PYTHON_MIN_SPARE;
+  opts->ramp_up = PAM_PYTHON_RAMP_UP;
+  opts->cool_down = PAM_PYTHON_COOL_DOWN;
+  opts->daemon_socket = PAM_PYTHON_DAEMON_SOCKET;
+  opts->reuse = false;
+  opts->ignore_undefined = false;
+  opts->startup = PAM_PYTHON_STARTUP_COMPAT;
+  opts->transport = PAM_PYTHON_TRANSPORT_SOCKET;
+  opts->log_level = PAM_PYTHON_LOG_LEVEL;
+  opts->timeout = PAM_PYTHON_TIMEOUT;
+  opts->max_inflight = PAM_PYTHON_MAX_INFLIGHT;
+  opts->queue_wait = PAM_PYTHON_QUEUE_WAIT;
+
+  bool workers_set = false;
+  int i;
+  for (i = 0; i < argc; i++) {
+    const char *eq = strchr(argv[i], '=');
+    if (!is_option(argv[i], eq)) {
+      // First argument which is not an option is the module path
+      break;
+    }
+
+    const char *value = eq + 1;
+    size_t key_len = eq - argv[i];
+
+    if (is_key(argv[i], key_len, "mode")) {
+      status = parse_mode(pamh, value, &opts->mode);
+    } else if (is_key(argv[i], key_len, "zygote_idle")) {
+      status = parse_int(pamh, "zygote_idle", value, &opts->zygote_idle);
+    } else if (is_key(argv[i], key_len, "workers")) {
+      status = parse_int(pamh, "workers", value, &opts->workers);
+      workers_set = true;
+      if (status == SUCCESS && opts->workers < 1) {
+        pam_syslog(pamh, LOG_ERR, "workers must be at least 1");
+        status = OPTIONS_ERR;
+      }
+    } else if (is_key(argv[i], key_len, "max_requests")) {
+      status = parse_int(pamh, "max_requests", value, &opts->max_requests);
+    } else if (is_key(argv[i], key_len, "max_rss")) {
+      status = parse_int(pamh, "max_rss", value, &opts->max_rss);
+    } else if (is_key(argv[i], key_len, "max_age")) {
+      status = parse_int(pamh, "max_age", value, &opts->max_age);
+    } else if (is_key(argv[i], key_len, "idle_timeout")) {
+      status = parse_int(pamh, "idle_timeout", value, &opts->idle_timeout);
+    } else if (is_key(argv[i], key_len, "max_workers")) {
+      status = parse_int(pamh, "max_workers", value, &opts->max_workers);
+    } else if (is_key(argv[i], key_len, "min_spare")) {
+      status = parse_int(pamh, "min_spare", value, &opts->min_spare);
+    } else if (is_key(argv[i], key_len, "ramp_up")) {
+      status = parse_int(pamh, "ramp_up", value, &opts->ramp_up);
+    } else if (is_key(argv[i], key_len, "cool_down")) {
+      status = parse_int(pamh, "cool_down", value, &opts->cool_down);
+    } else if (is_key(argv[i], key_len, "daemon_socket")) {
+      opts->daemon_socket = value;
+      status = SUCCESS;
+    } else if (is_key(argv[i], key_len, "reuse")) {
+      status = parse_reuse(pamh, value, &opts->reuse);
+    } else if (is_key(argv[i], key_len, "undefined")) {
+      status = parse_undefined(pamh, value, &opts->ignore_undefined);
+    } else if (is_key(argv[i], key_len, "startup")) {
+      status = parse_startup(pamh, value, &opts->startup);
+    } else if (is_key(argv[i], key_len, "transport")) {
+      status = parse_transport(pamh, value, &opts->transport);
+    } else if (is_key(argv[i], key_len, "log_level")) {
+      status = parse_log_level(pamh, value, &opts->log_level);
+    } else if (is_key(argv[i], key_len, "timeout")) {
+      status = parse_int(pamh, "timeout", value, &opts->timeout);
+    } else if (is_key(argv[i], key_len, "max_inflight")) {
+      status = parse_int(pamh, "max_inflight", value, &opts->max_inflight);
+      if (status == SUCCESS && opts->max_inflight > PAM_PYTHON_ADMISSION_SLOTS) {
+        pam_syslog(pamh, LOG_ERR, "max_inflight must be at most %d", PAM_PYTHON_ADMISSION_SLOTS);
+        status = OPTIONS_ERR;
+      }
+    } else if (is_key(argv[i], key_len, "queue_wait")) {
+      status = parse_int(pamh, "queue_wait", value, &opts->queue_wait);
+    } else {
+      pam_syslog(pamh, LOG_ERR, "Unknown option: %s", argv[i]);
+      status = OPTIONS_ERR;
+    }
+
+    if (status != SUCCESS) {
+      return status;
+    }
+  }
+
+  // The autoscaling options only make sense together, see PAM_PYTHON_MAX_WORKERS
+  if (opts->max_workers > 0) {
+    if (opts->ramp_up < 1) {
+      pam_syslog(pamh, LOG_ERR, "ramp_up must be at least 1");
+      return OPTIONS_ERR;
+    }
+    if (opts->cool_down < 1) {
+      pam_syslog(pamh, LOG_ERR, "cool_down must be at least 1");
+      return OPTIONS_ERR;
+    }
+    if (opts->min_spare > opts->max_workers) {
+      pam_syslog(pamh, LOG_ERR, "min_spare must be at most max_workers");
+      return OPTIONS_ERR;
+    }
+    if (workers_set) {
+      pam_syslog(pamh, LOG_ERR, "workers can't be combined with max_workers");
+      return OPTIONS_ERR;
+    }
+  }
+
+  opts->argc = argc - i;
+  opts->argv = argv + i;
+
+  if (opts->argc == 0) {
+    pam_syslog(pamh, LOG_ERR, "No python module provided");
+    return OPTIONS_ERR;
+  }
+
+  return SUCCESS;
+}
@@ -0,0 +1,135 @@
+#ifndef _PAM_PYTHON_OPTIONS_H
+#define _PAM_PYTHON_OPTIONS_H
+
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "pipe.h"
+
+// How a pam_sm_* call reaches the Python interpreter
+#define PAM_PYTHON_MODE_FORK      0
+#define PAM_PYTHON_MODE_ZYGOTE    1
+#define PAM_PYTHON_MODE_POOL      2
+#define PAM_PYTHON_MODE_DAEMON    3
+#define PAM_PYTHON_MODE_INPROCESS 4
+
+// How workers (and the PAM host in inprocess mode) initialize the interpreter:
+// compat is a plain Py_Initialize(), minimal is isolated from the environment,
+// skips site and uses a fixed module search path
+#define PAM_PYTHON_STARTUP_COMPAT  0
+#define PAM_PYTHON_STARTUP_MINIMAL 1
+
+// How frames travel between the PAM host and a worker it started itself (fork
+// and pool modes): datagrams of a SOCK_SEQPACKET socketpair, a pair of pipes,
+// or rings in a shared memory region (see shm.h).
+// Zygotes and the daemon are always reached over their stream socket.
+#define PAM_PYTHON_TRANSPORT_SOCKET 0
+#define PAM_PYTHON_TRANSPORT_PIPE   1
+#define PAM_PYTHON_TRANSPORT_SHM    2
+
+// Seconds an unused zygote stays around before it exits
+#define PAM_PYTHON_ZYGOTE_IDLE 600
+
+// Socket of the `python -m pam_python daemon` process
+#define PAM_PYTHON_DAEMON_SOCKET "/run/pam_python/daemon.sock"
+
+// Number of long-lived workers kept by each PAM host process in pool mode.
+// They are started one at a time, when a call finds none idle, and go away
+// with the PAM host. Pools only pay off in hosts which serve many logins
+// themselves. Hosts started per login, like the per-connection sshd process,
+// should use mode=zygote or mode=daemon, whose processes outlive them.
+#define PAM_PYTHON_POOL_WORKERS 4
+
+// Pool workers run the user module for as long as the PAM host lives and
+// whatever it leaks adds up. A worker is replaced once it has served
+// max_requests requests, grown past max_rss MiB of resident memory or lived
+// for max_age seconds, and stopped after idle_timeout seconds without a
+// request. Only idle workers are recycled. 0 disables a policy.
+#define PAM_PYTHON_MAX_REQUESTS 0
+#define PAM_PYTHON_MAX_RSS      0
+#define PAM_PYTHON_MAX_AGE      0
+#define PAM_PYTHON_IDLE_TIMEOUT 0
+
+// With max_workers set, the pool grows and shrinks between min_spare idle
+// workers and max_workers, starting from the worker of its first call
+// (workers= does not apply). It follows the demand: an
+// EWMA of the arrival rate times an EWMA of the time a request keeps a worker,
+// plus the calls which found no warm worker. At most ramp_up workers are
+// started per second, a call finding none idle meanwhile runs in a one-off
+// fork. One is stopped once the demand has stayed below the pool for
+// cool_down seconds. The averages are kept by each PAM host process, they
+// only settle in hosts which live for many requests.
+#define PAM_PYTHON_MAX_WORKERS 0
+#define PAM_PYTHON_MIN_SPARE   1
+#define PAM_PYTHON_RAMP_UP     2
+#define PAM_PYTHON_COOL_DOWN   60
+
+// Seconds the PAM host waits for the Python handler of a pam_sm_* call before
+// it gives up on the worker and returns the default error of the call.
+// Conversations with the user do not count. 0 means no limit.
+#define PAM_PYTHON_TIMEOUT 0
+
+// Calls executing Python at the same time, over every PAM host process of the
+// user (see admission.h). Time spent waiting for the user to answer a
+// conversation does not count. 0 means no limit, at most PAM_PYTHON_ADMISSION_SLOTS.
+#define PAM_PYTHON_MAX_INFLIGHT 0
+#define PAM_PYTHON_ADMISSION_SLOTS 1024
+
+// Milliseconds a call over max_inflight waits for a free slot before it is
+// shed, 0 sheds it right away
+#define PAM_PYTHON_QUEUE_WAIT 0
+
+// Records logged by the handler with a lower priority (log_level=emerg ... debug)
+// are dropped before they leave the Python process
+#define PAM_PYTHON_LOG_LEVEL LOG_INFO
+
+// Options are given as key=value pairs in the PAM config line before the module path:
+//
+//   auth required pam_python.so mode=zygote /etc/security/my_module.py arg1 arg2
+//
+// Everything starting with the module path is passed on to the Python module.
+// Only an argument beginning with an option name (lowercase letters and '_')
+// followed by '=' is an option, so a path like /etc/pam=python/module.py is not.
+struct pam_python_options {
+  int mode;
+  int zygote_idle;
+  int workers;
+  // Recycling of pool workers, see PAM_PYTHON_MAX_REQUESTS
+  int max_requests;
+  int max_rss;
+  int max_age;
+  int idle_timeout;
+  // Autoscaling of the pool, see PAM_PYTHON_MAX_WORKERS
+  int max_workers;
+  int min_spare;
+  int ramp_up;
+  int cool_down;
+  const char *daemon_socket;
+  // Keep the worker (or the subinterpreter in inprocess mode)
+  // for every pam_sm_* call of the PAM transaction
+  bool reuse;
+  // Answer calls of handlers the module does not define (see manifest.h)
+  // with PAM_IGNORE instead of the default error of the pam_sm_* function
+  bool ignore_undefined;
+  // PAM_PYTHON_STARTUP_*. The daemon is started by hand, pass -I -S to its python instead.
+  int startup;
+  // PAM_PYTHON_TRANSPORT_*
+  int transport;
+  // LOG_* priority, see PAM_PYTHON_LOG_LEVEL
+  int log_level;
+  // Seconds, see PAM_PYTHON_TIMEOUT
+  int timeout;
+  // See PAM_PYTHON_MAX_INFLIGHT and PAM_PYTHON_QUEUE_WAIT (milliseconds)
+  int max_inflight;
+  int queue_wait;
+  int argc;
+  const char **argv;
+};
+
+int parse_options(pam_handle_t *pamh, int argc, const char **argv, struct pam_python_options *opts);
+
+#endif
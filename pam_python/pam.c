@@ -6,6 +6,7 @@
 #define OK_GOTO(x) \
   if (x != SUCCESS) goto cleanup
 
+// BEGIN GENERATED by make.py: errors
 int get_default_err(char *pam_fn_name) {
   if (strcmp(pam_fn_name, "pam_sm_authenticate") == 0) {
     return PAM_AUTH_ERR;
@@ -18,225 +19,786 @@ int get_default_err(char *pam_fn_name) {
   } else if (strcmp(pam_fn_name, "pam_sm_close_session") == 0) {
     return PAM_SESSION_ERR;
   } else if (strcmp(pam_fn_name, "pam_sm_chauthtok") == 0) {
-    return PAM_AUTH_ERR;
+    return PAM_AUTHTOK_ERR;
+  }
+  return PAM_ABORT;
+}
+
+int get_shed_err(char *pam_fn_name) {
+  if (strcmp(pam_fn_name, "pam_sm_authenticate") == 0) {
+    return PAM_AUTHINFO_UNAVAIL;
+  } else if (strcmp(pam_fn_name, "pam_sm_setcred") == 0) {
+    return PAM_CRED_UNAVAIL;
+  } else if (strcmp(pam_fn_name, "pam_sm_acct_mgmt") == 0) {
+    return PAM_AUTHINFO_UNAVAIL;
+  } else if (strcmp(pam_fn_name, "pam_sm_open_session") == 0) {
+    return PAM_SESSION_ERR;
+  } else if (strcmp(pam_fn_name, "pam_sm_close_session") == 0) {
+    return PAM_SESSION_ERR;
+  } else if (strcmp(pam_fn_name, "pam_sm_chauthtok") == 0) {
+    return PAM_TRY_AGAIN;
   }
   return PAM_ABORT;
 }
+// END GENERATED: errors
+
+// The item as sent to the Python process, item is NULL when it is not set
+static void to_ipc_item(struct ipc_item *out, int item_type, const void *item) {
+  out->item_type = item_type;
+  out->has_value = item != NULL;
+  if (item == NULL) {
+    return;
+  }
 
-int ipc_strerror(pam_handle_t *pamh, struct ipc_pipe p) {
-  int status, errnum;
+  if (item_type == PAM_XAUTHDATA) {
+    const struct pam_xauth_data *xauth = item;
+    out->value.xauth.name = xauth->name;
+    out->value.xauth.data.data = xauth->data;
+    out->value.xauth.data.length = xauth->datalen;
+  } else {
+    out->value.string = item;
+  }
+}
 
-  status = read_int(p.read_end, &errnum);
+// Items sent along with every request. The authentication tokens are left out,
+// they only leave the PAM host when the handler asks for them.
+static const int snapshot_items[] = {PAM_SERVICE, PAM_USER,     PAM_USER_PROMPT, PAM_TTY,          PAM_RUSER,
+                                     PAM_RHOST,   PAM_XDISPLAY, PAM_XAUTHDATA,   PAM_AUTHTOK_TYPE};
+
+#define SNAPSHOT_SIZE (int)(sizeof(snapshot_items) / sizeof(snapshot_items[0]))
+
+// Returns the number of items
+static int get_items(pam_handle_t *pamh, struct ipc_item *items) {
+  int count = 0;
+
+  // Failed ones are asked for by the handler, if at all
+  for (int i = 0; i < SNAPSHOT_SIZE; i++) {
+    const void *item = NULL;
+    if (pam_get_item(pamh, snapshot_items[i], &item) == PAM_SUCCESS) {
+      to_ipc_item(&items[count++], snapshot_items[i], item);
+    }
+  }
+  return count;
+}
+
+int ipc_send_request(struct ipc_pipe p, uint32_t request_id, pam_handle_t *pamh, char *pam_fn_name, int flags,
+                     int log_level, int argc, const char **argv) {
+  struct ipc_item items[SNAPSHOT_SIZE];
+  struct ipc_request_to_python request = {
+      .fn_name = pam_fn_name,
+      .flags = flags,
+      .log_level = log_level,
+      .args_count = argc,
+      .args = argv,
+      .items_count = get_items(pamh, items),
+      .items = items,
+  };
+  struct ipc_message m;
+
+  ipc_message_init(&m);
+  int status = ipc_encode_request(&m, &request);
+  if (status == SUCCESS) {
+    status = ipc_write_frame(p, PAM_PYTHON_REQUEST, request_id, &m);
+  }
+  ipc_message_free(&m);
+  return status;
+}
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGNMENT  _Alignof(max_align_t)
+
+// New blocks are zeroed, and so is whatever a reset gives back
+static struct ipc_arena_block *new_block(bool locked, size_t size) {
+  size_t total = sizeof(struct ipc_arena_block) + size;
+  struct ipc_arena_block *block;
+
+  if (locked) {
+    long page = sysconf(_SC_PAGESIZE);
+    total = (total + page - 1) / page * page;
+    block = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+      return NULL;
+    }
+    madvise(block, total, MADV_DONTDUMP);
+    // Best effort, RLIMIT_MEMLOCK may not allow it
+    mlock(block, total);
+  } else {
+    block = calloc(1, total);
+    if (!block) {
+      return NULL;
+    }
+  }
+
+  block->next = NULL;
+  block->size = total - sizeof(struct ipc_arena_block);
+  block->used = 0;
+  return block;
+}
+
+static void free_blocks(bool locked, struct ipc_arena_block *block) {
+  while (block) {
+    struct ipc_arena_block *next = block->next;
+    size_t total = sizeof(struct ipc_arena_block) + block->size;
+
+    explicit_bzero(block->data, block->used);
+    if (locked) {
+      munlock(block, total);
+      munmap(block, total);
+    } else {
+      free(block);
+    }
+    block = next;
+  }
+}
+
+void ipc_arena_init(struct ipc_arena *a, bool locked) {
+  a->blocks = NULL;
+  a->locked = locked;
+}
+
+// Offset of the next aligned allocation in block
+static size_t next_offset(const struct ipc_arena_block *block) {
+  uintptr_t end = (uintptr_t)(block->data + block->used);
+  return block->used + (-end & (ARENA_ALIGNMENT - 1));
+}
+
+void *ipc_arena_alloc(struct ipc_arena *a, size_t size) {
+  struct ipc_arena_block *block = a->blocks;
+  size_t offset = block ? next_offset(block) : 0;
+
+  if (!block || offset > block->size || size > block->size - offset) {
+    size_t needed = size + ARENA_ALIGNMENT;
+    block = new_block(a->locked, needed > ARENA_BLOCK_SIZE ? needed : ARENA_BLOCK_SIZE);
+    if (!block) {
+      return NULL;
+    }
+    block->next = a->blocks;
+    a->blocks = block;
+    offset = next_offset(block);
+  }
+
+  block->used = offset + size;
+  return block->data + offset;
+}
+
+void ipc_arena_reset(struct ipc_arena *a) {
+  struct ipc_arena_block *kept = a->blocks;
+  if (!kept) {
+    return;
+  }
+
+  free_blocks(a->locked, kept->next);
+  kept->next = NULL;
+  explicit_bzero(kept->data, kept->used);
+  kept->used = 0;
+}
+
+void ipc_arena_free(struct ipc_arena *a) {
+  free_blocks(a->locked, a->blocks);
+  a->blocks = NULL;
+}
+
+// ipc_get_string() copying into the arena
+static int get_string(struct ipc_arena *a, struct ipc_frame *call, const char **str) {
+  const char *data;
+  int length;
+
+  int status = ipc_get_data(call, &data, &length);
   OK(status);
 
-  const char *str = pam_strerror(pamh, errnum);
+  char *copy = ipc_arena_alloc(a, (size_t)length + 1);
+  if (!copy) {
+    return MALLOC_ERR;
+  }
+  memcpy(copy, data, length);
+  copy[length] = '\0';
+  *str = copy;
+  return SUCCESS;
+}
 
-  status = write_int(p.write_end, strlen(str));
+// BEGIN GENERATED by make.py: codec
+static int decode_xauth(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_xauth *r) {
+  int status;
+  status = get_string(arena, frame, &r->name);
   OK(status);
+  status = ipc_get_data(frame, &r->data.data, &r->data.length);
+  OK(status);
+  return SUCCESS;
+}
 
-  status = write_string(p.write_end, (char *)str, strlen(str));
+static int decode_new_item(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_new_item *r) {
+  int status;
+  status = ipc_get_int(frame, &r->item_type);
   OK(status);
+  if (r->item_type == PAM_XAUTHDATA) {
+    status = decode_xauth(frame, arena, &r->value.xauth);
+    OK(status);
+  } else {
+    status = get_string(arena, frame, &r->value.string);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
+static int decode_prompt(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_prompt *r) {
+  int status;
+  status = ipc_get_int(frame, &r->msg_style);
+  OK(status);
+  if (r->msg_style == PAM_BINARY_PROMPT) {
+    status = ipc_get_data(frame, &r->msg.bytes.data, &r->msg.bytes.length);
+    OK(status);
+  } else {
+    status = get_string(arena, frame, &r->msg.string);
+    OK(status);
+  }
   return SUCCESS;
 }
 
-int ipc_get_item(pam_handle_t *pamh, struct ipc_pipe p) {
-  int item_type;
-  int status = read_int(p.read_end, &item_type);
+static int decode_log_record(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_log_record *r) {
+  int status;
+  (void)arena;
+  status = ipc_get_int(frame, &r->priority);
+  OK(status);
+  status = ipc_get_data(frame, &r->msg.data, &r->msg.length);
   OK(status);
+  return SUCCESS;
+}
 
-  if (item_type == PAM_XAUTHDATA) {
-    struct pam_xauth_data *xauth;
+static int encode_xauth(struct ipc_message *m, const struct ipc_xauth *r) {
+  int status;
+  status = ipc_put_string(m, r->name);
+  OK(status);
+  status = ipc_put_data(m, r->data.data, r->data.length);
+  OK(status);
+  return SUCCESS;
+}
 
-    int retval = pam_get_item(pamh, item_type, (const void **)&xauth);
-    status = write_int(p.write_end, retval);
-    OK(status);
+static size_t encoded_xauth_size(const struct ipc_xauth *r) {
+  size_t size = 0;
+  size += sizeof(int32_t) + strlen(r->name);
+  size += sizeof(int32_t) + r->data.length;
+  return size;
+}
 
-    if (pam_retval == PAM_SUCCESS) {
-      status = write_int(p.write_end, xauth->namelen);
-      OK(status);
-      status = write_string(p.write_end, xauth->name, xauth->namelen);
-      OK(status);
-      status = write_int(p.write_end, xauth->datalen);
+static int encode_item(struct ipc_message *m, const struct ipc_item *r) {
+  int status;
+  status = ipc_put_int(m, r->item_type);
+  OK(status);
+  status = ipc_put_int(m, r->has_value);
+  OK(status);
+  if (r->has_value) {
+    if (r->item_type == PAM_XAUTHDATA) {
+      status = encode_xauth(m, &r->value.xauth);
       OK(status);
-      status = write_string(p.write_end, xauth->data, xauth->datalen);
+    } else {
+      status = ipc_put_string(m, r->value.string);
       OK(status);
     }
+  }
+  return SUCCESS;
+}
 
-    return SUCCESS;
-  } else {
-    char *item;
+static size_t encoded_item_size(const struct ipc_item *r) {
+  size_t size = 0;
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  if (r->has_value) {
+    if (r->item_type == PAM_XAUTHDATA) {
+      size += encoded_xauth_size(&r->value.xauth);
+    } else {
+      size += sizeof(int32_t) + strlen(r->value.string);
+    }
+  }
+  return size;
+}
 
-    retval = pam_get_item(pamh, item_type, (const void **)&item);
-    status = write_int(p.write_end, retval);
+static int encode_response(struct ipc_message *m, const struct ipc_response *r) {
+  int status;
+  status = ipc_put_int(m, r->resp_retcode);
+  OK(status);
+  status = ipc_put_int(m, r->has_resp);
+  OK(status);
+  if (r->has_resp) {
+    status = ipc_put_data(m, r->resp.data, r->resp.length);
     OK(status);
+  }
+  return SUCCESS;
+}
 
-    if (retval == PAM_SUCCESS) {
-      status = write_int(p.write_end, strlen(item));
-      OK(status);
-      status = write_string(p.write_end, item, strlen(item));
-      OK(status);
-    }
-
-    return SUCCESS;
+static size_t encoded_response_size(const struct ipc_response *r) {
+  size_t size = 0;
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  if (r->has_resp) {
+    size += sizeof(int32_t) + r->resp.length;
   }
+  return size;
 }
 
-int ipc_set_item(pam_handle_t *pamh, struct ipc_pipe p) {
-  int item_type;
-  int status = read_int(p.read_end, &item_type);
+int ipc_decode_get_item(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_get_item_to_host *r) {
+  int status;
+  (void)arena;
+  status = ipc_get_int(frame, &r->item_type);
   OK(status);
+  return SUCCESS;
+}
 
-  if (item_type == PAM_XAUTHDATA) {
-    struct pam_xauth_data *xauth = malloc(sizeof(struct pam_xauth_data));
-    if (!xauth) return MALLOC_ERR;
+int ipc_decode_set_item(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_set_item_to_host *r) {
+  int status;
+  status = ipc_get_int(frame, &r->items_count);
+  OK(status);
+  if (r->items_count < 0 || (size_t)r->items_count > (frame->length - frame->pos) / 8) {
+    return READ_ERR;
+  }
+  r->items = ipc_arena_alloc(arena, (size_t)r->items_count * sizeof(*r->items));
+  if (!r->items) {
+    return MALLOC_ERR;
+  }
+  for (int i = 0; i < r->items_count; i++) {
+    status = decode_new_item(frame, arena, &r->items[i]);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
-    status = read_int(p.read_end, &xauth->namelen);
-    OK_GOTO(status);
+int ipc_decode_get_user(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_get_user_to_host *r) {
+  int status;
+  int set;
+  status = ipc_get_int(frame, &set);
+  OK(status);
+  r->has_prompt = set;
+  if (r->has_prompt) {
+    status = get_string(arena, frame, &r->prompt);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
-    xauth->name = malloc(xauth->namelen + 1);
-    if (!xauth->name) {
-      status = MALLOC_ERR;
-      goto cleanup;
-    }
+int ipc_decode_converse(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_converse_to_host *r) {
+  int status;
+  status = ipc_get_int(frame, &r->msgs_count);
+  OK(status);
+  if (r->msgs_count < 0 || (size_t)r->msgs_count > (frame->length - frame->pos) / 8) {
+    return READ_ERR;
+  }
+  r->msgs = ipc_arena_alloc(arena, (size_t)r->msgs_count * sizeof(*r->msgs));
+  if (!r->msgs) {
+    return MALLOC_ERR;
+  }
+  for (int i = 0; i < r->msgs_count; i++) {
+    status = decode_prompt(frame, arena, &r->msgs[i]);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
-    status = read_string(p.read_end, name, xauth->namelen);
-    OK_GOTO(status);
+int ipc_decode_fail_delay(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_fail_delay_to_host *r) {
+  int status;
+  (void)arena;
+  status = ipc_get_int(frame, &r->usec);
+  OK(status);
+  return SUCCESS;
+}
 
-    status = read_int(p.read_end, &xauth->datalen);
-    OK_GOTO(status);
+int ipc_decode_strerror(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_strerror_to_host *r) {
+  int status;
+  (void)arena;
+  status = ipc_get_int(frame, &r->err_num);
+  OK(status);
+  return SUCCESS;
+}
 
-    xauth->data = malloc(xauth->datalen);
-    if (xauth->data) {
-      status = MALLOC_ERR;
-      goto cleanup;
-    }
+int ipc_decode_syslog(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_syslog_to_host *r) {
+  int status;
+  status = ipc_get_int(frame, &r->records_count);
+  OK(status);
+  if (r->records_count < 0 || (size_t)r->records_count > (frame->length - frame->pos) / 8) {
+    return READ_ERR;
+  }
+  r->records = ipc_arena_alloc(arena, (size_t)r->records_count * sizeof(*r->records));
+  if (!r->records) {
+    return MALLOC_ERR;
+  }
+  for (int i = 0; i < r->records_count; i++) {
+    status = decode_log_record(frame, arena, &r->records[i]);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
-    status = read_bytes(p.read_end, data, xauth->datalen);
-    OK_GOTO(status);
+int ipc_decode_return(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_return_to_host *r) {
+  int status;
+  (void)arena;
+  status = ipc_get_int(frame, &r->retval);
+  OK(status);
+  return SUCCESS;
+}
 
-    int retval = pam_set_item(pamh, item_type, xauth);
-    status = write_int(p.write_end, retval);
+int ipc_encode_get_item(struct ipc_message *m, const struct ipc_get_item_to_python *r) {
+  int status;
+  status = ipc_put_int(m, r->retval);
+  OK(status);
+  status = encode_item(m, &r->item);
+  OK(status);
+  return SUCCESS;
+}
 
-  cleanup:
-    if (xauth->name) free(xauth->name);
-    if (xauth->data) free(xauth->data);
-    if (xauth) free(xauth);
-    return status;
-  } else {
-    int len;
+size_t ipc_get_item_size(const struct ipc_get_item_to_python *r) {
+  size_t size = 0;
+  size += sizeof(int32_t);
+  size += encoded_item_size(&r->item);
+  return size;
+}
 
-    status = read_int(p.read_end, &len);
+int ipc_encode_get_user(struct ipc_message *m, const struct ipc_get_user_to_python *r) {
+  int status;
+  status = ipc_put_int(m, r->retval);
+  OK(status);
+  status = ipc_put_int(m, r->has_user);
+  OK(status);
+  if (r->has_user) {
+    status = ipc_put_string(m, r->user);
     OK(status);
+  }
+  return SUCCESS;
+}
 
-    char *item = malloc(len + 1);
-    if (!item) return MALLOC_ERR;
+size_t ipc_get_user_size(const struct ipc_get_user_to_python *r) {
+  size_t size = 0;
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  if (r->has_user) {
+    size += sizeof(int32_t) + strlen(r->user);
+  }
+  return size;
+}
 
-    status = read_string(p.read_end, item, len);
-    if (status != SUCCESS) {
-      free(item);
-      return status;
-    }
+int ipc_encode_converse(struct ipc_message *m, const struct ipc_converse_to_python *r) {
+  int status;
+  status = ipc_put_int(m, r->retval);
+  OK(status);
+  status = ipc_put_int(m, r->responses_count);
+  OK(status);
+  for (int i = 0; i < r->responses_count; i++) {
+    status = encode_response(m, &r->responses[i]);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
-    int retval = pam_set_item(pamh, item_type, (const void *)item);
-    status = write_int(p.write_end, retval);
-    free(item);
-    return status;
+size_t ipc_converse_size(const struct ipc_converse_to_python *r) {
+  size_t size = 0;
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  for (int i = 0; i < r->responses_count; i++) {
+    size += encoded_response_size(&r->responses[i]);
   }
+  return size;
 }
 
-int ipc_fail_delay(pam_handle_t *pamh, struct ipc_pipe p) {
-  int status, delay;
+int ipc_encode_fail_delay(struct ipc_message *m, const struct ipc_fail_delay_to_python *r) {
+  int status;
+  status = ipc_put_int(m, r->retval);
+  OK(status);
+  return SUCCESS;
+}
+
+size_t ipc_fail_delay_size(const struct ipc_fail_delay_to_python *r) {
+  size_t size = 0;
+  (void)r;
+  size += sizeof(int32_t);
+  return size;
+}
 
-  status = read_int(p.read_end, &delay);
+int ipc_encode_strerror(struct ipc_message *m, const struct ipc_strerror_to_python *r) {
+  int status;
+  status = ipc_put_string(m, r->description);
   OK(status);
+  return SUCCESS;
+}
+
+size_t ipc_strerror_size(const struct ipc_strerror_to_python *r) {
+  size_t size = 0;
+  size += sizeof(int32_t) + strlen(r->description);
+  return size;
+}
 
-  int retval = pam_fail_delay(pamh, delay);
-  status = write_int(p.write_end, retval);
+int ipc_encode_request(struct ipc_message *m, const struct ipc_request_to_python *r) {
+  int status;
+  status = ipc_put_string(m, r->fn_name);
+  OK(status);
+  status = ipc_put_int(m, r->flags);
+  OK(status);
+  status = ipc_put_int(m, r->log_level);
+  OK(status);
+  status = ipc_put_int(m, r->args_count);
+  OK(status);
+  for (int i = 0; i < r->args_count; i++) {
+    status = ipc_put_string(m, r->args[i]);
+    OK(status);
+  }
+  status = ipc_put_int(m, r->items_count);
   OK(status);
+  for (int i = 0; i < r->items_count; i++) {
+    status = encode_item(m, &r->items[i]);
+    OK(status);
+  }
+  return SUCCESS;
+}
 
+size_t ipc_request_size(const struct ipc_request_to_python *r) {
+  size_t size = 0;
+  size += sizeof(int32_t) + strlen(r->fn_name);
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  size += sizeof(int32_t);
+  for (int i = 0; i < r->args_count; i++) {
+    size += sizeof(int32_t) + strlen(r->args[i]);
+  }
+  size += sizeof(int32_t);
+  for (int i = 0; i < r->items_count; i++) {
+    size += encoded_item_size(&r->items[i]);
+  }
+  return size;
+}
+// END GENERATED: codec
+
+// A reply which may carry an authentication token is encoded into the secret
+// arena. The message cannot grow there, so its size has to be known up front.
+static int secret_message(struct ipc_scratch *scratch, struct ipc_message *m, size_t size) {
+  char *buffer = ipc_arena_alloc(&scratch->secret, size);
+  if (!buffer) {
+    return MALLOC_ERR;
+  }
+  ipc_message_init_buffer(m, buffer, size);
   return SUCCESS;
 }
 
-int ipc_converse(pam_handle_t *pamh, struct ipc_pipe p) {
-  int status, retval, num_msgs;
-  struct pam_conv *conv;
+// Replies carry the opcode and the request id of the call. status is the
+// outcome of encoding m, which is freed either way.
+static int reply(struct ipc_queue *q, struct ipc_frame *call, struct ipc_message *m, int status) {
+  if (status == SUCCESS) {
+    status = ipc_queue_frame(q, call->opcode, call->request_id, m);
+  }
+  ipc_message_free(m);
+  return status;
+}
+
+int ipc_strerror(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_strerror_to_host in;
+  struct ipc_strerror_to_python out;
+  struct ipc_message m;
 
-  status = read_int(p.read_end, &num_msgs);
+  int status = ipc_decode_strerror(call, &scratch->plain, &in);
   OK(status);
 
-  retval = pam_get_item(pamh, PAM_CONV, (const void **)&conv);
+  out.description = pam_strerror(pamh, in.err_num);
+
+  ipc_message_init(&m);
+  return reply(q, call, &m, ipc_encode_strerror(&m, &out));
+}
+
+int ipc_get_item(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_get_item_to_host in;
+  struct ipc_get_item_to_python out;
+  struct ipc_message m;
+  const void *item = NULL;
+
+  int status = ipc_decode_get_item(call, &scratch->plain, &in);
+  OK(status);
+
+  out.retval = pam_get_item(pamh, in.item_type, &item);
+  to_ipc_item(&out.item, in.item_type, out.retval == PAM_SUCCESS ? item : NULL);
+
+  ipc_message_init(&m);
+  if (in.item_type == PAM_AUTHTOK || in.item_type == PAM_OLDAUTHTOK) {
+    status = secret_message(scratch, &m, ipc_get_item_size(&out));
+    OK(status);
+  }
+  return reply(q, call, &m, ipc_encode_get_item(&m, &out));
+}
+
+static void set_item(pam_handle_t *pamh, const struct ipc_new_item *item) {
+  int retval;
+
+  if (item->item_type == PAM_XAUTHDATA) {
+    // libpam copies the item
+    struct pam_xauth_data xauth = {0};
+    xauth.name = (char *)item->value.xauth.name;
+    xauth.namelen = strlen(xauth.name);
+    xauth.data = (char *)item->value.xauth.data.data;
+    xauth.datalen = item->value.xauth.data.length;
+
+    retval = pam_set_item(pamh, item->item_type, &xauth);
+  } else {
+    retval = pam_set_item(pamh, item->item_type, item->value.string);
+  }
+
+  // The handler does not wait for the outcome
   if (retval != PAM_SUCCESS) {
-    status = write_int(p.write_end, retval);
-    return status;
+    pam_syslog(pamh, LOG_ERR, "Failed to set item %d: %s", item->item_type, pam_strerror(pamh, retval));
   }
+}
 
-  struct pam_message **msgs = malloc(num_msgs * sizeof(struct pam_message *));
-  if (!pam_message) {
-    return MALLOC_ERR;
+int ipc_set_item(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_set_item_to_host in;
+  (void)q;
+
+  // The items might be PAM_AUTHTOK
+  int status = ipc_decode_set_item(call, &scratch->secret, &in);
+  OK(status);
+
+  for (int i = 0; i < in.items_count; i++) {
+    set_item(pamh, &in.items[i]);
   }
+  return SUCCESS;
+}
 
-  int len;
-  for (int i = 0; i < num_msgs; i++) {
-    msgs[i] = malloc(sizeof(struct pam_message));
-    if (!msgs[i]) goto cleanup;
+int ipc_get_user(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_get_user_to_host in;
+  struct ipc_get_user_to_python out;
+  struct ipc_message m;
+  const char *user = NULL;
+
+  int status = ipc_decode_get_user(call, &scratch->plain, &in);
+  OK(status);
+
+  out.retval = pam_get_user(pamh, &user, in.has_prompt ? in.prompt : NULL);
+  out.has_user = out.retval == PAM_SUCCESS;
+  out.user = user ? user : "";
+
+  ipc_message_init(&m);
+  return reply(q, call, &m, ipc_encode_get_user(&m, &out));
+}
+
+int ipc_fail_delay(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_fail_delay_to_host in;
+  struct ipc_fail_delay_to_python out;
+  struct ipc_message m;
+
+  int status = ipc_decode_fail_delay(call, &scratch->plain, &in);
+  OK(status);
+
+  out.retval = pam_fail_delay(pamh, in.usec);
+
+  ipc_message_init(&m);
+  return reply(q, call, &m, ipc_encode_fail_delay(&m, &out));
+}
 
-    status = read_int(p.read_end, &msgs[i]->msg_style);
-    OK_GOTO(status);
-    status = read_int(p.read_end, &len);
-    OK_GOTO(status);
+// Linux-PAM binary prompts and their responses start with their total length
+// (big-endian, the 5 byte header included) followed by a control byte
+#define BINARY_PROMPT_HEADER 5
 
-    msgs[i]->msg = malloc(len + 1);
-    if (!msgs[i]->msg) goto cleanup;
+static size_t binary_prompt_length(const void *prompt) {
+  uint32_t length;
+  memcpy(&length, prompt, sizeof(length));
+  return ntohl(length);
+}
+
+static bool is_binary(const struct pam_message *msg) {
+  return msg->msg_style == PAM_BINARY_PROMPT;
+}
 
-    status = read_string(p.read_end, (char *)msgs[i]->msg, len);
-    OK_GOTO(status);
+// Binary prompts point into the call, text ones are NUL-terminated copies
+static int to_pam_message(struct pam_message *msg, const struct ipc_prompt *prompt) {
+  msg->msg_style = prompt->msg_style;
+  if (!is_binary(msg)) {
+    msg->msg = prompt->msg.string;
+    return SUCCESS;
   }
 
-  struct pam_response *resps;
-  retval = conv->conv(num_msgs, (const struct pam_message **)msgs, &resps, conv->appdata_ptr);
-  if (retval != PAM_SUCCESS) {
-    write_int(p.write_end, retval);
-    goto cleanup;
+  const struct ipc_bytes *data = &prompt->msg.bytes;
+  if (data->length < BINARY_PROMPT_HEADER || binary_prompt_length(data->data) != (size_t)data->length) {
+    return READ_ERR;
   }
+  msg->msg = data->data;
+  return SUCCESS;
+}
 
-  status = write_int(p.write_end, PAM_SUCCESS);
-  OK_GOTO(status);
+// The application allocated the response, so all a binary one can be checked
+// against is the length it claims. False when that is not plausible.
+static bool response_length(const struct pam_message *msg, const struct pam_response *resp, size_t *length) {
+  if (!is_binary(msg)) {
+    *length = strlen(resp->resp);
+    return true;
+  }
 
-  for (int i = 0; i < num_msgs; i++) {
-    status = write_int(p.write_end, resps[i].resp_retcode);
-    OK_GOTO(status);
+  *length = binary_prompt_length(resp->resp);
+  if (*length < BINARY_PROMPT_HEADER || *length > IPC_MAX_PAYLOAD) {
+    *length = 0;
+    return false;
+  }
+  return true;
+}
 
-    if (!resps[i].resp) {
-      status = write_int(p.write_end, 0);
-      OK_GOTO(status);
-    } else {
-      int len = strlen(resps[i].resp);
+int ipc_converse(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_converse_to_host in;
+  struct ipc_converse_to_python out = {0};
+  const struct pam_conv *conv;
+  struct pam_response *resps = NULL;
+  struct ipc_message m;
 
-      status = write_int(p.write_end, len);
-      OK_GOTO(status);
+  int status = ipc_decode_converse(call, &scratch->plain, &in);
+  OK(status);
+  int num_msgs = in.msgs_count;
+  if (num_msgs <= 0 || num_msgs > PAM_MAX_NUM_MSG) {
+    return READ_ERR;
+  }
 
-      status = write_string(p.write_end, resps[i].resp, len);
-      OK_GOTO(status);
-    }
+  struct pam_message **msgs = ipc_arena_alloc(&scratch->plain, num_msgs * sizeof(struct pam_message *));
+  struct pam_message *msg_structs = ipc_arena_alloc(&scratch->plain, num_msgs * sizeof(struct pam_message));
+  out.responses = ipc_arena_alloc(&scratch->plain, num_msgs * sizeof(struct ipc_response));
+  if (!msgs || !msg_structs || !out.responses) {
+    return MALLOC_ERR;
   }
 
-cleanup:
   for (int i = 0; i < num_msgs; i++) {
-    if (msgs[i]) {
-      if (msgs[i]->msg) free(msgs[i]->msg);
-      free(msgs[i]);
+    msgs[i] = &msg_structs[i];
+    status = to_pam_message(msgs[i], &in.msgs[i]);
+    OK(status);
+  }
+
+  out.retval = pam_get_item(pamh, PAM_CONV, (const void **)&conv);
+  if (out.retval == PAM_SUCCESS && (!conv || !conv->conv)) {
+    out.retval = PAM_CONV_ERR;
+  }
+  if (out.retval == PAM_SUCCESS) {
+    out.retval = conv->conv(num_msgs, (const struct pam_message **)msgs, &resps, conv->appdata_ptr);
+  }
+  if (out.retval == PAM_SUCCESS && !resps) {
+    out.retval = PAM_CONV_ERR;
+  }
+
+  // Responses are only sent, and wiped, with a length we believe
+  for (int i = 0; resps && i < num_msgs; i++) {
+    struct ipc_response *resp = &out.responses[i];
+    size_t length = 0;
+
+    if (resps[i].resp && !response_length(msgs[i], &resps[i], &length) && out.retval == PAM_SUCCESS) {
+      out.retval = PAM_CONV_ERR;
     }
+    resp->resp_retcode = resps[i].resp_retcode;
+    resp->has_resp = resps[i].resp != NULL;
+    resp->resp.data = resps[i].resp;
+    resp->resp.length = length;
+  }
+  if (out.retval == PAM_SUCCESS) {
+    out.responses_count = num_msgs;
+  }
+
+  // The responses are likely to be passwords
+  ipc_message_init(&m);
+  status = secret_message(scratch, &m, ipc_converse_size(&out));
+  if (status == SUCCESS) {
+    status = reply(q, call, &m, ipc_encode_converse(&m, &out));
   }
-  free(msgs);
 
   // We are responsible for freeing the responses
   if (resps) {
     for (int i = 0; i < num_msgs; i++) {
       if (resps[i].resp) {
-        int len = strlen(resps[i].resp);
         // Overwriting ensures we don't leak any sensitive data like passwords
-        memset(resps[i].resp, 0, len);
+        memset(resps[i].resp, 0, out.responses[i].resp.length);
         free(resps[i].resp);
       }
     }
@@ -246,27 +808,29 @@ cleanup:
   return status;
 }
 
-int ipc_syslog(pam_handle_t *pamh, struct ipc_pipe p) {
-  int status, priority, len;
-  char *msg;
-
-  status = read_int(p.read_end, &priority);
-  OK(status);
+int ipc_syslog(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q) {
+  struct ipc_syslog_to_host in;
+  (void)q;
 
-  status = read_int(p.read_end, &len);
+  int status = ipc_decode_syslog(call, &scratch->plain, &in);
   OK(status);
 
-  msg = malloc(len + 1);
-  if (!msg) return MALLOC_ERR;
-
-  status = read_string(p.read_end, msg, len);
-  if (status != SUCCESS) {
-    free(msg);
-    return status;
+  // Nothing is sent back, the Python process does not wait for us
+  for (int i = 0; i < in.records_count; i++) {
+    const struct ipc_log_record *record = &in.records[i];
+    pam_syslog(pamh, record->priority, "%.*s", record->msg.length, record->msg.data);
   }
-
-  pam_syslog(pamh, priority, "%s", msg);
-
-  free(msg);
   return SUCCESS;
-}
\ No newline at end of file
+}
+
+// BEGIN GENERATED by make.py: handlers
+const ipc_handler ipc_handlers[PAM_PYTHON_OPCODE_COUNT] = {
+  [PAM_PYTHON_GET_ITEM] = ipc_get_item,
+  [PAM_PYTHON_SET_ITEM] = ipc_set_item,
+  [PAM_PYTHON_GET_USER] = ipc_get_user,
+  [PAM_PYTHON_CONVERSE] = ipc_converse,
+  [PAM_PYTHON_FAIL_DELAY] = ipc_fail_delay,
+  [PAM_PYTHON_STRERROR] = ipc_strerror,
+  [PAM_PYTHON_SYSLOG] = ipc_syslog,
+};
+// END GENERATED: handlers
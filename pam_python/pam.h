@@ -1,20 +1,24 @@
 #ifndef _PAM_PYTHON_PAM_H
 #define _PAM_PYTHON_PAM_H
 
-#include <Python.h>
+#include <arpa/inet.h>
 #include <security/pam_appl.h>
 #include <security/pam_ext.h>
 #include <security/pam_modules.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "pipe.h"
 
+// Opcodes of the frames, listed in make.py
+// BEGIN GENERATED by make.py: opcodes
 #define PAM_PYTHON_GET_ITEM   1
 #define PAM_PYTHON_SET_ITEM   2
 #define PAM_PYTHON_GET_USER   3
@@ -22,19 +26,226 @@
 #define PAM_PYTHON_FAIL_DELAY 5
 #define PAM_PYTHON_STRERROR   6
 #define PAM_PYTHON_SYSLOG     7
+#define PAM_PYTHON_REQUEST    8
+#define PAM_PYTHON_RETURN     9
 
+// One past the largest opcode
+#define PAM_PYTHON_OPCODE_COUNT 10
+// END GENERATED: opcodes
+
+// Errors of each pam_sm_* function, generated from PAM_FUNCTIONS in make.py
+// (the Python side gets the same default errors)
 int get_default_err(char *pam_fn_name);
 
-int ipc_strerror(pam_handle_t *pamh, struct ipc_pipe p);
+// Returned when a call is shed by admission control: the service is
+// unavailable rather than the credentials wrong, so the application can say so
+int get_shed_err(char *pam_fn_name);
+
+// The request carries a snapshot of the PAM items, which the handler reads
+// without asking for them (except for the authentication tokens)
+int ipc_send_request(struct ipc_pipe p, uint32_t request_id, pam_handle_t *pamh, char *pam_fn_name, int flags,
+                     int log_level, int argc, const char **argv);
+
+// Bump allocator for what the handlers decode. Everything a call needed is
+// released at once (and zeroed) when the call has been served.
+struct ipc_arena_block {
+  struct ipc_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct ipc_arena {
+  struct ipc_arena_block *blocks;
+  // The blocks are mlock'd and left out of core dumps, for secrets
+  bool locked;
+};
+
+void ipc_arena_init(struct ipc_arena *a, bool locked);
+
+// Zeroed memory which lives until the next reset, NULL on failure
+void *ipc_arena_alloc(struct ipc_arena *a, size_t size);
+
+// Zero everything handed out, one block is kept for the next call
+void ipc_arena_reset(struct ipc_arena *a);
+
+void ipc_arena_free(struct ipc_arena *a);
+
+// Where the handlers decode a call. Reset after every call.
+struct ipc_scratch {
+  struct ipc_arena plain;
+  // For whatever may hold an authentication token, calls decoded and replies encoded
+  struct ipc_arena secret;
+};
+
+// Length-prefixed bytes of a payload
+struct ipc_bytes {
+  const char *data;
+  int length;
+};
+
+// Payloads of the frames and their codecs, generated from the fields listed in make.py
+// BEGIN GENERATED by make.py: messages
+struct ipc_xauth {
+  const char *name;
+  struct ipc_bytes data;
+};
+
+struct ipc_item {
+  int item_type;
+  bool has_value;
+  union {
+    struct ipc_xauth xauth;
+    const char *string;
+  } value;
+};
+
+struct ipc_new_item {
+  int item_type;
+  union {
+    struct ipc_xauth xauth;
+    const char *string;
+  } value;
+};
+
+struct ipc_prompt {
+  int msg_style;
+  union {
+    struct ipc_bytes bytes;
+    const char *string;
+  } msg;
+};
+
+struct ipc_response {
+  int resp_retcode;
+  bool has_resp;
+  struct ipc_bytes resp;
+};
+
+struct ipc_log_record {
+  int priority;
+  struct ipc_bytes msg;
+};
+
+struct ipc_get_item_to_host {
+  int item_type;
+};
+
+struct ipc_set_item_to_host {
+  int items_count;
+  struct ipc_new_item *items;
+};
+
+struct ipc_get_user_to_host {
+  bool has_prompt;
+  const char *prompt;
+};
+
+struct ipc_converse_to_host {
+  int msgs_count;
+  struct ipc_prompt *msgs;
+};
+
+struct ipc_fail_delay_to_host {
+  int usec;
+};
+
+struct ipc_strerror_to_host {
+  int err_num;
+};
+
+struct ipc_syslog_to_host {
+  int records_count;
+  struct ipc_log_record *records;
+};
+
+struct ipc_return_to_host {
+  int retval;
+};
+
+struct ipc_get_item_to_python {
+  int retval;
+  struct ipc_item item;
+};
+
+struct ipc_get_user_to_python {
+  int retval;
+  bool has_user;
+  const char *user;
+};
+
+struct ipc_converse_to_python {
+  int retval;
+  int responses_count;
+  struct ipc_response *responses;
+};
+
+struct ipc_fail_delay_to_python {
+  int retval;
+};
+
+struct ipc_strerror_to_python {
+  const char *description;
+};
+
+struct ipc_request_to_python {
+  const char *fn_name;
+  int flags;
+  int log_level;
+  int args_count;
+  const char **args;
+  int items_count;
+  struct ipc_item *items;
+};
+
+// Decode the payloads sent to the PAM host, strings are copied into arena
+int ipc_decode_get_item(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_get_item_to_host *r);
+int ipc_decode_set_item(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_set_item_to_host *r);
+int ipc_decode_get_user(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_get_user_to_host *r);
+int ipc_decode_converse(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_converse_to_host *r);
+int ipc_decode_fail_delay(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_fail_delay_to_host *r);
+int ipc_decode_strerror(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_strerror_to_host *r);
+int ipc_decode_syslog(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_syslog_to_host *r);
+int ipc_decode_return(struct ipc_frame *frame, struct ipc_arena *arena, struct ipc_return_to_host *r);
+
+// Encode the payloads sent to the Python process, _size() is the length of the payload
+int ipc_encode_get_item(struct ipc_message *m, const struct ipc_get_item_to_python *r);
+size_t ipc_get_item_size(const struct ipc_get_item_to_python *r);
+int ipc_encode_get_user(struct ipc_message *m, const struct ipc_get_user_to_python *r);
+size_t ipc_get_user_size(const struct ipc_get_user_to_python *r);
+int ipc_encode_converse(struct ipc_message *m, const struct ipc_converse_to_python *r);
+size_t ipc_converse_size(const struct ipc_converse_to_python *r);
+int ipc_encode_fail_delay(struct ipc_message *m, const struct ipc_fail_delay_to_python *r);
+size_t ipc_fail_delay_size(const struct ipc_fail_delay_to_python *r);
+int ipc_encode_strerror(struct ipc_message *m, const struct ipc_strerror_to_python *r);
+size_t ipc_strerror_size(const struct ipc_strerror_to_python *r);
+int ipc_encode_request(struct ipc_message *m, const struct ipc_request_to_python *r);
+size_t ipc_request_size(const struct ipc_request_to_python *r);
+// END GENERATED: messages
+
+// Handlers of the calls made by the Python process. They decode the call
+// into scratch and queue the reply (if any) on q.
+
+int ipc_strerror(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
+
+int ipc_get_item(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
+
+// Sets every item of the batch, nothing is sent back. Failures are logged.
+int ipc_set_item(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
+
+int ipc_get_user(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
 
-int ipc_get_item(pam_handle_t *pamh, struct ipc_pipe p);
+int ipc_fail_delay(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
 
-int ipc_set_item(pam_handle_t *pamh, struct ipc_pipe p);
+int ipc_converse(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
 
-int ipc_fail_delay(pam_handle_t *pamh, struct ipc_pipe p);
+// A batch of log records, nothing is sent back
+int ipc_syslog(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch, struct ipc_queue *q);
 
-int ipc_converse(pam_handle_t *pamh, struct ipc_pipe p);
+typedef int (*ipc_handler)(pam_handle_t *pamh, struct ipc_frame *call, struct ipc_scratch *scratch,
+                           struct ipc_queue *q);
 
-int ipc_syslog(pam_handle_t *pamh, struct ipc_pipe p);
+// The handlers indexed by opcode, NULL for the frames which are not calls
+extern const ipc_handler ipc_handlers[PAM_PYTHON_OPCODE_COUNT];
 
 #endif
\ No newline at end of file
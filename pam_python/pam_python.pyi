@@ -1,6 +1,8 @@
 import syslog
 from dataclasses import dataclass
-from typing import List, Union
+from typing import Any, Generic, Iterable, List, TypeVar, Union
+
+T = TypeVar("T")
 
 
 class PamException(Exception):
@@ -14,24 +16,32 @@ class XAuthData:
 @dataclass
 class Message:
     msg_style: int
-    msg: str
+    # bytes for PAM_BINARY_PROMPT
+    msg: Union[str, bytes]
 
 @dataclass
 class Response:
-    resp: str
+    # bytes for PAM_BINARY_PROMPT
+    resp: Union[str, bytes, None]
     resp_retcode: int
 
+class PamFuture(Generic[T]):
+    def done(self) -> bool: ...
+    def result(self) -> T: ...
+
 class PamHandle:
+    PamFuture: type[PamFuture]
     PamException: type[PamException]
     XAuthData: type[XAuthData]
     Message: type[Message]
     Response: type[Response]
 
+    # BEGIN GENERATED by make.py: class constants
     # Return values
     PAM_SUCCESS                : int
     PAM_OPEN_ERR               : int
     PAM_SYMBOL_ERR             : int
-    PAM_SERVICE_ERRE           : int
+    PAM_SERVICE_ERR            : int
     PAM_SYSTEM_ERR             : int
     PAM_BUF_ERR                : int
     PAM_PERM_DENIED            : int
@@ -91,12 +101,20 @@ class PamHandle:
     PAM_PROMPT_ECHO_ON         : int
     PAM_ERROR_MSG              : int
     PAM_TEXT_INFO              : int
-    # Linux-Pam message style extensions
+    # Linux-PAM message style extensions
     PAM_RADIO_TYPE             : int
     PAM_BINARY_PROMPT          : int
     # Linux-PAM pam_set_data cleanup error_status
     PAM_DATA_REPLACE           : int
     PAM_DATA_SILENT            : int
+    # END GENERATED: class constants
+
+    pam_fn_name: str
+    log_level: int
+
+    # Outside of mode=inprocess, items are set in the PAM host once the handler
+    # calls into PAM again or returns. Setting one then only fails right away
+    # for an unknown item type, the PAM host logs any later failure.
 
     @property
     def service(self) -> str: ...
@@ -116,10 +134,11 @@ class PamHandle:
     @xauthdata.setter
     def xauthdata(self, value: XAuthData) -> None: ...
 
+    def get_items_async(self, item_types: Iterable[int]) -> List[PamFuture[Any]]: ...
     def get_user(self, prompt: Union[str, None] = None) -> str: ...
     def fail_delay(self, usec: int) -> None: ...
     def converse(self, msgs: Union[List[Message], Message]) -> List[Response]: ...
-    def prompt(self, msg: str, msg_style: int = PAM_PROMPT_ECHO_OFF) -> List[Response]: ...
+    def prompt(self, msg: Union[str, bytes], msg_style: int = PAM_PROMPT_ECHO_OFF) -> List[Response]: ...
     def strerror(self, err_num: int) -> str: ...
     def log(self, msg, priority=syslog.LOG_ERR) -> None: ...
     def debug(self, msg: str) -> None: ...
@@ -1,5 +1,7 @@
 #cython: language_level=3
+#cython: subinterpreters_compatible=own_gil
 
+import collections
 import importlib
 import importlib.util
 import os
@@ -9,12 +11,42 @@ from pathlib import Path
 from syslog import LOG_DEBUG, LOG_ERR
 from typing import List, Union
 
-from pam_python import io
+from libc.stdint cimport int32_t, uint32_t
+from libc.stdlib cimport calloc, free
+from libc.string cimport memcpy, memset, strlen
+from posix.mman cimport munmap
+
+from pam_python import cache
 
 cdef extern from "<security/pam_appl.h>":
-    pass
+    ctypedef struct pam_handle_t:
+        pass
+
+    struct pam_message:
+        int msg_style
+        const char *msg
+
+    struct pam_response:
+        char *resp
+        int resp_retcode
+
+    struct pam_conv:
+        int (*conv)(int num_msg, const pam_message **msg, pam_response **resp, void *appdata_ptr) nogil
+        void *appdata_ptr
+
+    struct pam_xauth_data:
+        int namelen
+        char *name
+        int datalen
+        char *data
+
+    int pam_get_item(const pam_handle_t *pamh, int item_type, const void **item)
+    int pam_set_item(pam_handle_t *pamh, int item_type, const void *item)
+    const char *pam_strerror(pam_handle_t *pamh, int errnum)
+    int pam_fail_delay(pam_handle_t *pamh, unsigned int musec_delay)
 
 cdef extern from "<security/pam_modules.h>":
+    # BEGIN GENERATED by make.py: constants
     # Return values
     cdef int PAM_SUCCESS
     cdef int PAM_OPEN_ERR
@@ -60,9 +92,9 @@ cdef extern from "<security/pam_modules.h>":
     cdef int PAM_PRELIM_CHECK
     cdef int PAM_UPDATE_AUTHTOK
     # Item types
-    cdef int PAM_SERVICE   
+    cdef int PAM_SERVICE
     cdef int PAM_USER
-    cdef int PAM_TTY  
+    cdef int PAM_TTY
     cdef int PAM_RHOST
     cdef int PAM_CONV
     cdef int PAM_AUTHTOK
@@ -78,35 +110,108 @@ cdef extern from "<security/pam_modules.h>":
     cdef int PAM_PROMPT_ECHO_OFF
     cdef int PAM_PROMPT_ECHO_ON
     cdef int PAM_ERROR_MSG
-    cdef int PAM_TEXT_INFO 
+    cdef int PAM_TEXT_INFO
     # Linux-PAM message style extensions
     cdef int PAM_RADIO_TYPE
     cdef int PAM_BINARY_PROMPT
     # Linux-PAM pam_set_data cleanup error_status
     cdef int PAM_DATA_REPLACE
     cdef int PAM_DATA_SILENT
+    # END GENERATED: constants
 
+    int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt) nogil
+
+
+cdef extern from "<security/pam_ext.h>":
+    void pam_syslog(const pam_handle_t *pamh, int priority, const char *fmt, ...)
 
 cdef extern from "pam.h":
+    # BEGIN GENERATED by make.py: opcodes
     cdef int PAM_PYTHON_GET_ITEM
     cdef int PAM_PYTHON_SET_ITEM
-    cdef int PAM_PYTHON_FAIL_DELAY
     cdef int PAM_PYTHON_GET_USER
     cdef int PAM_PYTHON_CONVERSE
-    cdef int PAM_PYTHON_STERROR
+    cdef int PAM_PYTHON_FAIL_DELAY
+    cdef int PAM_PYTHON_STRERROR
     cdef int PAM_PYTHON_SYSLOG
+    cdef int PAM_PYTHON_REQUEST
+    cdef int PAM_PYTHON_RETURN
+    # END GENERATED: opcodes
+
+cdef extern from "<arpa/inet.h>":
+    uint32_t ntohl(uint32_t netlong)
+
+cdef extern from "Python.h":
+    const char *PyUnicode_AsUTF8AndSize(object unicode, Py_ssize_t *size) except NULL
+
+cdef extern from "pipe.h":
+    cdef int SUCCESS
+    cdef int READ_EOF
+    cdef int MALLOC_ERR
+    cdef int IPC_MAX_PAYLOAD
+
+    struct shm_channel:
+        pass
+
+    struct ipc_pipe:
+        int read_end
+        int write_end
+        bint packet
+        shm_channel *shm
+        bint shm_host
+
+    struct ipc_message:
+        char *data
+        size_t length
+        size_t capacity
+
+    void ipc_message_init(ipc_message *m)
+    void ipc_message_free(ipc_message *m)
+    int ipc_put_int(ipc_message *m, int n)
+    int ipc_put_data(ipc_message *m, const char *data, int length)
+
+    struct ipc_queue:
+        ipc_pipe pipe
+        ipc_message frames
+        size_t count
+
+    void ipc_queue_init(ipc_queue *q, ipc_pipe p, bint locked)
+    void ipc_queue_free(ipc_queue *q)
+    int ipc_queue_frame(ipc_queue *q, int opcode, uint32_t request_id, const ipc_message *m) nogil
+    int ipc_queue_flush(ipc_queue *q) nogil
+
+    struct ipc_reader:
+        ipc_pipe pipe
+        char *buffer
+        size_t start
+        size_t end
+        size_t capacity
+
+    struct ipc_frame:
+        int opcode
+        uint32_t request_id
+        const char *payload
+        size_t length
+        size_t pos
+
+    void ipc_reader_init(ipc_reader *r, ipc_pipe p, bint locked)
+    void ipc_reader_free(ipc_reader *r)
+    int ipc_read_frame(ipc_reader *r, ipc_frame *frame) nogil
+    void *ipc_reader_take_mapping(ipc_reader *r, size_t *length)
 
 
 # Based on pam_deny.so
 # https://github.com/linux-pam/linux-pam/blob/master/modules/pam_deny/pam_deny.c
+# BEGIN GENERATED by make.py: default errors
 default_errors = {
     "pam_sm_authenticate": PAM_AUTH_ERR,
     "pam_sm_setcred": PAM_CRED_ERR,
     "pam_sm_acct_mgmt": PAM_AUTH_ERR,
     "pam_sm_open_session": PAM_SESSION_ERR,
     "pam_sm_close_session": PAM_SESSION_ERR,
-    "pam_sm_chauthtok": PAM_AUTHTOK_ERR
+    "pam_sm_chauthtok": PAM_AUTHTOK_ERR,
 }
+# END GENERATED: default errors
 
 
 class PamException(Exception):
@@ -141,58 +246,549 @@ class XAuthData:
 
 @dataclass
 class Message:
-    """Python equivalent for the 'pam_message' struct from _pam_types.h"""
+    """Python equivalent for the 'pam_message' struct from _pam_types.h
+
+    The msg of a PAM_BINARY_PROMPT is bytes: the whole binary prompt,
+    starting with its big-endian 32-bit length and a control byte.
+    """
 
     msg_style: int
-    msg: str
+    msg: Union[str, bytes]
 
 
 @dataclass
 class Response:
-    """Python equivalent for the 'pam_response' struct from _pam_types.h"""
+    """Python equivalent for the 'pam_response' struct from _pam_types.h
 
-    resp: str
+    The response to a PAM_BINARY_PROMPT is bytes, in the same format as the prompt.
+    """
+
+    resp: Union[str, bytes]
     resp_retcode: int
 
 
+# Size of the length and control byte every binary prompt starts with
+BINARY_PROMPT_HEADER = 5
+
+
+cdef size_t binary_prompt_length(const char *prompt):
+    cdef uint32_t length
+    memcpy(&length, prompt, sizeof(length))
+    return ntohl(length)
+
+
+cdef Py_ssize_t response_length(int msg_style, const char *resp):
+    """Length of a response from the application, -1 when a binary one claims an implausible length"""
+    if msg_style != PAM_BINARY_PROMPT:
+        return strlen(resp)
+
+    cdef size_t length = binary_prompt_length(resp)
+    if length < BINARY_PROMPT_HEADER or length > IPC_MAX_PAYLOAD:
+        return -1
+    return length
+
+
+cdef check_binary_prompt(msg):
+    if not isinstance(msg.msg, bytes) or len(msg.msg) < BINARY_PROMPT_HEADER or \
+            binary_prompt_length(msg.msg) != len(msg.msg):
+        raise ValueError("A binary prompt must be bytes starting with its own length and a control byte")
+
+
+class PamFuture:
+    """Result of a call which was sent to the PAM host without waiting for the reply
+
+    Returned by PamHandle.get_items_async(). result() waits for the reply,
+    replies to the calls made before it are received on the way.
+
+    Example:
+        user, rhost = [f.result() for f in pamh.get_items_async([pamh.PAM_USER, pamh.PAM_RHOST])]
+    """
+
+    def __init__(self, wait=None):
+        # wait(future) receives replies until the future is done
+        self._wait = wait
+        self._done = False
+        self._value = None
+
+    @classmethod
+    def completed(cls, value):
+        future = cls()
+        future.set_result(value)
+        return future
+
+    def set_result(self, value):
+        self._value = value
+        self._done = True
+
+    def done(self):
+        return self._done
+
+    def result(self):
+        while not self._done:
+            self._wait(self)
+        return self._value
+
+    def _then(self, fn):
+        """Future of fn(result)"""
+        return PamFuture(lambda future: future.set_result(fn(self.result())))
+
+
 def exit_on_io_error(f):
-    def _check_errors(self: PamHandle, *args, **kwargs):
+    def _check_errors(self: IPCWrapper, *args, **kwargs):
         try:
             return f(self, *args, **kwargs)
         except (EOFError, IOError):
-            sys.exit(default_errors[self.pam_fn_name])
+            sys.exit(default_errors.get(self.pam_fn_name, PAM_ABORT))
 
     return _check_errors
 
 
+cdef int check_payload(int status) except -1:
+    if status == MALLOC_ERR:
+        raise MemoryError
+    elif status != SUCCESS:
+        raise ValueError("Payload is too large")
+    return 0
+
+
+cdef class Payload:
+    """Builds the payload of a frame (see pipe.h for the encoding)"""
+
+    cdef ipc_message message
+
+    def __cinit__(self):
+        ipc_message_init(&self.message)
+
+    def __dealloc__(self):
+        # Wiped, it may contain passwords
+        ipc_message_free(&self.message)
+
+    cpdef Payload put_int(self, int num):
+        check_payload(ipc_put_int(&self.message, num))
+        return self
+
+    cpdef Payload put_bytes(self, bytes data):
+        check_payload(ipc_put_data(&self.message, data, len(data)))
+        return self
+
+    cpdef Payload put_string(self, str string):
+        cdef Py_ssize_t length
+        cdef const char *data = PyUnicode_AsUTF8AndSize(string, &length)
+        check_payload(ipc_put_data(&self.message, data, length))
+        return self
+
+
+cdef class PayloadReader:
+    """Decodes the payload of a received frame"""
+
+    # The payload is either in the buffer of the transport, until it reads the
+    # next frame, or in the mapped memfd it came in
+    cdef Transport transport
+    cdef unsigned long frame
+    cdef void *mapping
+    cdef size_t mapping_length
+    cdef const char *data
+    cdef Py_ssize_t length
+    cdef Py_ssize_t pos
+
+    def __dealloc__(self):
+        if self.mapping != NULL:
+            munmap(self.mapping, self.mapping_length)
+
+    cdef const char *take(self, Py_ssize_t n) except NULL:
+        if self.mapping == NULL and self.transport.frames != self.frame:
+            raise RuntimeError("Payload decoded after the next frame was read")
+        if n < 0 or self.length - self.pos < n:
+            raise EOFError("Truncated frame")
+        cdef const char *data = self.data + self.pos
+        self.pos += n
+        return data
+
+    cpdef int get_int(self) except? -1:
+        cdef int32_t num
+        memcpy(&num, self.take(sizeof(num)), sizeof(num))
+        return num
+
+    cpdef bytes get_bytes(self):
+        cdef int length = self.get_int()
+        return self.take(length)[:length]
+
+    cpdef str get_string(self):
+        cdef int length = self.get_int()
+        return self.take(length)[:length].decode("utf-8")
+
+
+cdef class Transport:
+    """Frames exchanged with the PAM host over any kind of ipc_pipe
+
+    The codec of pipe.c is shared with the PAM host. Reads are buffered,
+    queued frames are written at once on flush(), and waiting for the
+    other side happens without the GIL.
+    """
+
+    cdef ipc_reader reader
+    cdef ipc_queue outgoing
+    # Frames read so far, a PayloadReader over the buffer is only valid for the last one
+    cdef unsigned long frames
+
+    def __dealloc__(self):
+        ipc_reader_free(&self.reader)
+        ipc_queue_free(&self.outgoing)
+
+    def read_frame(self):
+        """Returns (opcode, request id, PayloadReader)
+
+        The payload has to be decoded before the next read_frame().
+        """
+        cdef ipc_frame frame
+        cdef int status
+        with nogil:
+            status = ipc_read_frame(&self.reader, &frame)
+        # Payloads of the previous frame are gone either way
+        self.frames += 1
+        if status == READ_EOF:
+            raise EOFError
+        elif status != SUCCESS:
+            raise IOError("Failed to read a frame")
+
+        cdef PayloadReader payload = PayloadReader.__new__(PayloadReader)
+        payload.transport = self
+        payload.frame = self.frames
+        # Large payloads are decoded right from their memfd, the others right
+        # from the buffer of the reader, which reuses it for the next frame
+        payload.mapping = ipc_reader_take_mapping(&self.reader, &payload.mapping_length)
+        payload.data = <const char *>payload.mapping if payload.mapping != NULL else frame.payload
+        payload.length = frame.length
+        return frame.opcode, frame.request_id, payload
+
+    def queue(self, int opcode, uint32_t request_id, Payload payload=None):
+        """Frames too large for a datagram are written right away"""
+        cdef const ipc_message *message = &payload.message if payload is not None else NULL
+        cdef int status
+        with nogil:
+            status = ipc_queue_frame(&self.outgoing, opcode, request_id, message)
+        if status != SUCCESS:
+            raise IOError("Failed to write a frame")
+
+    def flush(self):
+        cdef int status
+        with nogil:
+            status = ipc_queue_flush(&self.outgoing)
+        if status != SUCCESS:
+            raise IOError("Failed to write a frame")
+
+
+cdef Transport new_transport(ipc_pipe p):
+    cdef Transport transport = Transport.__new__(Transport)
+    # The tokens end up in Python objects anyway, locking the buffers would not keep them out of the heap
+    ipc_reader_init(&transport.reader, p, False)
+    ipc_queue_init(&transport.outgoing, p, False)
+    return transport
+
+
+def stream_transport(int fd):
+    """Transport over a stream socket, the descriptor stays owned by the caller"""
+    cdef ipc_pipe p
+    memset(&p, 0, sizeof(p))
+    p.read_end = fd
+    p.write_end = fd
+    return new_transport(p)
+
+
+# Encoders of the payloads sent to the PAM host (taking their fields) and
+# decoders of those it sends (returning their fields), generated from the
+# fields listed in make.py. Records without a Python class are tuples.
+# BEGIN GENERATED by make.py: codec
+cdef _encode_xauth(Payload payload, record):
+    name = record.name
+    data = record.data
+    payload.put_string(name)
+    payload.put_bytes(data)
+
+
+cdef _encode_new_item(Payload payload, record):
+    item_type, value = record
+    payload.put_int(item_type)
+    if item_type == PAM_XAUTHDATA:
+        _encode_xauth(payload, value)
+    else:
+        payload.put_string(value)
+
+
+cdef _encode_prompt(Payload payload, record):
+    msg_style = record.msg_style
+    msg = record.msg
+    payload.put_int(msg_style)
+    if msg_style == PAM_BINARY_PROMPT:
+        payload.put_bytes(msg)
+    else:
+        payload.put_string(msg)
+
+
+cdef _encode_log_record(Payload payload, record):
+    priority, msg = record
+    payload.put_int(priority)
+    payload.put_bytes(msg)
+
+
+cdef _decode_xauth(PayloadReader reader):
+    name = reader.get_string()
+    data = reader.get_bytes()
+    return XAuthData(name=name, data=data)
+
+
+cdef _decode_item(PayloadReader reader):
+    item_type = reader.get_int()
+    value = None
+    if reader.get_int():
+        if item_type == PAM_XAUTHDATA:
+            value = _decode_xauth(reader)
+        else:
+            value = reader.get_string()
+    return item_type, value
+
+
+cdef _decode_response(PayloadReader reader):
+    resp_retcode = reader.get_int()
+    resp = None
+    if reader.get_int():
+        resp = reader.get_bytes()
+    return resp_retcode, resp
+
+
+def encode_get_item(item_type):
+    cdef Payload payload = Payload()
+    payload.put_int(item_type)
+    return payload
+
+
+def encode_set_item(items):
+    cdef Payload payload = Payload()
+    payload.put_int(len(items))
+    for element in items:
+        _encode_new_item(payload, element)
+    return payload
+
+
+def encode_get_user(prompt):
+    cdef Payload payload = Payload()
+    payload.put_int(prompt is not None)
+    if prompt is not None:
+        payload.put_string(prompt)
+    return payload
+
+
+def encode_converse(msgs):
+    cdef Payload payload = Payload()
+    payload.put_int(len(msgs))
+    for element in msgs:
+        _encode_prompt(payload, element)
+    return payload
+
+
+def encode_fail_delay(usec):
+    cdef Payload payload = Payload()
+    payload.put_int(usec)
+    return payload
+
+
+def encode_strerror(err_num):
+    cdef Payload payload = Payload()
+    payload.put_int(err_num)
+    return payload
+
+
+def encode_syslog(records):
+    cdef Payload payload = Payload()
+    payload.put_int(len(records))
+    for element in records:
+        _encode_log_record(payload, element)
+    return payload
+
+
+def encode_return(retval):
+    cdef Payload payload = Payload()
+    payload.put_int(retval)
+    return payload
+
+
+def decode_get_item(PayloadReader reader):
+    retval = reader.get_int()
+    item = _decode_item(reader)
+    return retval, item
+
+
+def decode_get_user(PayloadReader reader):
+    retval = reader.get_int()
+    user = None
+    if reader.get_int():
+        user = reader.get_string()
+    return retval, user
+
+
+def decode_converse(PayloadReader reader):
+    retval = reader.get_int()
+    responses = [_decode_response(reader) for _ in range(reader.get_int())]
+    return retval, responses
+
+
+def decode_fail_delay(PayloadReader reader):
+    retval = reader.get_int()
+    return retval
+
+
+def decode_strerror(PayloadReader reader):
+    description = reader.get_string()
+    return description
+
+
+def decode_request(PayloadReader reader):
+    fn_name = reader.get_string()
+    flags = reader.get_int()
+    log_level = reader.get_int()
+    args = [reader.get_string() for _ in range(reader.get_int())]
+    items = [_decode_item(reader) for _ in range(reader.get_int())]
+    return fn_name, flags, log_level, args, items
+# END GENERATED: codec
+
+
 class IPCWrapper:
-    def __init__(self, read_fd, write_fd):
-        self.read_end = os.fdopen(read_fd, "rb")
-        self.write_end = os.fdopen(write_fd, "wb", buffering=0) # Write data to the pipe immediately
+    def __init__(self, transport):
+        # Frames not flushed yet stay in the transport, calls made without
+        # waiting are sent together
+        self.transport = transport
+        self.pam_fn_name = None
+        # Set by the PAM host for each request
+        self.request_id = 0
+        # Calls waiting for a reply as (opcode, decode, future), the PAM host
+        # answers them in order
+        self._pending = collections.deque()
+
+    def read_request(self):
+        """Read the next request sent by the PAM host
+
+        Raises EOFError once the host closes the pipe.
+        """
+        opcode, self.request_id, payload = self.transport.read_frame()
+        if opcode != PAM_PYTHON_REQUEST:
+            raise ValueError(f"Expected a request, received method type {opcode}")
+
+        # items is a snapshot of the PAM items, see get_items() in pam.c
+        fn_name, flags, log_level, args, items = decode_request(payload)
+        return fn_name, flags, log_level, args, dict(items)
 
     @exit_on_io_error
-    def read_bytes(self, n):
-        return io.read_bytes(self.read_end, n)
+    def queue(self, opcode, payload=None):
+        """Send a frame along with the next one which is not queued"""
+        self.transport.queue(opcode, self.request_id, payload)
 
     @exit_on_io_error
-    def read_int(self):
-        return io.read_int(self.read_end)
+    def flush(self):
+        self.transport.flush()
 
-    @exit_on_io_error
-    def read_string(self, n):
-        return io.read_string(self.read_end, n)
+    def send(self, opcode, payload=None):
+        self.queue(opcode, payload)
+        self.flush()
 
-    @exit_on_io_error
-    def write_bytes(self):
-        return io.write_bytes(self.write_end)
+    def call_async(self, opcode, payload, decode=None):
+        """Make a call to the PAM host without waiting for its reply
 
-    @exit_on_io_error
-    def write_int(self):
-        return io.write_int(self.write_end)
+        The call is sent once a reply is waited for. Returns a PamFuture
+        of decode(reply), or of the reply decoder itself.
+        """
+        self.queue(opcode, payload)
+        future = PamFuture(self._receive_reply)
+        self._pending.append((opcode, decode, future))
+        return future
+
+    def call(self, opcode, payload, decode=None):
+        """Send a call to the PAM host and wait for its reply"""
+        return self.call_async(opcode, payload, decode).result()
+
+    def drain(self):
+        """Receive the replies to calls whose result was never asked for"""
+        while self._pending:
+            self._receive_reply(None)
 
     @exit_on_io_error
-    def write_string(self):
-        return io.write_string(self.write_end)
+    def _receive_reply(self, future):
+        self.flush()
+        opcode, decode, pending = self._pending.popleft()
+        reply_opcode, request_id, reply = self.transport.read_frame()
+        if reply_opcode != opcode or request_id != self.request_id:
+            raise IOError(f"Unexpected reply [method type={reply_opcode}, request id={request_id}]")
+        pending.set_result(decode(reply) if decode else reply)
+
+
+# PAM constants by name, the class body of PamHandle cannot refer to the
+# names declared in the cdef extern blocks
+# BEGIN GENERATED by make.py: constant table
+_pam_constants = {
+    "PAM_SUCCESS": PAM_SUCCESS,
+    "PAM_OPEN_ERR": PAM_OPEN_ERR,
+    "PAM_SYMBOL_ERR": PAM_SYMBOL_ERR,
+    "PAM_SERVICE_ERR": PAM_SERVICE_ERR,
+    "PAM_SYSTEM_ERR": PAM_SYSTEM_ERR,
+    "PAM_BUF_ERR": PAM_BUF_ERR,
+    "PAM_PERM_DENIED": PAM_PERM_DENIED,
+    "PAM_AUTH_ERR": PAM_AUTH_ERR,
+    "PAM_CRED_INSUFFICIENT": PAM_CRED_INSUFFICIENT,
+    "PAM_AUTHINFO_UNAVAIL": PAM_AUTHINFO_UNAVAIL,
+    "PAM_USER_UNKNOWN": PAM_USER_UNKNOWN,
+    "PAM_MAXTRIES": PAM_MAXTRIES,
+    "PAM_NEW_AUTHTOK_REQD": PAM_NEW_AUTHTOK_REQD,
+    "PAM_ACCT_EXPIRED": PAM_ACCT_EXPIRED,
+    "PAM_SESSION_ERR": PAM_SESSION_ERR,
+    "PAM_CRED_UNAVAIL": PAM_CRED_UNAVAIL,
+    "PAM_CRED_EXPIRED": PAM_CRED_EXPIRED,
+    "PAM_CRED_ERR": PAM_CRED_ERR,
+    "PAM_NO_MODULE_DATA": PAM_NO_MODULE_DATA,
+    "PAM_CONV_ERR": PAM_CONV_ERR,
+    "PAM_AUTHTOK_ERR": PAM_AUTHTOK_ERR,
+    "PAM_AUTHTOK_RECOVERY_ERR": PAM_AUTHTOK_RECOVERY_ERR,
+    "PAM_AUTHTOK_LOCK_BUSY": PAM_AUTHTOK_LOCK_BUSY,
+    "PAM_AUTHTOK_DISABLE_AGING": PAM_AUTHTOK_DISABLE_AGING,
+    "PAM_TRY_AGAIN": PAM_TRY_AGAIN,
+    "PAM_IGNORE": PAM_IGNORE,
+    "PAM_ABORT": PAM_ABORT,
+    "PAM_AUTHTOK_EXPIRED": PAM_AUTHTOK_EXPIRED,
+    "PAM_MODULE_UNKNOWN": PAM_MODULE_UNKNOWN,
+    "PAM_BAD_ITEM": PAM_BAD_ITEM,
+    "PAM_CONV_AGAIN": PAM_CONV_AGAIN,
+    "PAM_INCOMPLETE": PAM_INCOMPLETE,
+    "PAM_SILENT": PAM_SILENT,
+    "PAM_DISALLOW_NULL_AUTHTOK": PAM_DISALLOW_NULL_AUTHTOK,
+    "PAM_ESTABLISH_CRED": PAM_ESTABLISH_CRED,
+    "PAM_DELETE_CRED": PAM_DELETE_CRED,
+    "PAM_REINITIALIZE_CRED": PAM_REINITIALIZE_CRED,
+    "PAM_REFRESH_CRED": PAM_REFRESH_CRED,
+    "PAM_CHANGE_EXPIRED_AUTHTOK": PAM_CHANGE_EXPIRED_AUTHTOK,
+    "PAM_PRELIM_CHECK": PAM_PRELIM_CHECK,
+    "PAM_UPDATE_AUTHTOK": PAM_UPDATE_AUTHTOK,
+    "PAM_SERVICE": PAM_SERVICE,
+    "PAM_USER": PAM_USER,
+    "PAM_TTY": PAM_TTY,
+    "PAM_RHOST": PAM_RHOST,
+    "PAM_CONV": PAM_CONV,
+    "PAM_AUTHTOK": PAM_AUTHTOK,
+    "PAM_OLDAUTHTOK": PAM_OLDAUTHTOK,
+    "PAM_RUSER": PAM_RUSER,
+    "PAM_USER_PROMPT": PAM_USER_PROMPT,
+    "PAM_FAIL_DELAY": PAM_FAIL_DELAY,
+    "PAM_XDISPLAY": PAM_XDISPLAY,
+    "PAM_XAUTHDATA": PAM_XAUTHDATA,
+    "PAM_AUTHTOK_TYPE": PAM_AUTHTOK_TYPE,
+    "PAM_PROMPT_ECHO_OFF": PAM_PROMPT_ECHO_OFF,
+    "PAM_PROMPT_ECHO_ON": PAM_PROMPT_ECHO_ON,
+    "PAM_ERROR_MSG": PAM_ERROR_MSG,
+    "PAM_TEXT_INFO": PAM_TEXT_INFO,
+    "PAM_RADIO_TYPE": PAM_RADIO_TYPE,
+    "PAM_BINARY_PROMPT": PAM_BINARY_PROMPT,
+    "PAM_DATA_REPLACE": PAM_DATA_REPLACE,
+    "PAM_DATA_SILENT": PAM_DATA_SILENT,
+}
+# END GENERATED: constant table
+
 
 class PamHandle:
     """Python wrapper for the PAM handle providing access to its properties
@@ -202,84 +798,89 @@ class PamHandle:
     """
 
     PamException = PamException
+    PamFuture = PamFuture
     XAuthData = XAuthData
     Message = Message
     Response = Response
 
+    # BEGIN GENERATED by make.py: class constants
     # Return values
-    PAM_SUCCESS                = PAM_SUCCESS
-    PAM_OPEN_ERR               = PAM_OPEN_ERR
-    PAM_SYMBOL_ERR             = PAM_SYMBOL_ERR
-    PAM_SERVICE_ERR            = PAM_SERVICE_ERR
-    PAM_SYSTEM_ERR             = PAM_SYSTEM_ERR
-    PAM_BUF_ERR                = PAM_BUF_ERR
-    PAM_PERM_DENIED            = PAM_PERM_DENIED
-    PAM_AUTH_ERR               = PAM_AUTH_ERR
-    PAM_CRED_INSUFFICIENT      = PAM_CRED_INSUFFICIENT
-    PAM_AUTHINFO_UNAVAIL       = PAM_AUTHINFO_UNAVAIL
-    PAM_USER_UNKNOWN           = PAM_USER_UNKNOWN
-    PAM_MAXTRIES               = PAM_MAXTRIES
-    PAM_NEW_AUTHTOK_REQD       = PAM_NEW_AUTHTOK_REQD
-    PAM_ACCT_EXPIRED           = PAM_ACCT_EXPIRED
-    PAM_SESSION_ERR            = PAM_SESSION_ERR
-    PAM_CRED_UNAVAIL           = PAM_CRED_UNAVAIL
-    PAM_CRED_EXPIRED           = PAM_CRED_EXPIRED
-    PAM_CRED_ERR               = PAM_CRED_ERR
-    PAM_NO_MODULE_DATA         = PAM_NO_MODULE_DATA
-    PAM_CONV_ERR               = PAM_CONV_ERR
-    PAM_AUTHTOK_ERR            = PAM_AUTHTOK_ERR
-    PAM_AUTHTOK_RECOVERY_ERR   = PAM_AUTHTOK_RECOVERY_ERR
-    PAM_AUTHTOK_LOCK_BUSY      = PAM_AUTHTOK_LOCK_BUSY
-    PAM_AUTHTOK_DISABLE_AGING  = PAM_AUTHTOK_DISABLE_AGING
-    PAM_TRY_AGAIN              = PAM_TRY_AGAIN
-    PAM_IGNORE                 = PAM_IGNORE
-    PAM_ABORT                  = PAM_ABORT
-    PAM_AUTHTOK_EXPIRED        = PAM_AUTHTOK_EXPIRED
-    PAM_MODULE_UNKNOWN         = PAM_MODULE_UNKNOWN
-    PAM_BAD_ITEM               = PAM_BAD_ITEM
-    PAM_CONV_AGAIN             = PAM_CONV_AGAIN
-    PAM_INCOMPLETE             = PAM_INCOMPLETE
+    PAM_SUCCESS                = _pam_constants["PAM_SUCCESS"]
+    PAM_OPEN_ERR               = _pam_constants["PAM_OPEN_ERR"]
+    PAM_SYMBOL_ERR             = _pam_constants["PAM_SYMBOL_ERR"]
+    PAM_SERVICE_ERR            = _pam_constants["PAM_SERVICE_ERR"]
+    PAM_SYSTEM_ERR             = _pam_constants["PAM_SYSTEM_ERR"]
+    PAM_BUF_ERR                = _pam_constants["PAM_BUF_ERR"]
+    PAM_PERM_DENIED            = _pam_constants["PAM_PERM_DENIED"]
+    PAM_AUTH_ERR               = _pam_constants["PAM_AUTH_ERR"]
+    PAM_CRED_INSUFFICIENT      = _pam_constants["PAM_CRED_INSUFFICIENT"]
+    PAM_AUTHINFO_UNAVAIL       = _pam_constants["PAM_AUTHINFO_UNAVAIL"]
+    PAM_USER_UNKNOWN           = _pam_constants["PAM_USER_UNKNOWN"]
+    PAM_MAXTRIES               = _pam_constants["PAM_MAXTRIES"]
+    PAM_NEW_AUTHTOK_REQD       = _pam_constants["PAM_NEW_AUTHTOK_REQD"]
+    PAM_ACCT_EXPIRED           = _pam_constants["PAM_ACCT_EXPIRED"]
+    PAM_SESSION_ERR            = _pam_constants["PAM_SESSION_ERR"]
+    PAM_CRED_UNAVAIL           = _pam_constants["PAM_CRED_UNAVAIL"]
+    PAM_CRED_EXPIRED           = _pam_constants["PAM_CRED_EXPIRED"]
+    PAM_CRED_ERR               = _pam_constants["PAM_CRED_ERR"]
+    PAM_NO_MODULE_DATA         = _pam_constants["PAM_NO_MODULE_DATA"]
+    PAM_CONV_ERR               = _pam_constants["PAM_CONV_ERR"]
+    PAM_AUTHTOK_ERR            = _pam_constants["PAM_AUTHTOK_ERR"]
+    PAM_AUTHTOK_RECOVERY_ERR   = _pam_constants["PAM_AUTHTOK_RECOVERY_ERR"]
+    PAM_AUTHTOK_LOCK_BUSY      = _pam_constants["PAM_AUTHTOK_LOCK_BUSY"]
+    PAM_AUTHTOK_DISABLE_AGING  = _pam_constants["PAM_AUTHTOK_DISABLE_AGING"]
+    PAM_TRY_AGAIN              = _pam_constants["PAM_TRY_AGAIN"]
+    PAM_IGNORE                 = _pam_constants["PAM_IGNORE"]
+    PAM_ABORT                  = _pam_constants["PAM_ABORT"]
+    PAM_AUTHTOK_EXPIRED        = _pam_constants["PAM_AUTHTOK_EXPIRED"]
+    PAM_MODULE_UNKNOWN         = _pam_constants["PAM_MODULE_UNKNOWN"]
+    PAM_BAD_ITEM               = _pam_constants["PAM_BAD_ITEM"]
+    PAM_CONV_AGAIN             = _pam_constants["PAM_CONV_AGAIN"]
+    PAM_INCOMPLETE             = _pam_constants["PAM_INCOMPLETE"]
     # Flags
-    PAM_SILENT                 = PAM_SILENT
-    PAM_DISALLOW_NULL_AUTHTOK  = PAM_DISALLOW_NULL_AUTHTOK
-    PAM_ESTABLISH_CRED         = PAM_ESTABLISH_CRED
-    PAM_DELETE_CRED            = PAM_DELETE_CRED
-    PAM_REINITIALIZE_CRED      = PAM_REINITIALIZE_CRED
-    PAM_REFRESH_CRED           = PAM_REFRESH_CRED
-    PAM_CHANGE_EXPIRED_AUTHTOK = PAM_CHANGE_EXPIRED_AUTHTOK
+    PAM_SILENT                 = _pam_constants["PAM_SILENT"]
+    PAM_DISALLOW_NULL_AUTHTOK  = _pam_constants["PAM_DISALLOW_NULL_AUTHTOK"]
+    PAM_ESTABLISH_CRED         = _pam_constants["PAM_ESTABLISH_CRED"]
+    PAM_DELETE_CRED            = _pam_constants["PAM_DELETE_CRED"]
+    PAM_REINITIALIZE_CRED      = _pam_constants["PAM_REINITIALIZE_CRED"]
+    PAM_REFRESH_CRED           = _pam_constants["PAM_REFRESH_CRED"]
+    PAM_CHANGE_EXPIRED_AUTHTOK = _pam_constants["PAM_CHANGE_EXPIRED_AUTHTOK"]
     # Internal flags
-    PAM_PRELIM_CHECK           = PAM_PRELIM_CHECK
-    PAM_UPDATE_AUTHTOK         = PAM_UPDATE_AUTHTOK
+    PAM_PRELIM_CHECK           = _pam_constants["PAM_PRELIM_CHECK"]
+    PAM_UPDATE_AUTHTOK         = _pam_constants["PAM_UPDATE_AUTHTOK"]
     # Item types
-    PAM_SERVICE                = PAM_SERVICE
-    PAM_USER                   = PAM_USER
-    PAM_TTY                    = PAM_TTY
-    PAM_RHOST                  = PAM_RHOST
-    PAM_CONV                   = PAM_CONV
-    PAM_AUTHTOK                = PAM_AUTHTOK
-    PAM_OLDAUTHTOK             = PAM_OLDAUTHTOK
-    PAM_RUSER                  = PAM_RUSER
-    PAM_USER_PROMPT            = PAM_USER_PROMPT
+    PAM_SERVICE                = _pam_constants["PAM_SERVICE"]
+    PAM_USER                   = _pam_constants["PAM_USER"]
+    PAM_TTY                    = _pam_constants["PAM_TTY"]
+    PAM_RHOST                  = _pam_constants["PAM_RHOST"]
+    PAM_CONV                   = _pam_constants["PAM_CONV"]
+    PAM_AUTHTOK                = _pam_constants["PAM_AUTHTOK"]
+    PAM_OLDAUTHTOK             = _pam_constants["PAM_OLDAUTHTOK"]
+    PAM_RUSER                  = _pam_constants["PAM_RUSER"]
+    PAM_USER_PROMPT            = _pam_constants["PAM_USER_PROMPT"]
     # Linux-PAM item type extensions
-    PAM_FAIL_DELAY             = PAM_FAIL_DELAY
-    PAM_XDISPLAY               = PAM_XDISPLAY
-    PAM_XAUTHDATA              = PAM_XAUTHDATA
-    PAM_AUTHTOK_TYPE           = PAM_AUTHTOK_TYPE
+    PAM_FAIL_DELAY             = _pam_constants["PAM_FAIL_DELAY"]
+    PAM_XDISPLAY               = _pam_constants["PAM_XDISPLAY"]
+    PAM_XAUTHDATA              = _pam_constants["PAM_XAUTHDATA"]
+    PAM_AUTHTOK_TYPE           = _pam_constants["PAM_AUTHTOK_TYPE"]
     # Message styles (pam_message)
-    PAM_PROMPT_ECHO_OFF        = PAM_PROMPT_ECHO_OFF
-    PAM_PROMPT_ECHO_ON         = PAM_PROMPT_ECHO_ON
-    PAM_ERROR_MSG              = PAM_ERROR_MSG
-    PAM_TEXT_INFO              = PAM_TEXT_INFO
+    PAM_PROMPT_ECHO_OFF        = _pam_constants["PAM_PROMPT_ECHO_OFF"]
+    PAM_PROMPT_ECHO_ON         = _pam_constants["PAM_PROMPT_ECHO_ON"]
+    PAM_ERROR_MSG              = _pam_constants["PAM_ERROR_MSG"]
+    PAM_TEXT_INFO              = _pam_constants["PAM_TEXT_INFO"]
     # Linux-PAM message style extensions
-    PAM_RADIO_TYPE             = PAM_RADIO_TYPE
-    PAM_BINARY_PROMPT          = PAM_BINARY_PROMPT
+    PAM_RADIO_TYPE             = _pam_constants["PAM_RADIO_TYPE"]
+    PAM_BINARY_PROMPT          = _pam_constants["PAM_BINARY_PROMPT"]
     # Linux-PAM pam_set_data cleanup error_status
-    PAM_DATA_REPLACE           = PAM_DATA_REPLACE
-    PAM_DATA_SILENT            = PAM_DATA_SILENT
+    PAM_DATA_REPLACE           = _pam_constants["PAM_DATA_REPLACE"]
+    PAM_DATA_SILENT            = _pam_constants["PAM_DATA_SILENT"]
+    # END GENERATED: class constants
 
-    def __init__(self, read_fd, write_fd, pam_fn_name):
-        self._ipc = IPCWrapper(read_fd, write_fd)
+    def __init__(self, backend, pam_fn_name, log_level=LOG_DEBUG):
+        self._backend = backend
         self.pam_fn_name = pam_fn_name
+        # Least important priority which is still logged (log_level= option)
+        self.log_level = log_level
 
     @property
     def service(self):
@@ -305,63 +906,36 @@ class PamHandle:
     def xauthdata(self, value: XAuthData):
         self._set_item(PAM_XAUTHDATA, value)
 
-    def get_user(self, prompt=None):
-        """Wrapper for pam_get_user()"""
-        self._ipc.write_int(PAM_PYTHON_GET_USER)
-
-        if prompt is None:
-            self._ipc.write_int(0)
-        else:
-            assert isinstance(prompt, str)
-            self._ipc.write_int(len(prompt))
-            self._ipc.write_string(prompt)
+    def get_items_async(self, item_types):
+        """Ask for several items without waiting for each of them in turn
 
-        retval = self._ipc.read_int()
-        if retval != PAM_SUCCESS:
-            self.logger.log(f"Failed to get user [retval={retval}] {self.strerror(retval)}")
-            raise self.PamException(err_num=retval, description=self.strerror(retval))
+        Returns a PamFuture per item type, its result() is the item or raises
+        PamException. The PAM host answers all of them in one go.
+        """
+        return [self._get_item_async(item_type) for item_type in item_types]
 
-        length = self._ipc.read_int()
-        return self._ipc.read_string(length)
+    def get_user(self, prompt=None):
+        """Wrapper for pam_get_user()"""
+        assert prompt is None or isinstance(prompt, str)
+        retval, user = self._backend.get_user(prompt)
+        self._check(retval, "Failed to get user")
+        return user
 
     def fail_delay(self, usec: int):
         """Set the fail delay"""
-        self._ipc.write_int(PAM_PYTHON_FAIL_DELAY)
-        self._ipc.write_int(usec)
-
-        retval = self._ipc.read_int()
-        if retval != PAM_SUCCESS:
-            self.logger.log(f"Failed to set fail delay [retval={retval}] {self.strerror(retval)}")
-            raise self.PamException(err_num=retval, description=self.strerror(retval))
+        retval = self._backend.fail_delay(usec)
+        self._check(retval, "Failed to set fail delay")
 
     def converse(self, msgs: Union[List[Message], Message]):
         """Interface for the application conversation function"""
         if not isinstance(msgs, list):
             msgs = [msgs]
-
-        self._ipc.write_int(PAM_PYTHON_CONVERSE)
-        self._ipc.write_int(len(msgs))
-
         for msg in msgs:
-            self._ipc.write_int(msg.msg_style)
-            self._ipc.write_int(len(msg.msg))
-            self._ipc.write_string(msg.msg)
-
-        retval = self._ipc.read_int()
-        if retval != PAM_SUCCESS:
-            self.logger.log(f"Error when getting PAM_CONV [retval={retval}] {self.strerror(retval)}")
-            raise self.PamException(err_num=retval, description=self.strerror(retval))
-
-        responses = []
-        for _ in range(len(msgs)):
-            resp_retcode = self._ipc.read_int()
-            resp_len = self._ipc.read_int()
-            if resp_len == 0:
-                responses.append(Response(None, resp_retcode))
-            else:
-                data = self._ipc.read_string(resp_len)
-                responses.append(Response(data, resp_retcode))
+            if msg.msg_style == PAM_BINARY_PROMPT:
+                check_binary_prompt(msg)
 
+        retval, responses = self._backend.converse(msgs)
+        self._check(retval, "Error when getting PAM_CONV")
         return responses
 
     def prompt(self, msg, msg_style=PAM_PROMPT_ECHO_OFF):
@@ -369,117 +943,373 @@ class PamHandle:
         if isinstance(msg, Message):
             return self.converse(msg)
         else:
-            assert isinstance(msg, str)
+            assert isinstance(msg, (str, bytes))
             return self.converse(Message(msg_style=msg_style, msg=msg))
 
     def strerror(self, err_num):
         """Get a description from an error number"""
-        self._ipc.write_int(PAM_PYTHON_STERROR)
-        self._ipc.write_int(err_num)
-        length = self._ipc.read_int()
-        return self._ipc.read_string(length)
+        return self._backend.strerror(err_num)
 
     def log(self, msg, priority=LOG_ERR):
-        """Wrapper for pam_syslog()"""
-        print(msg)
+        """Wrapper for pam_syslog()
+
+        Records less important than log_level are dropped. The others
+        may reach syslog only once the handler calls into PAM again or
+        returns.
+        """
         assert isinstance(msg, str)
-        self._ipc.write_int(PAM_PYTHON_SYSLOG)
-        self._ipc.write_int(priority)
-        self._ipc.write_int(len(msg))
-        self._ipc.write_string(msg)
+        if priority <= self.log_level:
+            self._backend.syslog(priority, msg)
 
     def debug(self, msg: str):
         """log with a debug priority"""
         self.log(msg, LOG_DEBUG)
 
+    def _check(self, retval, description):
+        if retval != PAM_SUCCESS:
+            error = self.strerror(retval)
+            self.log(f"{description} [retval={retval}] {error}")
+            raise self.PamException(err_num=retval, description=error)
+
     def _get_item(self, item_type):
+        return self._get_item_async(item_type).result()
+
+    def _get_item_async(self, item_type):
         if item_type == PAM_CONV or item_type == PAM_FAIL_DELAY:
             # We don't allow accessing these items
-            return None
-        elif item_type == PAM_XAUTHDATA:
-            self._ipc.write_int(PAM_PYTHON_GET_ITEM)
-            self._ipc.write_int(item_type)
-            retval = self._ipc.read_int()
-
-            if retval != PAM_SUCCESS:
-                self.logger.log(f"Error when getting XAuthData [retval={retval}] {self.strerror(retval)}")
-                raise self.PamException(err_num=retval, description=self.strerror(retval))
-
-            namelen = self._ipc.read_int()
-            # print(f"[CH] namelen {namelen}")
-            name = self._ipc.read_string(namelen)
-            datalen = self._ipc.read_int()
-            # print(f"[CH] datalen {datalen}")
-            data = self._ipc.read_bytes(datalen)
-            return XAuthData(name, data)
-        else:
-            self._ipc.write_int(PAM_PYTHON_GET_ITEM)
-            self._ipc.write_int(item_type)
-            retval = self._ipc.read_int()
+            return PamFuture.completed(None)
 
-            if retval != PAM_SUCCESS:
-                self.logger.log(f"Error when getting item [item_type={item_type}, retval={retval}] {self.strerror(retval)}")
-                raise self.PamException(err_num=retval, description=self.strerror(retval))
+        return self._backend.get_item_async(item_type)._then(lambda reply: self._checked_item(item_type, *reply))
 
-            length = self._ipc.read_int()
-            return self._ipc.read_string(length)
+    def _checked_item(self, item_type, retval, item):
+        if item_type == PAM_XAUTHDATA:
+            self._check(retval, "Error when getting XAuthData")
+        else:
+            self._check(retval, f"Error when getting item [item_type={item_type}]")
+        return item
 
     def _set_item(self, item_type, item):
         if item_type == PAM_CONV or item_type == PAM_FAIL_DELAY:
             # We don't allow setting these items
             # Use fail_delay() or converse() instead
-            pass
-        elif item_type == PAM_XAUTHDATA:
-            assert isinstance(item, XAuthData)
-            self._ipc.write_int(PAM_PYTHON_SET_ITEM)
-            self._ipc.write_int(item_type)
-            self._ipc.write_int(len(item.name))
-            self._ipc.write_string(item.name)
-            self._ipc.write_int(len(item.data))
-            self._ipc.write_bytes(item.data)
-            retval = self._ipc.read_int()
+            return
 
-            if retval != PAM_SUCCESS:
-                self.logger.log(f"Error when setting XAuthData [retval={retval}] {self.strerror(retval)}")
-                raise self.PamException(err_num=retval, description=self.strerror(retval))
+        if item_type == PAM_XAUTHDATA:
+            assert isinstance(item, XAuthData)
+            self._check(self._backend.set_item(item_type, item), "Error when setting XAuthData")
         else:
             assert isinstance(item, str)
-            self._ipc.write_int(PAM_PYTHON_SET_ITEM)
-            self._ipc.write_int(item_type)
-            self._ipc.write_int(len(item))
-            self._ipc.write_string(item)
-            retval = self._ipc.read_int()
+            self._check(self._backend.set_item(item_type, item), f"Error when setting item [item_type={item_type}]")
+
+
+class PipeBackend:
+    """Forwards the PamHandle calls to the PAM host over the pipe protocol
+
+    Every method returns the raw PAM return value, PamHandle turns
+    failures into exceptions.
+
+    Items come from the snapshot sent with the request. Items set by
+    the handler and log records are kept here and written back to the
+    PAM host before any other call and when the handler returns.
+    """
+
+    # Log records are sent right away once they take up this many bytes
+    LOG_BUFFER_SIZE = 16 * 1024
+
+    def __init__(self, ipc, items=None):
+        self._ipc = ipc
+        self._items = dict(items or {})
+        # Set since the last write-back
+        self._dirty = {}
+        # (priority, encoded message) not sent yet
+        self._records = []
+        self._records_size = 0
+
+    def get_item(self, item_type):
+        return self.get_item_async(item_type).result()
+
+    def get_item_async(self, item_type):
+        if item_type in self._items:
+            return PamFuture.completed((PAM_SUCCESS, self._items[item_type]))
+        return self._call_async(PAM_PYTHON_GET_ITEM, encode_get_item(item_type), self._decode_item)
+
+    @staticmethod
+    def _decode_item(reply):
+        retval, (_, item) = decode_get_item(reply)
+        return retval, item
+
+    # Item types pam_set_item() accepts, see _pam_item.c in Linux-PAM
+    SETTABLE_ITEMS = frozenset((PAM_SERVICE, PAM_USER, PAM_TTY, PAM_RHOST, PAM_AUTHTOK, PAM_OLDAUTHTOK,
+                                PAM_RUSER, PAM_USER_PROMPT, PAM_XDISPLAY, PAM_XAUTHDATA, PAM_AUTHTOK_TYPE))
+
+    def set_item(self, item_type, item):
+        """Keep the item for the next write-back
+
+        Unknown item types fail right away with PAM_BAD_ITEM. Otherwise
+        the PAM host sets the item later and only logs a failure, the
+        handler is not told about it.
+        """
+        if item_type not in self.SETTABLE_ITEMS:
+            return PAM_BAD_ITEM
+        self._items[item_type] = item
+        self._dirty[item_type] = item
+        return PAM_SUCCESS
+
+    def write_back(self):
+        """Queue the items set and the records logged since the last write-back
+
+        Items go into a single SET_ITEM, records into a single SYSLOG.
+        The PAM host does not reply to either, it logs the items it
+        fails to set.
+        """
+        self._write_back_items()
+        self._write_back_records(self._ipc.queue)
+
+    def _write_back_items(self):
+        if not self._dirty:
+            return
+
+        payload = encode_set_item(list(self._dirty.items()))
+        self._dirty.clear()
+        self._ipc.queue(PAM_PYTHON_SET_ITEM, payload)
+
+    def _write_back_records(self, send):
+        if not self._records:
+            return
+
+        payload = encode_syslog(self._records)
+        self._records = []
+        self._records_size = 0
+        send(PAM_PYTHON_SYSLOG, payload)
+
+    # The PAM host has to see our items (and log records) before it serves anything else
+    def _call_async(self, opcode, payload, decode):
+        self.write_back()
+        return self._ipc.call_async(opcode, payload, decode)
+
+    def _call(self, opcode, payload, decode):
+        self.write_back()
+        return self._ipc.call(opcode, payload, decode)
+
+    def get_user(self, prompt):
+        # pam_get_user() does not prompt either once the user is known
+        if self._items.get(PAM_USER) is not None:
+            return PAM_SUCCESS, self._items[PAM_USER]
+
+        retval, user = self._call(PAM_PYTHON_GET_USER, encode_get_user(prompt), decode_get_user)
+        if retval != PAM_SUCCESS:
+            return retval, None
+        self._items[PAM_USER] = user
+        return retval, user
 
+    def fail_delay(self, usec):
+        return self._call(PAM_PYTHON_FAIL_DELAY, encode_fail_delay(usec), decode_fail_delay)
+
+    def converse(self, msgs):
+        retval, replies = self._call(PAM_PYTHON_CONVERSE, encode_converse(msgs), decode_converse)
+        if retval != PAM_SUCCESS:
+            return retval, None
+        if len(replies) != len(msgs):
+            raise IOError(f"Expected {len(msgs)} responses, received {len(replies)}")
+
+        responses = []
+        for msg, (resp_retcode, resp) in zip(msgs, replies):
+            if resp is not None and msg.msg_style != PAM_BINARY_PROMPT:
+                resp = resp.decode("utf-8")
+            responses.append(Response(resp, resp_retcode))
+
+        return retval, responses
+
+    def strerror(self, err_num):
+        return self._call(PAM_PYTHON_STRERROR, encode_strerror(err_num), decode_strerror)
+
+    def syslog(self, priority, msg):
+        msg = msg.encode("utf-8")
+        self._records.append((priority, msg))
+        self._records_size += len(msg)
+        if self._records_size >= self.LOG_BUFFER_SIZE:
+            # The items first, the PAM host handles frames in order
+            self._write_back_items()
+            self._write_back_records(self._ipc.send)
+
+
+cdef class LibpamBackend:
+    """Calls libpam directly, used when the handler runs inside the PAM host
+
+    Same interface as PipeBackend.
+    """
+
+    cdef pam_handle_t *pamh
+
+    def get_item(self, int item_type):
+        cdef const void *item = NULL
+        cdef const pam_xauth_data *xauth
+
+        retval = pam_get_item(self.pamh, item_type, &item)
+        if retval != PAM_SUCCESS or item == NULL:
+            return retval, None
+
+        if item_type == PAM_XAUTHDATA:
+            xauth = <const pam_xauth_data *>item
+            return retval, XAuthData(xauth.name[:xauth.namelen].decode("utf-8"), xauth.data[:xauth.datalen])
+        else:
+            return retval, (<const char *>item).decode("utf-8")
+
+    def get_item_async(self, int item_type):
+        return PamFuture.completed(self.get_item(item_type))
+
+    def set_item(self, int item_type, item):
+        cdef pam_xauth_data xauth
+
+        if item_type == PAM_XAUTHDATA:
+            # libpam copies the item
+            name = item.name.encode("utf-8")
+            data = bytes(item.data)
+            xauth.namelen = len(name)
+            xauth.name = name
+            xauth.datalen = len(data)
+            xauth.data = data
+            return pam_set_item(self.pamh, item_type, &xauth)
+        else:
+            value = item.encode("utf-8")
+            return pam_set_item(self.pamh, item_type, <const char *>value)
+
+    def get_user(self, prompt):
+        cdef const char *user = NULL
+        cdef const char *c_prompt = NULL
+        cdef int retval
+
+        if prompt is not None:
+            prompt = prompt.encode("utf-8")
+            c_prompt = prompt
+
+        # pam_get_user() may have to ask the application
+        with nogil:
+            retval = pam_get_user(self.pamh, &user, c_prompt)
+        if retval != PAM_SUCCESS or user == NULL:
+            return retval, None
+        return retval, user.decode("utf-8")
+
+    def fail_delay(self, unsigned int usec):
+        return pam_fail_delay(self.pamh, usec)
+
+    def converse(self, msgs):
+        cdef const pam_conv *conv = NULL
+        cdef pam_message *c_msgs = NULL
+        cdef const pam_message **c_msg_ptrs = NULL
+        cdef pam_response *resps = NULL
+        cdef int num_msgs = len(msgs)
+        cdef Py_ssize_t length
+        cdef int retval, i
+
+        retval = pam_get_item(self.pamh, PAM_CONV, <const void **>&conv)
+        if retval != PAM_SUCCESS:
+            return retval, None
+        if conv == NULL or conv.conv == NULL:
+            return PAM_CONV_ERR, None
+
+        # Keeps the encoded messages alive for the duration of the call
+        encoded = [msg.msg if msg.msg_style == PAM_BINARY_PROMPT else msg.msg.encode("utf-8") for msg in msgs]
+
+        c_msgs = <pam_message *>calloc(num_msgs, sizeof(pam_message))
+        c_msg_ptrs = <const pam_message **>calloc(num_msgs, sizeof(pam_message *))
+        try:
+            if c_msgs == NULL or c_msg_ptrs == NULL:
+                return PAM_BUF_ERR, None
+
+            for i in range(num_msgs):
+                c_msgs[i].msg_style = msgs[i].msg_style
+                c_msgs[i].msg = encoded[i]
+                c_msg_ptrs[i] = &c_msgs[i]
+
+            # The application may wait for the user for a long time
+            with nogil:
+                retval = conv.conv(num_msgs, c_msg_ptrs, &resps, conv.appdata_ptr)
             if retval != PAM_SUCCESS:
-                self.logger.log(f"Error when setting item [item_type={item_type}, retval={retval}] {self.strerror(retval)}")
-                raise self.PamException(err_num=retval, description=self.strerror(retval))
+                return retval, None
+            if resps == NULL:
+                return PAM_CONV_ERR, None
+
+            for i in range(num_msgs):
+                if resps[i].resp != NULL and response_length(c_msgs[i].msg_style, resps[i].resp) < 0:
+                    return PAM_CONV_ERR, None
+
+            responses = []
+            for i in range(num_msgs):
+                if resps[i].resp == NULL:
+                    responses.append(Response(None, resps[i].resp_retcode))
+                elif c_msgs[i].msg_style == PAM_BINARY_PROMPT:
+                    resp = resps[i].resp[:response_length(c_msgs[i].msg_style, resps[i].resp)]
+                    responses.append(Response(resp, resps[i].resp_retcode))
+                else:
+                    responses.append(Response(resps[i].resp.decode("utf-8"), resps[i].resp_retcode))
+            return retval, responses
+        finally:
+            # We are responsible for freeing the responses
+            if resps != NULL:
+                for i in range(num_msgs):
+                    if resps[i].resp != NULL:
+                        # Overwriting ensures we don't leak any sensitive data like passwords.
+                        # A binary response claiming an implausible length is left alone.
+                        length = response_length(c_msgs[i].msg_style, resps[i].resp)
+                        if length > 0:
+                            memset(resps[i].resp, 0, length)
+                        free(resps[i].resp)
+                free(resps)
+            free(c_msgs)
+            free(c_msg_ptrs)
+
+    def strerror(self, int err_num):
+        return pam_strerror(self.pamh, err_num).decode("utf-8")
+
+    def syslog(self, int priority, msg):
+        encoded = msg.encode("utf-8")
+        pam_syslog(self.pamh, priority, "%s", <const char *>encoded)
+
+
+# Modules imported by this process, keyed by their path.
+# A zygote or the daemon imports a module once and every forked child reuses it.
+_modules = {}
+
+
+def _file_identity(file_path):
+    st = os.stat(file_path)
+    return st.st_dev, st.st_ino, st.st_size, st.st_mtime_ns
 
 
 def _load_module(file_path):
+    identity = _file_identity(file_path)
+    cached = _modules.get(file_path)
+    if cached is not None and cached[0] == identity:
+        return cached[1]
+
     module_name = Path(file_path).stem
     spec = importlib.util.spec_from_file_location(module_name, file_path)
     module = importlib.util.module_from_spec(spec)
     sys.modules[module_name] = module
-    spec.loader.exec_module(module)
+    code = cache.load_code(file_path)
+    if code is None:
+        spec.loader.exec_module(module)
+    else:
+        exec(code, module.__dict__)
+    _modules[file_path] = (identity, module)
+    cache.store_manifest(file_path, identity, [name for name in default_errors if getattr(module, name, None) is not None])
     return module
 
 
-cdef public int python_handle_request(int read_end, int write_end, int flags, int argc, const char ** argv, char *pam_fn_name):
-    fn_name = pam_fn_name.decode("utf-8")
-    pam_handle = PamHandle(read_end, write_end, pam_fn_name)
+def python_handle_request(backend, fn_name, flags, args, log_level=LOG_DEBUG, in_host=False):
+    pam_handle = PamHandle(backend, fn_name, log_level)
+    # A handler running in the PAM host must not take it down with sys.exit()
+    caught = BaseException if in_host else Exception
 
-    if argc == 0:
+    if not args:
         pam_handle.log("No python module provided")
         return default_errors[fn_name]
 
-    args = []
-    for i in range(argc):
-        args.append(argv[i].decode("utf-8"))
-
     pam_handle.debug(f"Importing {args[0]}")
     try:
         module = _load_module(args[0])
-    except Exception as e:
+    except caught as e:
         pam_handle.log(f"Failed to import python module: {e}")
         return default_errors[fn_name]
 
@@ -490,7 +1320,7 @@ cdef public int python_handle_request(int read_end, int write_end, int flags, in
 
     try:
         retval = handler(pam_handle, flags, args[1:])
-    except Exception as e:
+    except caught as e:
         pam_handle.log(f"Exception ocurred while running python handler: [flags={flags}, args={args[1:]}, fn_name={fn_name}]" +
                        f"   Exception: {e}")
         return default_errors[fn_name]
@@ -500,3 +1330,62 @@ cdef public int python_handle_request(int read_end, int write_end, int flags, in
         return default_errors[fn_name]
     else:
         return retval
+
+
+cdef public int python_preload_module(const char *module_path) except -1:
+    _load_module(module_path.decode("utf-8"))
+    return 0
+
+
+def receive_request(ipc):
+    """Read the next request sent by the PAM host, None once it closed the channel"""
+    try:
+        return ipc.read_request()
+    except EOFError:
+        return None
+
+
+def serve_requests(ipc, max_requests=0, request=None):
+    """Serve requests sent by the PAM host over ipc
+
+    Returns once the host closes the channel or after max_requests
+    requests (0 means no limit). A request which was already read
+    by the caller can be passed in as request.
+    """
+    served = 0
+
+    while max_requests == 0 or served < max_requests:
+        if request is None:
+            request = receive_request(ipc)
+            if request is None:
+                return 0
+
+        fn_name, flags, log_level, args, items = request
+        request = None
+
+        ipc.pam_fn_name = fn_name
+        backend = PipeBackend(ipc, items)
+        retval = python_handle_request(backend, fn_name, flags, args, log_level)
+
+        # Sent along with the return value
+        backend.write_back()
+        # Replies still on their way would be mistaken for the next request
+        ipc.drain()
+        ipc.send(PAM_PYTHON_RETURN, encode_return(retval))
+        served += 1
+
+    return 0
+
+
+cdef public int python_serve(ipc_pipe p, int max_requests):
+    return serve_requests(IPCWrapper(new_transport(p)), max_requests)
+
+
+cdef public int python_handle_inprocess(pam_handle_t *pamh, const char *pam_fn_name, int flags, int log_level,
+                                        int argc, const char **argv):
+    """Run the handler in the PAM host itself, talking to libpam directly"""
+    cdef LibpamBackend backend = LibpamBackend.__new__(LibpamBackend)
+    backend.pamh = pamh
+
+    args = [argv[i].decode("utf-8") for i in range(argc)]
+    return python_handle_request(backend, pam_fn_name.decode("utf-8"), flags, args, log_level, in_host=True)
@@ -1,41 +1,627 @@
+#define _GNU_SOURCE
+
 #include "pipe.h"
 
-int write_bytes(int fd, char *data, int n) {
-  int written = write(fd, data, n);
-  if (written != n) {
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+
+#define INITIAL_CAPACITY 4096
+
+void ipc_message_init(struct ipc_message *m) {
+  m->data = NULL;
+  m->length = 0;
+  m->capacity = 0;
+  m->locked = false;
+  m->fixed = false;
+}
+
+void ipc_message_init_buffer(struct ipc_message *m, char *buffer, size_t capacity) {
+  ipc_message_init(m);
+  m->data = buffer;
+  m->capacity = capacity;
+  m->fixed = true;
+}
+
+// Locked buffers are mmap'd, mlock'd (best effort, RLIMIT_MEMLOCK may not
+// allow it) and left out of core dumps
+static char *alloc_buffer(bool locked, size_t size) {
+  if (!locked) {
+    return malloc(size);
+  }
+
+  char *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(buffer, size, MADV_DONTDUMP);
+  mlock(buffer, size);
+  return buffer;
+}
+
+// The buffer is wiped first
+static void free_buffer(bool locked, char *buffer, size_t size) {
+  explicit_bzero(buffer, size);
+  if (locked) {
+    munlock(buffer, size);
+    munmap(buffer, size);
+  } else {
+    free(buffer);
+  }
+}
+
+void ipc_message_free(struct ipc_message *m) {
+  if (m->data && m->fixed) {
+    explicit_bzero(m->data, m->capacity);
+  } else if (m->data) {
+    free_buffer(m->locked, m->data, m->capacity);
+  }
+  ipc_message_init(m);
+}
+
+// Grows the buffer without leaving copies of its contents behind
+static int reserve(char **buffer, size_t used, size_t *capacity, size_t needed, bool locked) {
+  if (needed <= *capacity) {
+    return SUCCESS;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : INITIAL_CAPACITY;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+
+  char *new_buffer = alloc_buffer(locked, new_capacity);
+  if (!new_buffer) {
+    return MALLOC_ERR;
+  }
+  if (*buffer) {
+    memcpy(new_buffer, *buffer, used);
+    free_buffer(locked, *buffer, *capacity);
+  }
+  *buffer = new_buffer;
+  *capacity = new_capacity;
+  return SUCCESS;
+}
+
+static int put(struct ipc_message *m, const void *data, size_t length) {
+  if (m->length + length > IPC_MAX_PAYLOAD || (m->fixed && m->length + length > m->capacity)) {
+    return WRITE_ERR;
+  }
+  int status = reserve(&m->data, m->length, &m->capacity, m->length + length, m->locked);
+  if (status != SUCCESS) {
+    return status;
+  }
+  memcpy(m->data + m->length, data, length);
+  m->length += length;
+  return SUCCESS;
+}
+
+int ipc_put_int(struct ipc_message *m, int n) {
+  int32_t value = n;
+  return put(m, &value, sizeof(value));
+}
+
+int ipc_put_data(struct ipc_message *m, const char *data, int length) {
+  int status = ipc_put_int(m, length);
+  if (status != SUCCESS) {
+    return status;
+  }
+  return put(m, data, length);
+}
+
+int ipc_put_string(struct ipc_message *m, const char *str) {
+  return ipc_put_data(m, str, strlen(str));
+}
+
+static int send_all(int fd, struct msghdr *msg) {
+  while (sendmsg(fd, msg, MSG_NOSIGNAL) < 0) {
+    if (errno != EINTR) {
+      return WRITE_ERR;
+    }
+  }
+  return SUCCESS;
+}
+
+// Sealed memfd with a copy of data
+static int memfd_with(const char *data, size_t length) {
+  int fd = memfd_create("pam_python", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < length) {
+    ssize_t written = write(fd, data + done, length - done);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      close(fd);
+      return -1;
+    }
+    done += written;
+  }
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// iov holds the header and the payload
+static int write_packet(int fd, struct iovec *iov) {
+  struct msghdr msg = {0};
+
+  if (iov[0].iov_len + iov[1].iov_len <= IPC_PACKET_MAX) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return send_all(fd, &msg);
+  }
+
+  int memfd = memfd_with(iov[1].iov_base, iov[1].iov_len);
+  if (memfd < 0) {
     return WRITE_ERR;
   }
+
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  int status = send_all(fd, &msg);
+  close(memfd);
+  return status;
+}
+
+static ssize_t write_some(int fd, bool socket, struct iovec *iov, int count) {
+  if (!socket) {
+    return writev(fd, iov, count);
+  }
+  struct msghdr msg = {0};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// Write the whole iovec to a pipe or a stream socket. iov is modified.
+static int write_iov(int fd, bool socket, struct iovec *iov, int count) {
+  struct iovec *next = iov;
+
+  while (count > 0) {
+    ssize_t written = write_some(fd, socket, next, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return WRITE_ERR;
+    }
+
+    // Partial write, continue where it stopped
+    while (count > 0 && (size_t)written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+  return SUCCESS;
+}
+
+// A side which exited must not take the PAM host down with SIGPIPE. Sockets have
+// MSG_NOSIGNAL. The signal disposition belongs to the host (and is shared by its
+// threads), so for pipes SIGPIPE is blocked in the calling thread and a signal
+// raised by the write is discarded.
+static int write_all(struct ipc_pipe p, struct iovec *iov, int count) {
+  // Stream sockets (zygotes, the daemon) are a single descriptor
+  if (p.read_end == p.write_end) {
+    return write_iov(p.write_end, true, iov, count);
+  }
+
+  sigset_t sigpipe, pending, old_mask;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+  sigpending(&pending);
+  bool was_pending = sigismember(&pending, SIGPIPE);
+
+  int status = write_iov(p.write_end, false, iov, count);
+  if (status != SUCCESS && errno == EPIPE && !was_pending) {
+    const struct timespec no_wait = {0, 0};
+    sigtimedwait(&sigpipe, NULL, &no_wait);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  return status;
+}
+
+int ipc_write_frame(struct ipc_pipe p, int opcode, uint32_t request_id, const struct ipc_message *m) {
+  struct ipc_header header = {opcode, m ? m->length : 0, request_id};
+  struct iovec iov[2] = {{&header, sizeof(header)}, {m ? m->data : NULL, m ? m->length : 0}};
+
+  if (p.shm) {
+    return shm_write(p, iov, 2);
+  } else if (p.packet) {
+    return write_packet(p.write_end, iov);
+  }
+  return write_all(p, iov, 2);
+}
+
+void ipc_queue_init(struct ipc_queue *q, struct ipc_pipe p, bool locked) {
+  q->pipe = p;
+  ipc_message_init(&q->frames);
+  q->frames.locked = locked;
+  q->count = 0;
+}
+
+void ipc_queue_free(struct ipc_queue *q) {
+  bool locked = q->frames.locked;
+  ipc_message_free(&q->frames);
+  q->frames.locked = locked;
+  q->count = 0;
+}
+
+int ipc_queue_frame(struct ipc_queue *q, int opcode, uint32_t request_id, const struct ipc_message *m) {
+  struct ipc_header header = {opcode, m ? m->length : 0, request_id};
+
+  if (sizeof(header) + header.length > IPC_PACKET_MAX) {
+    int status = ipc_queue_flush(q);
+    return status == SUCCESS ? ipc_write_frame(q->pipe, opcode, request_id, m) : status;
+  }
+
+  struct ipc_message *frames = &q->frames;
+  int status = reserve(&frames->data, frames->length, &frames->capacity,
+                       frames->length + sizeof(header) + header.length, frames->locked);
+  if (status != SUCCESS) {
+    return status;
+  }
+  memcpy(frames->data + frames->length, &header, sizeof(header));
+  if (header.length > 0) {
+    memcpy(frames->data + frames->length + sizeof(header), m->data, header.length);
+  }
+  frames->length += sizeof(header) + header.length;
+  q->count++;
+  return SUCCESS;
 }
 
-int write_int(int fd, int n) {
-  return write_bytes(fd, (char *)&n, sizeof(int));
+// One datagram per frame, sent with as few sendmmsg() calls as possible
+static int flush_packets(struct ipc_queue *q) {
+  struct mmsghdr *msgs = calloc(q->count, sizeof(struct mmsghdr));
+  struct iovec *iov = calloc(q->count, sizeof(struct iovec));
+  if (!msgs || !iov) {
+    free(msgs);
+    free(iov);
+    return MALLOC_ERR;
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < q->count; i++) {
+    struct ipc_header header;
+    memcpy(&header, q->frames.data + offset, sizeof(header));
+    iov[i].iov_base = q->frames.data + offset;
+    iov[i].iov_len = sizeof(header) + header.length;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    offset += iov[i].iov_len;
+  }
+
+  int status = SUCCESS;
+  size_t sent = 0;
+  while (sent < q->count) {
+    int count = sendmmsg(q->pipe.write_end, msgs + sent, q->count - sent, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      status = WRITE_ERR;
+      break;
+    }
+    sent += count;
+  }
+
+  free(msgs);
+  free(iov);
+  return status;
 }
 
-int write_string(int fd, char *str, int length) {
-  return write_bytes(fd, str, length);
+int ipc_queue_flush(struct ipc_queue *q) {
+  if (q->count == 0) {
+    return SUCCESS;
+  }
+
+  struct iovec iov = {q->frames.data, q->frames.length};
+  int status;
+  if (q->pipe.shm) {
+    status = shm_write(q->pipe, &iov, 1);
+  } else if (q->pipe.packet) {
+    status = flush_packets(q);
+  } else {
+    status = write_all(q->pipe, &iov, 1);
+  }
+
+  // Keep the buffer for the next batch, but not its contents
+  memset(q->frames.data, 0, q->frames.length);
+  q->frames.length = 0;
+  q->count = 0;
+  return status;
+}
+
+void ipc_reader_init(struct ipc_reader *r, struct ipc_pipe p, bool locked) {
+  r->pipe = p;
+  r->locked = locked;
+  r->buffer = NULL;
+  r->start = 0;
+  r->end = 0;
+  r->capacity = 0;
+  r->mapping = NULL;
+  r->mapping_length = 0;
+}
+
+static void unmap(struct ipc_reader *r) {
+  if (r->mapping) {
+    munmap(r->mapping, r->mapping_length);
+    r->mapping = NULL;
+    r->mapping_length = 0;
+  }
 }
 
-int read_bytes(int fd, char *data, int n) {
-  int total = 0;
-  while (total != n) {
-    int remaining = n - total;
-    int r = read(fd, data, remaining);
-    if (r == 0) {
-      return EOF;
-    } else if (r < 0) {
+void ipc_reader_free(struct ipc_reader *r) {
+  if (r->buffer) {
+    free_buffer(r->locked, r->buffer, r->capacity);
+  }
+  unmap(r);
+  ipc_reader_init(r, r->pipe, r->locked);
+}
+
+void *ipc_reader_take_mapping(struct ipc_reader *r, size_t *length) {
+  void *mapping = r->mapping;
+  *length = r->mapping_length;
+  r->mapping = NULL;
+  r->mapping_length = 0;
+  return mapping;
+}
+
+// Make sure at least n bytes are buffered, reading as much as is available
+static int fill(struct ipc_reader *r, size_t n) {
+  if (r->end - r->start >= n) {
+    return SUCCESS;
+  }
+
+  if (r->start > 0) {
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  int status = reserve(&r->buffer, r->end, &r->capacity, n, r->locked);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  while (r->end < n) {
+    ssize_t count;
+    if (r->pipe.shm) {
+      count = shm_read(r->pipe, r->buffer + r->end, r->capacity - r->end);
+      if (count < 0) {
+        return -count;
+      }
+      r->end += count;
+      continue;
+    }
+
+    count = read(r->pipe.read_end, r->buffer + r->end, r->capacity - r->end);
+    if (count == 0) {
+      return READ_EOF;
+    } else if (count < 0) {
+      if (errno == EINTR) continue;
       return READ_ERR;
     }
-    total += r;
+    r->end += count;
   }
   return SUCCESS;
 }
 
-int read_int(int fd, int *n) {
-  return read_bytes(fd, (char *)n, sizeof(int));
+// Descriptors passed along with the datagram, at most one is expected
+static int received_fd(struct msghdr *msg) {
+  int fd = -1;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count; i++) {
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (fd < 0) {
+        fd = received;
+      } else {
+        close(received);
+      }
+    }
+  }
+  return fd;
+}
+
+// Map the payload of an oversized frame from the memfd which came with it. The
+// seals guarantee that the sender can neither change nor truncate it meanwhile.
+static int map_memfd(struct ipc_reader *r, int memfd, size_t length) {
+  const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+  struct stat st;
+
+  // Anything but a memfd fails with -1, which has every bit set
+  int present = fcntl(memfd, F_GET_SEALS);
+  if (length == 0 || present < 0 || (present & seals) != seals || fstat(memfd, &st) != 0 ||
+      (size_t)st.st_size < length) {
+    return READ_ERR;
+  }
+
+  void *mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, memfd, 0);
+  if (mapping == MAP_FAILED) {
+    return READ_ERR;
+  }
+  r->mapping = mapping;
+  r->mapping_length = length;
+  return SUCCESS;
 }
 
-int read_string(int fd, char *str, int length) {
-  int status = read_bytes(fd, str, length);
-  str[length] = '\0';
+// Receive one datagram, the reader's buffer holds exactly one frame afterwards
+static int read_packet(struct ipc_reader *r, struct ipc_header *header) {
+  r->start = r->end = 0;
+  int status = reserve(&r->buffer, 0, &r->capacity, IPC_PACKET_MAX, r->locked);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {r->buffer, r->capacity};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  ssize_t count;
+  do {
+    count = recvmsg(r->pipe.read_end, &msg, MSG_CMSG_CLOEXEC);
+  } while (count < 0 && errno == EINTR);
+  if (count == 0) {
+    return READ_EOF;
+  } else if (count < 0) {
+    return READ_ERR;
+  }
+
+  int memfd = received_fd(&msg);
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC) || (size_t)count < sizeof(*header)) {
+    status = READ_ERR;
+  } else {
+    memcpy(header, r->buffer, sizeof(*header));
+    r->end = count;
+    if (header->length > IPC_MAX_PAYLOAD) {
+      status = READ_ERR;
+    } else if (memfd >= 0) {
+      status = (size_t)count == sizeof(*header) ? map_memfd(r, memfd, header->length) : READ_ERR;
+    } else {
+      status = r->end - sizeof(*header) == header->length ? SUCCESS : READ_ERR;
+    }
+  }
+
+  if (memfd >= 0) {
+    close(memfd);
+  }
   return status;
 }
+
+int ipc_read_frame(struct ipc_reader *r, struct ipc_frame *frame) {
+  struct ipc_header header;
+  int status;
+
+  // The previous frame is done with
+  unmap(r);
+
+  if (r->pipe.packet && !r->pipe.shm) {
+    status = read_packet(r, &header);
+    if (status != SUCCESS) {
+      return status;
+    }
+    frame->opcode = header.opcode;
+    frame->request_id = header.request_id;
+    frame->payload = r->mapping ? r->mapping : r->buffer + sizeof(header);
+    frame->length = header.length;
+    frame->pos = 0;
+    r->start = r->end;
+    return SUCCESS;
+  }
+
+  status = fill(r, sizeof(header));
+  if (status != SUCCESS) {
+    return status;
+  }
+  memcpy(&header, r->buffer + r->start, sizeof(header));
+  if (header.length > IPC_MAX_PAYLOAD) {
+    return READ_ERR;
+  }
+
+  status = fill(r, sizeof(header) + header.length);
+  if (status != SUCCESS) {
+    // The header was there, the payload has to follow
+    return status == READ_EOF ? READ_ERR : status;
+  }
+
+  frame->opcode = header.opcode;
+  frame->request_id = header.request_id;
+  frame->payload = r->buffer + r->start + sizeof(header);
+  frame->length = header.length;
+  frame->pos = 0;
+  r->start += sizeof(header) + header.length;
+  return SUCCESS;
+}
+
+bool ipc_reader_ready(struct ipc_reader *r) {
+  struct ipc_header header;
+
+  if (r->end - r->start >= sizeof(header)) {
+    memcpy(&header, r->buffer + r->start, sizeof(header));
+    if (r->end - r->start >= sizeof(header) + header.length) {
+      return true;
+    }
+  }
+  if (r->pipe.shm) {
+    return shm_readable(r->pipe);
+  }
+
+  struct pollfd pfd = {r->pipe.read_end, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+int ipc_get_int(struct ipc_frame *frame, int *n) {
+  int32_t value;
+  if (frame->length - frame->pos < sizeof(value)) {
+    return READ_ERR;
+  }
+  memcpy(&value, frame->payload + frame->pos, sizeof(value));
+  frame->pos += sizeof(value);
+  *n = value;
+  return SUCCESS;
+}
+
+int ipc_get_data(struct ipc_frame *frame, const char **data, int *length) {
+  int status = ipc_get_int(frame, length);
+  if (status != SUCCESS) {
+    return status;
+  }
+  if (*length < 0 || frame->length - frame->pos < (size_t)*length) {
+    return READ_ERR;
+  }
+  *data = frame->payload + frame->pos;
+  frame->pos += *length;
+  return SUCCESS;
+}
+
+int ipc_get_string(struct ipc_frame *frame, char **str) {
+  const char *data;
+  int length;
+
+  int status = ipc_get_data(frame, &data, &length);
+  if (status != SUCCESS) {
+    return status;
+  }
+  *str = malloc(length + 1);
+  if (!*str) {
+    return MALLOC_ERR;
+  }
+  memcpy(*str, data, length);
+  (*str)[length] = '\0';
+  return SUCCESS;
+}
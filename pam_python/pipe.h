@@ -1,10 +1,14 @@
 #ifndef _PAM_PYTHON_PIPE_H
 #define _PAM_PYTHON_PIPE_H
 
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define SUCCESS 0
@@ -12,18 +16,129 @@
 #define READ_ERR 2
 #define WRITE_ERR 3
 #define MALLOC_ERR 4
+#define OPTIONS_ERR 5
+#define TIMEOUT_ERR 6
+
+struct shm_channel;
 
 struct ipc_pipe {
   int read_end;
   int write_end;
+  // read_end == write_end is a SOCK_SEQPACKET socket, every frame is one datagram
+  bool packet;
+  // With transport=shm frames go through the shared region instead (see shm.h),
+  // the socket only tells whether the other side is still there
+  struct shm_channel *shm;
+  // Which pair of rings of the region is ours
+  bool shm_host;
+};
+
+// Every message is a frame: a header followed by `length` bytes of payload,
+// written with a single writev(). The payload is a sequence of native-endian
+// 32-bit ints and length-prefixed byte strings. The Python side uses the same
+// code through the Transport class of pam_python.pyx.
+//
+// The request id is chosen by the PAM host for each request and carried by
+// every frame exchanged while serving it, replies repeat the opcode of the call.
+struct ipc_header {
+  int32_t opcode;
+  uint32_t length;
+  uint32_t request_id;
 };
 
-int write_bytes(int fd, char *data, int n);
-int write_int(int fd, int n);
-int write_string(int fd, char *str, int length);
+// Larger frames are treated as a protocol error
+#define IPC_MAX_PAYLOAD (1 << 20)
+
+// Largest datagram on a packet socket. The payload of a bigger frame is put
+// into a sealed memfd, the datagram then only holds the header and the memfd
+// is passed along with it (SCM_RIGHTS). The receiver maps the memfd instead of
+// copying the payload out of it.
+#define IPC_PACKET_MAX (64 * 1024)
+
+// Payload of a frame being built
+struct ipc_message {
+  char *data;
+  size_t length;
+  size_t capacity;
+  // The buffer is mlock'd and left out of core dumps
+  bool locked;
+  // The buffer belongs to the caller, the message cannot grow beyond it
+  bool fixed;
+};
+
+void ipc_message_init(struct ipc_message *m);
+// Payload written into buffer, which the caller allocated and frees
+void ipc_message_init_buffer(struct ipc_message *m, char *buffer, size_t capacity);
+// The payload is wiped, it may contain passwords
+void ipc_message_free(struct ipc_message *m);
+
+int ipc_put_int(struct ipc_message *m, int n);
+int ipc_put_data(struct ipc_message *m, const char *data, int length);
+int ipc_put_string(struct ipc_message *m, const char *str);
+
+int ipc_write_frame(struct ipc_pipe p, int opcode, uint32_t request_id, const struct ipc_message *m);
+
+// Frames written together (one write() or sendmmsg()) on ipc_queue_flush().
+// The PAM host queues its replies while further calls of the Python side are
+// already waiting, so that calls sent ahead of time are answered in one go.
+struct ipc_queue {
+  struct ipc_pipe pipe;
+  // Whole frames, headers included
+  struct ipc_message frames;
+  size_t count;
+};
+
+// With locked the frames are kept in memory which is mlock'd and left out of core dumps
+void ipc_queue_init(struct ipc_queue *q, struct ipc_pipe p, bool locked);
+// The frames are wiped, they may contain passwords
+void ipc_queue_free(struct ipc_queue *q);
+
+// Frames which do not fit into a datagram flush the queue and are written right away
+int ipc_queue_frame(struct ipc_queue *q, int opcode, uint32_t request_id, const struct ipc_message *m);
+int ipc_queue_flush(struct ipc_queue *q);
+
+// Reads whole frames, usually with a single read() (or recvmsg()) each
+struct ipc_reader {
+  struct ipc_pipe pipe;
+  char *buffer;
+  size_t start;
+  size_t end;
+  size_t capacity;
+  // Payload of the last frame when it came in a memfd, mapped until the next frame
+  void *mapping;
+  size_t mapping_length;
+  // The buffer is mlock'd and left out of core dumps (a mapped memfd is not)
+  bool locked;
+};
+
+// A received frame. The payload points into the reader's buffer and is only
+// valid until the next ipc_read_frame().
+struct ipc_frame {
+  int opcode;
+  uint32_t request_id;
+  const char *payload;
+  size_t length;
+  size_t pos;
+};
+
+void ipc_reader_init(struct ipc_reader *r, struct ipc_pipe p, bool locked);
+// The buffer is wiped, it may contain passwords
+void ipc_reader_free(struct ipc_reader *r);
+
+int ipc_read_frame(struct ipc_reader *r, struct ipc_frame *frame);
+
+// Take over the mapping holding the payload of the last frame, which then
+// outlives the next ipc_read_frame(). The caller unmaps it with munmap().
+// NULL when the payload is in the reader's buffer.
+void *ipc_reader_take_mapping(struct ipc_reader *r, size_t *length);
+
+// Whether ipc_read_frame() would return without waiting for the other side
+bool ipc_reader_ready(struct ipc_reader *r);
 
-int read_bytes(int fd, char *data, int n);
-int read_int(int fd, int *n);
-int read_string(int fd, char *str, int length);
+int ipc_get_int(struct ipc_frame *frame, int *n);
+// data points into the frame, it is not NUL-terminated
+int ipc_get_data(struct ipc_frame *frame, const char **data, int *length);
+// NUL-terminated copy, to be freed by the caller
+int ipc_get_string(struct ipc_frame *frame, char **str);
 
 #endif
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+
+#include "pool.h"
+
+struct pool {
+  // Process which created the pool, the PAM host might fork afterwards
+  pid_t owner;
+  char *module_path;
+  int startup;
+  int transport;
+  int size;
+  // Recycling policies, taken like size from the call which created the pool
+  int max_requests;
+  int max_rss;
+  int max_age;
+  int idle_timeout;
+  // Autoscaling, size is max_workers then. The other fields are covered by pools_lock.
+  bool autoscale;
+  int min_spare;
+  int ramp_up;
+  int cool_down;
+  // EWMAs of the seconds between two requests and of the seconds a request keeps a worker
+  double interval;
+  double service;
+  double last_arrival;
+  // Requests which found no warm worker since the pool last grew
+  int misses;
+  double last_ramp;
+  // Since when the demand is below the pool, 0 when it is not
+  double below_since;
+  // Recycled processes which may still be exiting, reaped by sweep(). Covered by pools_lock.
+  pid_t *retired;
+  int retired_count;
+  int retired_size;
+  struct pool_worker *workers;
+  struct pool *next;
+};
+
+// Threads of the PAM host share the pools. The lock covers the list and the
+// busy flags, a claimed worker is only touched by the thread which claimed it.
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pools = NULL;
+
+// Weight of a new sample in the EWMAs of the autoscaling
+#define EWMA_WEIGHT 0.2
+
+static time_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static double now_precise(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double ewma(double average, double sample) {
+  return average == 0 ? sample : average + EWMA_WEIGHT * (sample - average);
+}
+
+// Give the slot a new process, which initializes in the background
+static int start(pam_handle_t *pamh, struct pool *pool, struct pool_worker *worker) {
+  if (spawn_worker(pamh, pool->module_path, pool->startup, pool->transport, 0, &worker->proc) != 0) {
+    return -1;
+  }
+  worker->requests = 0;
+  worker->started = worker->last_used = now();
+  return 0;
+}
+
+// Remember a recycled process for sweep() to reap
+static void keep_retired(struct pool *pool, pid_t pid) {
+  pthread_mutex_lock(&pools_lock);
+  if (pool->retired_count == pool->retired_size) {
+    int size = pool->retired_size > 0 ? pool->retired_size * 2 : pool->size;
+    pid_t *retired = realloc(pool->retired, size * sizeof(pid_t));
+    if (retired) {
+      pool->retired = retired;
+      pool->retired_size = size;
+    }
+  }
+  // Without memory the process stays a zombie until the PAM host exits
+  if (pool->retired_count < pool->retired_size) {
+    pool->retired[pool->retired_count++] = pid;
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+// Collect the recycled processes which have exited, without waiting for the others
+static void reap_retired(struct pool *pool) {
+  pthread_mutex_lock(&pools_lock);
+  for (int i = 0; i < pool->retired_count;) {
+    if (waitpid(pool->retired[i], NULL, WNOHANG) != 0) {
+      pool->retired[i] = pool->retired[--pool->retired_count];
+    } else {
+      i++;
+    }
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+// The worker is idle, closing its pipe is enough for it to exit. It is reaped
+// by a later sweep(), the calling thread never waits for Python to shut down.
+static void recycle(pam_handle_t *pamh, struct pool *pool, struct pool_worker *worker, bool replace) {
+  pid_t pid = retire_worker(&worker->proc);
+  if (pid > 0) {
+    keep_retired(pool, pid);
+  }
+  // A slot which failed to start is retried by pool_acquire() (autoscale() when autoscaled)
+  if (replace) {
+    start(pamh, pool, worker);
+  }
+}
+
+// Resident memory of a worker in MiB
+static long rss_mib(pid_t pid) {
+  char path[64];
+  long size, resident;
+
+  snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    return 0;
+  }
+  int count = fscanf(f, "%ld %ld", &size, &resident);
+  fclose(f);
+  return count == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) / 1024 : 0;
+}
+
+// The policy the worker has run into, NULL when it may serve more requests
+static const char *expired_policy(const struct pool *pool, const struct pool_worker *worker) {
+  if (pool->max_requests > 0 && worker->requests >= (unsigned long)pool->max_requests) {
+    return "max_requests";
+  }
+  if (pool->max_age > 0 && now() - worker->started >= pool->max_age) {
+    return "max_age";
+  }
+  if (pool->max_rss > 0 && rss_mib(worker->proc.pid) >= pool->max_rss) {
+    return "max_rss";
+  }
+  return NULL;
+}
+
+// The slots are empty, see start_empty(). Called with pools_lock held.
+static struct pool *pool_create(const struct pam_python_options *opts) {
+  struct pool *pool = calloc(1, sizeof(struct pool));
+  if (!pool) return NULL;
+
+  pool->module_path = strdup(opts->argv[0]);
+  pool->workers = calloc(opts->max_workers > 0 ? opts->max_workers : opts->workers, sizeof(struct pool_worker));
+  if (!pool->module_path || !pool->workers) {
+    free(pool->module_path);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+  }
+
+  pool->owner = getpid();
+  pool->startup = opts->startup;
+  pool->transport = opts->transport;
+  pool->size = opts->max_workers > 0 ? opts->max_workers : opts->workers;
+  pool->autoscale = opts->max_workers > 0;
+  pool->min_spare = opts->min_spare;
+  pool->ramp_up = opts->ramp_up;
+  pool->cool_down = opts->cool_down;
+  pool->max_requests = opts->max_requests;
+  pool->max_rss = opts->max_rss;
+  pool->max_age = opts->max_age;
+  pool->idle_timeout = opts->idle_timeout;
+  for (int i = 0; i < pool->size; i++) {
+    pool->workers[i].proc.pid = -1;
+    pool->workers[i].pool = pool;
+  }
+  // Keep the pools around after pam_end()
+  if (!pools) {
+    pin_module();
+  }
+  pool->next = pools;
+  pools = pool;
+  return pool;
+}
+
+// Drop the pools inherited from the process which forked us. Their workers
+// belong to it, only our copies of the pipes are closed: the processes are
+// neither told to exit nor reaped. Called with pools_lock held.
+static void disown_inherited(void) {
+  struct pool **link = &pools;
+  while (*link) {
+    struct pool *pool = *link;
+    if (pool->owner == getpid()) {
+      link = &pool->next;
+      continue;
+    }
+    *link = pool->next;
+    for (int i = 0; i < pool->size; i++) {
+      if (pool->workers[i].proc.pid != -1) {
+        pool->workers[i].proc.pid = -1;
+        retire_worker(&pool->workers[i].proc);
+      }
+    }
+    free(pool->retired);
+    free(pool->workers);
+    free(pool->module_path);
+    free(pool);
+  }
+}
+
+static struct pool *pool_find(const struct pam_python_options *opts) {
+  for (struct pool *pool = pools; pool; pool = pool->next) {
+    if (pool->startup == opts->startup && pool->transport == opts->transport &&
+        strcmp(pool->module_path, opts->argv[0]) == 0) {
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+// Mark an idle worker as busy, preferring a running one over the first empty
+// slot from index start on. An autoscaled pool only hands out running workers,
+// autoscale() fills its empty slots at the ramp_up pace. Called with pools_lock held.
+static struct pool_worker *claim(struct pool *pool, int start, int *index) {
+  for (int i = 0; i < pool->size; i++) {
+    if (!pool->workers[i].busy && pool->workers[i].proc.pid != -1) {
+      pool->workers[i].busy = true;
+      *index = i;
+      return &pool->workers[i];
+    }
+  }
+  if (pool->autoscale) {
+    return NULL;
+  }
+  for (int i = start; i < pool->size; i++) {
+    if (!pool->workers[i].busy) {
+      pool->workers[i].busy = true;
+      *index = i;
+      return &pool->workers[i];
+    }
+  }
+  return NULL;
+}
+
+static void unclaim(struct pool_worker *worker) {
+  pthread_mutex_lock(&pools_lock);
+  worker->busy = false;
+  pthread_mutex_unlock(&pools_lock);
+}
+
+// Workers with a process, busy ones count as such. Called with pools_lock held.
+static int count_warm(const struct pool *pool) {
+  int warm = 0;
+  for (int i = 0; i < pool->size; i++) {
+    if (pool->workers[i].busy || pool->workers[i].proc.pid != -1) {
+      warm++;
+    }
+  }
+  return warm;
+}
+
+// Stop the workers nobody used for idle_timeout seconds (their slots are
+// filled again on demand, an autoscaled pool keeps min_spare of them) and
+// reap the recycled ones which have exited since
+static void sweep(pam_handle_t *pamh, struct pool *pool) {
+  time_t t = now();
+  int removable = pool->size;
+
+  if (pool->autoscale) {
+    pthread_mutex_lock(&pools_lock);
+    removable = count_warm(pool) - pool->min_spare;
+    pthread_mutex_unlock(&pools_lock);
+  }
+
+  for (int i = 0; i < pool->size; i++) {
+    struct pool_worker *worker = &pool->workers[i];
+
+    // Fields of a worker nobody claimed do not change under us
+    pthread_mutex_lock(&pools_lock);
+    bool idle = !worker->busy && worker->proc.pid != -1 && pool->idle_timeout > 0 &&
+                t - worker->last_used >= pool->idle_timeout && removable > 0;
+    if (idle) {
+      worker->busy = true;
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    if (idle) {
+      recycle(pamh, pool, worker, false);
+      removable--;
+      unclaim(worker);
+    }
+  }
+  reap_retired(pool);
+}
+
+// Claim the idle running worker with the highest index, called with pools_lock held
+static struct pool_worker *claim_last_running(struct pool *pool) {
+  for (int i = pool->size - 1; i >= 0; i--) {
+    struct pool_worker *worker = &pool->workers[i];
+    if (!worker->busy && worker->proc.pid != -1) {
+      worker->busy = true;
+      return worker;
+    }
+  }
+  return NULL;
+}
+
+// Give up to count empty slots a process. pools_lock is not held while
+// spawning, other threads keep using the pool (and its other slots) meanwhile.
+// Workers initialize in parallel, a request only waits for the one it uses.
+static void start_empty(pam_handle_t *pamh, struct pool *pool, int count) {
+  for (int n = 0; n < count; n++) {
+    struct pool_worker *worker = NULL;
+
+    pthread_mutex_lock(&pools_lock);
+    for (int i = 0; i < pool->size && !worker; i++) {
+      if (!pool->workers[i].busy && pool->workers[i].proc.pid == -1) {
+        worker = &pool->workers[i];
+        worker->busy = true;
+      }
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (!worker) {
+      return;
+    }
+
+    // Slots which failed to spawn are retried by pool_acquire() (autoscale() when autoscaled)
+    int status = start(pamh, pool, worker);
+    unclaim(worker);
+    if (status != 0) {
+      return;
+    }
+  }
+}
+
+// Size the pool after the demand, called after each request with the seconds it kept its worker
+// and with 0 for each call which found no idle worker.
+// The demand is the number of workers busy on average (arrival rate times the time
+// a request keeps its worker) plus min_spare; calls which found no warm worker
+// grow the pool even when the averages do not ask for it yet.
+static void autoscale(pam_handle_t *pamh, struct pool *pool, double service) {
+  double t = now_precise();
+  int grow = 0;
+  struct pool_worker *victim = NULL;
+
+  pthread_mutex_lock(&pools_lock);
+  if (service > 0) {
+    pool->service = ewma(pool->service, service);
+  }
+  int warm = count_warm(pool);
+  double busy = pool->interval > 0 ? pool->service / pool->interval : 0;
+  int target = (int)busy + (busy > (int)busy) + pool->min_spare;
+  if (pool->misses > 0 && target <= warm) {
+    target = warm + 1;
+  }
+  if (target > pool->size) {
+    target = pool->size;
+  }
+  int misses = pool->misses;
+  double rate = pool->interval > 0 ? 1 / pool->interval : 0;
+  double service_ms = pool->service * 1000;
+
+  if (target > warm) {
+    pool->below_since = 0;
+    if (t - pool->last_ramp >= 1) {
+      grow = target - warm < pool->ramp_up ? target - warm : pool->ramp_up;
+      pool->last_ramp = t;
+      pool->misses = 0;
+    }
+  } else if (target < warm) {
+    if (pool->below_since == 0) {
+      pool->below_since = t;
+    } else if (t - pool->below_since >= pool->cool_down && (victim = claim_last_running(pool))) {
+      pool->below_since = t;
+    }
+  } else {
+    pool->below_since = 0;
+  }
+  pthread_mutex_unlock(&pools_lock);
+
+  if (grow > 0 || victim) {
+    pam_syslog(pamh, LOG_INFO,
+               "Scaling python workers for %s from %d to %d (%.1f requests/s, %.0f ms per request, %d cold starts)",
+               pool->module_path, warm, victim ? warm - 1 : warm + grow, rate, service_ms, misses);
+  }
+
+  if (victim) {
+    recycle(pamh, pool, victim, false);
+    unclaim(victim);
+  }
+  start_empty(pamh, pool, grow);
+}
+
+struct pool_worker *pool_acquire(pam_handle_t *pamh, const struct pam_python_options *opts) {
+  bool created = false;
+  pthread_mutex_lock(&pools_lock);
+  disown_inherited();
+  struct pool *pool = pool_find(opts);
+  if (!pool) {
+    pool = pool_create(opts);
+    created = pool != NULL;
+  }
+  double arrival = now_precise();
+  if (pool) {
+    if (pool->last_arrival > 0) {
+      pool->interval = ewma(pool->interval, arrival - pool->last_arrival);
+    }
+    pool->last_arrival = arrival;
+  }
+  pthread_mutex_unlock(&pools_lock);
+
+  if (!pool) {
+    pam_syslog(pamh, LOG_ERR, "Failed to create worker pool for %s", opts->argv[0]);
+    return NULL;
+  }
+  // Only the worker this call needs is started, the others follow the demand.
+  // A PAM host living for a single login must not pay for a whole pool.
+  if (created && pool->autoscale) {
+    start_empty(pamh, pool, 1);
+  }
+
+  int i = 0;
+  while (true) {
+    pthread_mutex_lock(&pools_lock);
+    struct pool_worker *worker = claim(pool, i, &i);
+    // The caller waits for a worker to start, or for a one-off fork
+    if (!worker || worker->proc.pid == -1) {
+      pool->misses++;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (!worker) {
+      if (pool->autoscale) {
+        autoscale(pamh, pool, 0);
+      }
+      return NULL;
+    }
+    i++;
+
+    if (worker->proc.pid != -1 && !worker_idle(&worker->proc)) {
+      pam_syslog(pamh, LOG_WARNING, "Python worker %d exited, replacing it", worker->proc.pid);
+      stop_worker(&worker->proc, true);
+    }
+    // The slot of a worker which exited in an autoscaled pool is left to autoscale()
+    if (worker->proc.pid == -1 && (pool->autoscale || start(pamh, pool, worker) != 0)) {
+      unclaim(worker);
+      continue;
+    }
+    worker->claimed_at = arrival;
+    return worker;
+  }
+}
+
+void pool_release(pam_handle_t *pamh, struct pool_worker *worker, bool healthy) {
+  struct pool *pool = worker->pool;
+  double service = now_precise() - worker->claimed_at;
+
+  if (!healthy) {
+    stop_worker(&worker->proc, true);
+  } else {
+    worker->requests++;
+    worker->last_used = now();
+    const char *policy = expired_policy(pool, worker);
+    if (policy) {
+      pam_syslog(pamh, LOG_INFO, "Recycling python worker %d after %lu requests (%s)", worker->proc.pid,
+                 worker->requests, policy);
+      recycle(pamh, pool, worker, true);
+    }
+  }
+  unclaim(worker);
+  sweep(pamh, pool);
+  if (pool->autoscale && healthy) {
+    autoscale(pamh, pool, service);
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef _PAM_PYTHON_POOL_H
+#define _PAM_PYTHON_POOL_H
+
+#include <pthread.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "module.h"
+#include "options.h"
+#include "pipe.h"
+#include "spawn.h"
+
+struct pool;
+
+// A long-lived child of the PAM host with the interpreter initialized and the
+// user module imported. It serves requests over its pipe until it is recycled
+// (see PAM_PYTHON_MAX_REQUESTS).
+struct pool_worker {
+  struct worker_process proc;
+  bool busy;
+  struct pool *pool;
+  // Requests served by proc, CLOCK_MONOTONIC seconds of its start and of its last request
+  unsigned long requests;
+  time_t started;
+  time_t last_used;
+  // When the current request claimed the worker, in seconds (see the autoscaling in pool.c)
+  double claimed_at;
+};
+
+// Borrow an idle worker for opts->argv[0], an empty slot gets a new process
+// when no worker is running idle (except with max_workers, the caller forks
+// instead and the pool grows by ramp_up). The pool is created empty on first
+// use and lives as long as the PAM host process (a child forked by the host gets
+// pools of its own), see PAM_PYTHON_POOL_WORKERS. Safe to call from any thread.
+// Returns NULL when no worker is available.
+struct pool_worker *pool_acquire(pam_handle_t *pamh, const struct pam_python_options *opts);
+
+// Give the worker back to the pool. A worker whose pipe failed is discarded
+// and replaced on the next pool_acquire(), one due for recycling is replaced
+// right away.
+void pool_release(pam_handle_t *pamh, struct pool_worker *worker, bool healthy);
+
+#endif
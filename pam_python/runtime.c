@@ -0,0 +1,47 @@
+#include "runtime.h"
+
+#define RESOLVE(handle, name) \
+  if (!(runtime.name = dlsym(handle, #name))) goto error
+
+static pthread_once_t runtime_once = PTHREAD_ONCE_INIT;
+static struct python_runtime runtime;
+static bool runtime_loaded = false;
+static char runtime_error[512];
+
+static void load(void) {
+  char extension[PATH_MAX];
+
+  // Extension modules imported later on resolve the C API through the global scope
+  if (!dlopen(LIBPYTHON_SO, RTLD_NOW | RTLD_GLOBAL | RTLD_NODELETE)) {
+    goto error;
+  }
+
+  if (module_sibling(PAM_PYTHON_EXTENSION, extension, sizeof(extension)) != 0) {
+    snprintf(runtime_error, sizeof(runtime_error), "Can't locate %s", PAM_PYTHON_EXTENSION);
+    return;
+  }
+  void *handle = dlopen(extension, RTLD_NOW | RTLD_NODELETE);
+  if (!handle) {
+    goto error;
+  }
+
+  RESOLVE(handle, worker_fork);
+  RESOLVE(handle, worker_run);
+  RESOLVE(handle, inprocess_request);
+
+  runtime_loaded = true;
+  return;
+
+error:
+  snprintf(runtime_error, sizeof(runtime_error), "%s", dlerror());
+}
+
+const struct python_runtime *runtime_load(pam_handle_t *pamh) {
+  pthread_once(&runtime_once, load);
+
+  if (!runtime_loaded) {
+    pam_syslog(pamh, LOG_ERR, "Failed to load Python: %s", runtime_error);
+    return NULL;
+  }
+  return &runtime;
+}
@@ -0,0 +1,37 @@
+#ifndef _PAM_PYTHON_RUNTIME_H
+#define _PAM_PYTHON_RUNTIME_H
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "module.h"
+#include "options.h"
+#include "pipe.h"
+
+// The PAM module does not link libpython. Everything which calls into Python
+// lives in the extension module (pam_python.cpython-*.so, installed next to
+// the PAM module) and is loaded together with libpython by the first request
+// which needs an interpreter in this process. Stacks which never get to a
+// pam_python line, and requests served by pam-python-worker or the daemon,
+// don't map libpython at all.
+//
+// See worker.h and inprocess.h for what the functions do.
+struct python_runtime {
+  pid_t (*worker_fork)(void);
+  void (*worker_run)(struct ipc_pipe child, const char *module_path, int startup, int max_requests);
+  int (*inprocess_request)(pam_handle_t *pamh, char *pam_fn_name, int flags,
+                           const struct pam_python_options *opts, int *retval);
+};
+
+// Load libpython and the extension module on first use. They are never unloaded.
+// Returns NULL if Python is not available.
+const struct python_runtime *runtime_load(pam_handle_t *pamh);
+
+#endif
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+// How long a side sleeps before checking whether the other one is still there
+#define LIVENESS_CHECK_MS 250
+
+int shm_create(struct shm_channel **channel) {
+  int fd = memfd_create("pam_python", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(struct shm_channel)) != 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  void *region = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  // The memfd starts zeroed
+  *channel = region;
+  (*channel)->magic = SHM_MAGIC;
+  return fd;
+}
+
+struct shm_channel *shm_attach(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(struct shm_channel)) {
+    return NULL;
+  }
+
+  struct shm_channel *channel = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (channel == MAP_FAILED) {
+    return NULL;
+  }
+  if (channel->magic != SHM_MAGIC) {
+    shm_unmap(channel);
+    return NULL;
+  }
+  return channel;
+}
+
+static void futex_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void futex_wait(uint32_t *word, uint32_t expected) {
+  struct timespec timeout = {0, LIVENESS_CHECK_MS * 1000000L};
+  syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+// Called after changing the ring. A side which saw the old events value before
+// looking at the ring either sees the change or does not go to sleep.
+static void notify(struct shm_ring *ring) {
+  __atomic_add_fetch(&ring->events, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&ring->events);
+  }
+}
+
+// Sleep until the ring changes (events differs from seen) or the liveness check is due
+static void wait_for_change(struct shm_ring *ring, uint32_t seen) {
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+  futex_wait(&ring->events, seen);
+  __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+void shm_close(struct shm_channel *channel) {
+  __atomic_store_n(&channel->to_python.closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&channel->to_host.closed, 1, __ATOMIC_SEQ_CST);
+  notify(&channel->to_python);
+  notify(&channel->to_host);
+}
+
+void shm_unmap(struct shm_channel *channel) {
+  munmap(channel, sizeof(struct shm_channel));
+}
+
+static struct shm_ring *outgoing(struct ipc_pipe p) {
+  return p.shm_host ? &p.shm->to_python : &p.shm->to_host;
+}
+
+static struct shm_ring *incoming(struct ipc_pipe p) {
+  return p.shm_host ? &p.shm->to_host : &p.shm->to_python;
+}
+
+// Nothing is ever written to the socket, it becomes readable when the other side exits
+static bool peer_gone(struct ipc_pipe p) {
+  struct pollfd pfd = {p.read_end, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+int shm_write(struct ipc_pipe p, const struct iovec *iov, int count) {
+  struct shm_ring *ring = outgoing(p);
+
+  for (int i = 0; i < count; i++) {
+    const char *data = iov[i].iov_base;
+    size_t remaining = iov[i].iov_len;
+
+    while (remaining > 0) {
+      if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+        return WRITE_ERR;
+      }
+
+      uint32_t events = __atomic_load_n(&ring->events, __ATOMIC_SEQ_CST);
+      uint32_t head = ring->head;
+      uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+      size_t space = SHM_RING_SIZE - (head - tail);
+      if (space == 0) {
+        wait_for_change(ring, events);
+        if (__atomic_load_n(&ring->events, __ATOMIC_SEQ_CST) == events && peer_gone(p)) {
+          return WRITE_ERR;
+        }
+        continue;
+      }
+
+      // Up to the end of the ring, the rest goes to its start on the next round
+      size_t offset = head % SHM_RING_SIZE;
+      size_t chunk = remaining < space ? remaining : space;
+      if (chunk > SHM_RING_SIZE - offset) {
+        chunk = SHM_RING_SIZE - offset;
+      }
+      memcpy(ring->data + offset, data, chunk);
+      data += chunk;
+      remaining -= chunk;
+
+      __atomic_store_n(&ring->head, head + chunk, __ATOMIC_SEQ_CST);
+      notify(ring);
+    }
+  }
+  return SUCCESS;
+}
+
+bool shm_readable(struct ipc_pipe p) {
+  struct shm_ring *ring = incoming(p);
+  return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail;
+}
+
+void shm_wait(struct ipc_pipe p) {
+  struct shm_ring *ring = incoming(p);
+
+  uint32_t events = __atomic_load_n(&ring->events, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail) {
+    wait_for_change(ring, events);
+  }
+}
+
+ssize_t shm_read(struct ipc_pipe p, char *buffer, size_t n) {
+  struct shm_ring *ring = incoming(p);
+
+  while (true) {
+    uint32_t events = __atomic_load_n(&ring->events, __ATOMIC_SEQ_CST);
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+    if (head == tail) {
+      if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+        return -READ_EOF;
+      }
+      wait_for_change(ring, events);
+      if (__atomic_load_n(&ring->events, __ATOMIC_SEQ_CST) == events && peer_gone(p)) {
+        return -READ_EOF;
+      }
+      continue;
+    }
+
+    size_t offset = tail % SHM_RING_SIZE;
+    size_t available = head - tail;
+    size_t chunk = n < available ? n : available;
+    if (chunk > SHM_RING_SIZE - offset) {
+      chunk = SHM_RING_SIZE - offset;
+    }
+    memcpy(buffer, ring->data + offset, chunk);
+
+    __atomic_store_n(&ring->tail, tail + chunk, __ATOMIC_SEQ_CST);
+    notify(ring);
+    return chunk;
+  }
+}
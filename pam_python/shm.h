@@ -0,0 +1,73 @@
+#ifndef _PAM_PYTHON_SHM_H
+#define _PAM_PYTHON_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipe.h"
+
+// transport=shm: frames are copied into a memfd region shared with the worker
+// instead of going through the kernel. The region holds a single-producer
+// single-consumer ring per direction, a side which has to wait sleeps on a
+// futex. The socket stays around so that either side notices when the other
+// one exits, nothing is written to it.
+
+#define SHM_MAGIC     0x70796d31
+#define SHM_RING_SIZE (64 * 1024)
+
+struct shm_ring {
+  // Bytes ever written and read (wrapping)
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail __attribute__((aligned(64)));
+  // Futex word, bumped whenever head, tail or closed change
+  uint32_t events __attribute__((aligned(64)));
+  // Whether a side sleeps on events, saves the wake-up syscall otherwise
+  uint32_t waiting;
+  // Set by the PAM host when it is done with the worker
+  uint32_t closed;
+  char data[SHM_RING_SIZE];
+};
+
+struct shm_channel {
+  uint32_t magic;
+  struct shm_ring to_python;
+  struct shm_ring to_host;
+};
+
+// Create and map a new region. Returns its memfd (for the worker) or -1.
+int shm_create(struct shm_channel **channel);
+
+// Map the region created by the PAM host, NULL if fd is not one
+struct shm_channel *shm_attach(int fd);
+
+// Wake up the worker, its reads fail with READ_EOF from now on
+void shm_close(struct shm_channel *channel);
+
+void shm_unmap(struct shm_channel *channel);
+
+// Write the whole iovec into the outgoing ring of p, waiting for space as needed
+int shm_write(struct ipc_pipe p, const struct iovec *iov, int count);
+
+// Whether the incoming ring of p holds anything
+bool shm_readable(struct ipc_pipe p);
+
+// Sleep until something is written into the incoming ring of p, but no longer
+// than the interval at which the liveness of the other side is checked
+void shm_wait(struct ipc_pipe p);
+
+// Read whatever is in the incoming ring of p (at most n bytes), waiting for
+// at least one byte. Returns the number of bytes read or -READ_EOF/-READ_ERR.
+ssize_t shm_read(struct ipc_pipe p, char *buffer, size_t n);
+
+#endif
@@ -0,0 +1,73 @@
+#include "sock.h"
+
+static bool dir_ok(pam_handle_t *pamh, const char *dir) {
+  struct stat st;
+
+  if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    pam_syslog(pamh, LOG_ERR, "%s is not a directory", dir);
+    return false;
+  }
+
+  if ((st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    pam_syslog(pamh, LOG_ERR, "Refusing to use %s, it is writable by other users", dir);
+    return false;
+  }
+
+  return true;
+}
+
+bool runtime_dir_ok(pam_handle_t *pamh) {
+  if (mkdir(PAM_PYTHON_RUNTIME_DIR, 0700) != 0 && errno != EEXIST) {
+    pam_syslog(pamh, LOG_ERR, "Failed to create %s: %m", PAM_PYTHON_RUNTIME_DIR);
+    return false;
+  }
+  return dir_ok(pamh, PAM_PYTHON_RUNTIME_DIR);
+}
+
+bool socket_dir_ok(pam_handle_t *pamh, const char *path) {
+  char dir[PATH_MAX];
+
+  if (strlen(path) >= sizeof(dir)) {
+    return false;
+  }
+  strcpy(dir, path);
+  return dir_ok(pamh, dirname(dir));
+}
+
+int connect_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int listen_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,31 @@
+#ifndef _PAM_PYTHON_SOCK_H
+#define _PAM_PYTHON_SOCK_H
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Directory holding the zygote and daemon sockets, must only be writable by root
+#define PAM_PYTHON_RUNTIME_DIR "/run/pam_python"
+
+// Create PAM_PYTHON_RUNTIME_DIR if needed and check that it can be trusted
+bool runtime_dir_ok(pam_handle_t *pamh);
+
+// Check that the directory containing the socket at path can be trusted,
+// anyone able to plant a socket in there could impersonate the server
+bool socket_dir_ok(pam_handle_t *pamh, const char *path);
+
+int connect_socket(const char *path);
+
+int listen_socket(const char *path);
+
+#endif
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include "spawn.h"
+
+#include "runtime.h"
+#include "shm.h"
+#include "worker.h"
+
+extern char **environ;
+
+// Moves fd above the descriptors the worker expects its pipe on
+static int fd_above_worker_fds(int fd) {
+  if (fd < 0 || fd > WORKER_SHM_FD) {
+    return fd;
+  }
+  return fcntl(fd, F_DUPFD_CLOEXEC, WORKER_SHM_FD + 1);
+}
+
+// Start pam-python-worker (installed next to the module). Unlike fork() the cost
+// does not depend on the size of the PAM host and the worker starts with a single
+// thread and default signal handling.
+// Returns -1 when the executable is not available.
+static pid_t exec_worker(pam_handle_t *pamh, struct ipc_pipe child, int transport, int shm_fd,
+                         const char *module_path, int startup, int max_requests) {
+  char extension[PATH_MAX];
+  char executable[PATH_MAX];
+  char startup_str[16];
+  char max_requests_str[16];
+  char transport_str[16];
+
+  if (module_sibling(PAM_PYTHON_EXTENSION, extension, sizeof(extension)) != 0 ||
+      module_sibling(WORKER_EXECUTABLE, executable, sizeof(executable)) != 0) {
+    return -1;
+  }
+  if (access(executable, X_OK) != 0) {
+    pam_syslog(pamh, LOG_DEBUG, "%s not available, forking the worker", executable);
+    return -1;
+  }
+  snprintf(startup_str, sizeof(startup_str), "%d", startup);
+  snprintf(max_requests_str, sizeof(max_requests_str), "%d", max_requests);
+  snprintf(transport_str, sizeof(transport_str), "%d", transport);
+
+  // A socket is both ends
+  int read_end = fd_above_worker_fds(child.read_end);
+  int write_end = child.write_end == child.read_end ? -1 : fd_above_worker_fds(child.write_end);
+  int region = fd_above_worker_fds(shm_fd);
+  if (read_end < 0 || (child.write_end != child.read_end && write_end < 0) || (shm_fd >= 0 && region < 0)) {
+    if (read_end >= 0 && read_end != child.read_end) close(read_end);
+    if (write_end >= 0 && write_end != child.write_end) close(write_end);
+    if (region >= 0 && region != shm_fd) close(region);
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, read_end, WORKER_READ_FD);
+  if (write_end >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, write_end, WORKER_WRITE_FD);
+  }
+  if (region >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, region, WORKER_SHM_FD);
+  }
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigfillset(&signals);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+
+  char *argv[] = {executable,    LIBPYTHON_SO,        extension, startup_str, max_requests_str,
+                  transport_str, (char *)module_path, NULL};
+  pid_t pid;
+  int err = posix_spawn(&pid, executable, &actions, &attr, argv, environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (read_end != child.read_end) close(read_end);
+  if (write_end >= 0 && write_end != child.write_end) close(write_end);
+  if (region != shm_fd) close(region);
+
+  if (err != 0) {
+    errno = err;
+    pam_syslog(pamh, LOG_WARNING, "Failed to start %s: %m, forking the worker", executable);
+    return -1;
+  }
+  return pid;
+}
+
+// Fork the PAM host, the child runs the Python side itself (and inherits the
+// mapping of the shared region, if any)
+static pid_t fork_worker(pam_handle_t *pamh, struct ipc_pipe child, const char *module_path, int startup,
+                         int max_requests) {
+  const struct python_runtime *python = runtime_load(pamh);
+  if (!python) {
+    return -1;
+  }
+
+  pid_t pid = python->worker_fork();
+  if (pid == -1) {
+    pam_syslog(pamh, LOG_ERR, "Failed to fork: %m");
+  } else if (pid == 0) {
+    python->worker_run(child, module_path, startup, max_requests);
+  }
+  return pid;
+}
+
+static void close_pipe(struct ipc_pipe p) {
+  close(p.read_end);
+  if (p.write_end != p.read_end) {
+    close(p.write_end);
+  }
+}
+
+// A SOCK_SEQPACKET socketpair (one descriptor on each side) unless transport=pipe
+static int open_channel(pam_handle_t *pamh, int transport, struct ipc_pipe *host, struct ipc_pipe *child) {
+  if (transport != PAM_PYTHON_TRANSPORT_PIPE) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+      pam_syslog(pamh, LOG_ERR, "Failed to create socket pair: %m");
+      return -1;
+    }
+    *host = (struct ipc_pipe){.read_end = sv[0], .write_end = sv[0], .packet = true};
+    *child = (struct ipc_pipe){.read_end = sv[1], .write_end = sv[1], .packet = true};
+    return 0;
+  }
+
+  int parent_child[2];
+  int child_parent[2];
+  if (pipe2(parent_child, O_CLOEXEC) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to create pipe: %m");
+    return -1;
+  }
+  if (pipe2(child_parent, O_CLOEXEC) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to create pipe: %m");
+    close(parent_child[0]);
+    close(parent_child[1]);
+    return -1;
+  }
+  *host = (struct ipc_pipe){.read_end = child_parent[0], .write_end = parent_child[1]};
+  *child = (struct ipc_pipe){.read_end = parent_child[0], .write_end = child_parent[1]};
+  return 0;
+}
+
+int spawn_worker(pam_handle_t *pamh, const char *module_path, int startup, int transport, int max_requests,
+                 struct worker_process *worker) {
+  struct ipc_pipe host, child;
+  struct shm_channel *shm = NULL;
+  int shm_fd = -1;
+
+  if (open_channel(pamh, transport, &host, &child) != 0) {
+    return -1;
+  }
+
+  if (transport == PAM_PYTHON_TRANSPORT_SHM) {
+    shm_fd = shm_create(&shm);
+    if (shm_fd < 0) {
+      pam_syslog(pamh, LOG_WARNING, "Failed to create shared memory: %m, using the socket");
+      transport = PAM_PYTHON_TRANSPORT_SOCKET;
+    }
+  }
+  host.shm = child.shm = shm;
+  host.shm_host = true;
+
+  pid_t pid = exec_worker(pamh, child, transport, shm_fd, module_path, startup, max_requests);
+  if (pid == -1) {
+    pid = fork_worker(pamh, child, module_path, startup, max_requests);
+  }
+  if (shm_fd >= 0) {
+    close(shm_fd);
+  }
+  close_pipe(child);
+  if (pid == -1) {
+    if (shm) shm_unmap(shm);
+    close_pipe(host);
+    return -1;
+  }
+
+  worker->pid = pid;
+  worker->pipe = host;
+  return 0;
+}
+
+pid_t retire_worker(struct worker_process *worker) {
+  pid_t pid = worker->pid;
+
+  // Only the process which started the worker may tell it to exit,
+  // pid is -1 in children of the PAM host (see transaction.c)
+  if (worker->pipe.shm && pid > 0) {
+    shm_close(worker->pipe.shm);
+  }
+  close_pipe(worker->pipe);
+  if (worker->pipe.shm) {
+    shm_unmap(worker->pipe.shm);
+    worker->pipe.shm = NULL;
+  }
+  worker->pid = -1;
+  return pid;
+}
+
+void stop_worker(struct worker_process *worker, bool force) {
+  if (force && worker->pid > 0) {
+    kill(worker->pid, SIGKILL);
+  }
+  pid_t pid = retire_worker(worker);
+  if (pid > 0) {
+    // Closing the pipe makes an idle worker exit
+    waitpid(pid, NULL, 0);
+  }
+}
+
+bool worker_idle(struct worker_process *worker) {
+  struct pollfd pfd = {worker->pipe.read_end, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _PAM_PYTHON_SPAWN_H
+#define _PAM_PYTHON_SPAWN_H
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "pipe.h"
+
+// A Python process serving requests of the PAM host over pipe.
+// pid is -1 when the process is not our child (zygotes, daemon).
+struct worker_process {
+  pid_t pid;
+  struct ipc_pipe pipe;
+};
+
+// Start a worker which serves up to max_requests requests (0 means until the pipe
+// is closed). Long-lived workers import the module right away.
+// The worker runs pam-python-worker when it is installed, otherwise it is forked.
+// startup is the PAM_PYTHON_STARTUP_* profile the worker initializes Python with,
+// transport the PAM_PYTHON_TRANSPORT_* it is talked to over.
+int spawn_worker(pam_handle_t *pamh, const char *module_path, int startup, int transport, int max_requests,
+                 struct worker_process *worker);
+
+// Close the pipe (and the shared region) and reap the worker. With force, the worker is killed first
+// in case it is stuck in the middle of a request.
+void stop_worker(struct worker_process *worker, bool force);
+
+// Close the pipe of an idle worker, which then exits on its own, without waiting
+// for it. Returns the pid to reap later, -1 when the worker is not our child.
+pid_t retire_worker(struct worker_process *worker);
+
+// An idle worker never writes anything, so anything readable means it exited
+bool worker_idle(struct worker_process *worker);
+
+#endif
@@ -0,0 +1,69 @@
+#include "transaction.h"
+
+#define TRANSACTION_DATA_PREFIX "pam_python_worker:"
+
+struct transaction_worker {
+  struct worker_process proc;
+  // Process which stored the worker, the PAM host might fork afterwards
+  pid_t owner;
+};
+
+// Every module gets its own worker
+static void data_name(const char *module_path, char *name, size_t size) {
+  snprintf(name, size, "%s%s", TRANSACTION_DATA_PREFIX, module_path);
+}
+
+static void transaction_cleanup(pam_handle_t *pamh, void *data, int error_status) {
+  struct transaction_worker *worker = data;
+  (void)pamh;
+
+  if (worker->owner != getpid()) {
+    // Only our copy of the pipe goes away, the worker belongs to the original process
+    worker->proc.pid = -1;
+  }
+  // A replaced worker is dropped because its pipe failed, it might be stuck
+  stop_worker(&worker->proc, error_status & PAM_DATA_REPLACE);
+  free(worker);
+}
+
+struct worker_process *transaction_get(pam_handle_t *pamh, const char *module_path) {
+  char name[PATH_MAX + sizeof(TRANSACTION_DATA_PREFIX)];
+  const struct transaction_worker *worker;
+
+  data_name(module_path, name, sizeof(name));
+  if (pam_get_data(pamh, name, (const void **)&worker) != PAM_SUCCESS || !worker) {
+    return NULL;
+  }
+
+  if (worker->owner != getpid()) {
+    return NULL;
+  }
+  return (struct worker_process *)&worker->proc;
+}
+
+int transaction_keep(pam_handle_t *pamh, const char *module_path, const struct worker_process *proc) {
+  char name[PATH_MAX + sizeof(TRANSACTION_DATA_PREFIX)];
+
+  struct transaction_worker *worker = malloc(sizeof(struct transaction_worker));
+  if (!worker) {
+    return -1;
+  }
+  worker->proc = *proc;
+  worker->owner = getpid();
+
+  data_name(module_path, name, sizeof(name));
+  if (pam_set_data(pamh, name, worker, transaction_cleanup) != PAM_SUCCESS) {
+    pam_syslog(pamh, LOG_ERR, "Failed to store the python worker on the pam handle");
+    free(worker);
+    return -1;
+  }
+  return 0;
+}
+
+void transaction_drop(pam_handle_t *pamh, const char *module_path) {
+  char name[PATH_MAX + sizeof(TRANSACTION_DATA_PREFIX)];
+
+  data_name(module_path, name, sizeof(name));
+  // Replacing the data runs transaction_cleanup() on the old value
+  pam_set_data(pamh, name, NULL, NULL);
+}
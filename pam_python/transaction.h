@@ -0,0 +1,28 @@
+#ifndef _PAM_PYTHON_TRANSACTION_H
+#define _PAM_PYTHON_TRANSACTION_H
+
+#include <limits.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "spawn.h"
+
+// With reuse=transaction, the worker serving the first pam_sm_* call of a PAM
+// transaction is stored on the pam handle and serves every later call of the
+// same transaction. Module level state thus survives from pam_sm_authenticate
+// to pam_sm_close_session. The worker is stopped in pam_end().
+
+// Returns the worker stored for the module or NULL
+struct worker_process *transaction_get(pam_handle_t *pamh, const char *module_path);
+
+// Hand the worker over to the pam handle, returns 0 on success
+int transaction_keep(pam_handle_t *pamh, const char *module_path, const struct worker_process *worker);
+
+// Stop the stored worker and forget about it
+void transaction_drop(pam_handle_t *pamh, const char *module_path);
+
+#endif
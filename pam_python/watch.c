@@ -0,0 +1,111 @@
+#include "watch.h"
+
+static int add(struct worker_watch *w, int fd) {
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  return epoll_ctl(w->epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+int watch_init(struct worker_watch *w, const struct worker_process *worker, int timeout) {
+  w->pidfd = -1;
+  w->timer = -1;
+  w->pipe = worker->pipe;
+  w->remaining = (struct timespec){timeout, 0};
+
+  w->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epoll < 0 || add(w, worker->pipe.read_end) != 0) {
+    goto fail;
+  }
+
+#ifdef SYS_pidfd_open
+  if (worker->pid > 0) {
+    // Kernels before 5.3 have no pidfds, the pipe still tells when the worker exits
+    w->pidfd = syscall(SYS_pidfd_open, worker->pid, 0);
+    if (w->pidfd >= 0 && add(w, w->pidfd) != 0) {
+      goto fail;
+    }
+  }
+#endif
+
+  if (timeout > 0) {
+    w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (w->timer < 0 || add(w, w->timer) != 0) {
+      goto fail;
+    }
+  }
+  return 0;
+
+fail:
+  watch_free(w);
+  return -1;
+}
+
+void watch_free(struct worker_watch *w) {
+  if (w->epoll >= 0) close(w->epoll);
+  if (w->pidfd >= 0) close(w->pidfd);
+  if (w->timer >= 0) close(w->timer);
+  w->epoll = w->pidfd = w->timer = -1;
+}
+
+// -1 when nothing happened within timeout_ms
+static int wait_events(struct worker_watch *w, int timeout_ms) {
+  struct epoll_event events[3];
+  int count;
+
+  do {
+    count = epoll_wait(w->epoll, events, 3, timeout_ms);
+  } while (count < 0 && errno == EINTR);
+  if (count < 0) {
+    return WATCH_ERR;
+  }
+
+  // Whatever the worker sent before it exited is read first
+  int result = -1;
+  for (int i = 0; i < count; i++) {
+    if (events[i].data.fd == w->pipe.read_end) {
+      return WATCH_READY;
+    } else if (events[i].data.fd == w->pidfd) {
+      result = WATCH_EXITED;
+    } else if (events[i].data.fd == w->timer && result < 0) {
+      result = WATCH_TIMEOUT;
+    }
+  }
+  return result;
+}
+
+// The rings of transport=shm are not file descriptors, the socket only becomes
+// readable when the worker exits. Sleep on the incoming ring and look at the
+// other events in between.
+static int wait_shm(struct worker_watch *w) {
+  while (!shm_readable(w->pipe)) {
+    int result = wait_events(w, 0);
+    if (result >= 0) {
+      return result;
+    }
+    shm_wait(w->pipe);
+  }
+  return WATCH_READY;
+}
+
+int watch_wait(struct worker_watch *w) {
+  if (w->timer >= 0) {
+    if (w->remaining.tv_sec == 0 && w->remaining.tv_nsec == 0) {
+      return WATCH_TIMEOUT;
+    }
+    struct itimerspec deadline = {.it_value = w->remaining};
+    if (timerfd_settime(w->timer, 0, &deadline, NULL) != 0) {
+      return WATCH_ERR;
+    }
+  }
+
+  int result = w->pipe.shm ? wait_shm(w) : wait_events(w, -1);
+
+  if (w->timer >= 0) {
+    // Time the host then spends serving the call does not count
+    struct itimerspec left;
+    if (timerfd_gettime(w->timer, &left) != 0) {
+      return WATCH_ERR;
+    }
+    w->remaining = left.it_value;
+  }
+  return result;
+}
@@ -0,0 +1,45 @@
+#ifndef _PAM_PYTHON_WATCH_H
+#define _PAM_PYTHON_WATCH_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipe.h"
+#include "shm.h"
+#include "spawn.h"
+
+// What the PAM host waits on while a worker serves a request: the pipe of the
+// worker, its exit (a pidfd, only for our own children) and the deadline of
+// the request (a timerfd, see the timeout= option), all in one epoll set.
+// The deadline only runs while the host waits for the worker, time spent
+// serving its calls (a conversation waiting for the user) does not count.
+
+#define WATCH_READY   0
+#define WATCH_EXITED  1
+#define WATCH_TIMEOUT 2
+#define WATCH_ERR     3
+
+struct worker_watch {
+  int epoll;
+  int pidfd;
+  int timer;
+  struct ipc_pipe pipe;
+  // What is left of the timeout
+  struct timespec remaining;
+};
+
+// timeout is in seconds, 0 means no deadline. Returns -1 on failure.
+int watch_init(struct worker_watch *w, const struct worker_process *worker, int timeout);
+
+void watch_free(struct worker_watch *w);
+
+// Wait until the pipe is readable (WATCH_READY, which includes the worker closing
+// it), the worker exits without closing it (WATCH_EXITED) or the deadline passes
+int watch_wait(struct worker_watch *w);
+
+#endif
@@ -0,0 +1,334 @@
+#include "worker.h"
+
+#include "pam_python.h"
+#include "shm.h"
+#include "sock.h"
+
+static void close_fd_range(unsigned int first, unsigned int last) {
+  if (first > last || close_range(first, last, 0) == 0) {
+    return;
+  }
+
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  for (long fd = first; fd <= last && fd < max_fd; fd++) {
+    close(fd);
+  }
+}
+
+void worker_close_fds(int keep_a, int keep_b) {
+  unsigned int lo = keep_a < keep_b ? keep_a : keep_b;
+  unsigned int hi = keep_a < keep_b ? keep_b : keep_a;
+
+  close_fd_range(STDERR_FILENO + 1, lo - 1);
+  close_fd_range(lo + 1, hi - 1);
+  close_fd_range(hi + 1, ~0U);
+}
+
+pthread_mutex_t python_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pid_t worker_fork(void) {
+  pid_t pid;
+
+  // The child is a copy of the calling thread, it releases the lock as well
+  pthread_mutex_lock(&python_lock);
+  if (!Py_IsInitialized()) {
+    pid = fork();
+    pthread_mutex_unlock(&python_lock);
+    return pid;
+  }
+
+  // The child keeps the interpreter, it has to be in a consistent state
+  PyGILState_STATE gil = PyGILState_Ensure();
+  PyOS_BeforeFork();
+  pid = fork();
+  if (pid == 0) {
+    // The child holds the GIL from now on
+    PyOS_AfterFork_Child();
+    pthread_mutex_unlock(&python_lock);
+    return pid;
+  }
+  PyOS_AfterFork_Parent();
+  PyGILState_Release(gil);
+  pthread_mutex_unlock(&python_lock);
+  return pid;
+}
+
+// Directory the pam_python package is installed in (usually site-packages),
+// i.e. the parent of the directory this extension module was loaded from
+static wchar_t *package_parent_dir(void) {
+  Dl_info info;
+  char path[PATH_MAX];
+
+  if (!dladdr((void *)start_interpreter, &info) || !info.dli_fname || strlen(info.dli_fname) >= sizeof(path)) {
+    return NULL;
+  }
+  strcpy(path, info.dli_fname);
+  for (int i = 0; i < 2; i++) {
+    char *slash = strrchr(path, '/');
+    if (!slash) return NULL;
+    *slash = '\0';
+  }
+  return Py_DecodeLocale(path, NULL);
+}
+
+static PyStatus append_path(PyWideStringList *list, const char *path) {
+  wchar_t *wpath = Py_DecodeLocale(path, NULL);
+  if (!wpath) {
+    return PyStatus_NoMemory();
+  }
+  PyStatus status = PyWideStringList_Append(list, wpath);
+  PyMem_RawFree(wpath);
+  return status;
+}
+
+// Isolated from the environment (PYTHON* variables, the user site directory, the
+// current directory), without site and its .pth files and with sys.path fixed to
+// the stdlib of the Python we were built against and the pam_python package.
+// Modules the handler imports have to live next to pam_python.
+static PyStatus minimal_config(PyConfig *config, int install_signal_handlers) {
+  PyStatus status;
+  PyPreConfig preconfig;
+
+  PyPreConfig_InitIsolatedConfig(&preconfig);
+  status = Py_PreInitialize(&preconfig);
+  if (PyStatus_Exception(status)) return status;
+
+  PyConfig_InitIsolatedConfig(config);
+  config->site_import = 0;
+  config->install_signal_handlers = install_signal_handlers;
+#if PY_VERSION_HEX >= 0x030B0000
+  // -X frozen_modules=on, the stdlib modules needed for startup are not read from disk
+  config->use_frozen_modules = 1;
+#endif
+
+  config->module_search_paths_set = 1;
+  status = append_path(&config->module_search_paths, PYTHON_STDLIB_DIR);
+  if (PyStatus_Exception(status)) return status;
+  status = append_path(&config->module_search_paths, PYTHON_DYNLOAD_DIR);
+  if (PyStatus_Exception(status)) return status;
+
+  wchar_t *package_dir = package_parent_dir();
+  if (!package_dir) {
+    return PyStatus_Error("Failed to locate the pam_python package");
+  }
+  status = PyWideStringList_Append(&config->module_search_paths, package_dir);
+  PyMem_RawFree(package_dir);
+  return status;
+}
+
+int start_interpreter(int startup, int install_signal_handlers) {
+  PyImport_AppendInittab("pam_python.pam_python", PyInit_pam_python);
+
+  if (startup != PAM_PYTHON_STARTUP_MINIMAL) {
+    Py_InitializeEx(install_signal_handlers);
+    return SUCCESS;
+  }
+
+  PyConfig config;
+  PyStatus status = minimal_config(&config, install_signal_handlers);
+  if (!PyStatus_Exception(status)) {
+    status = Py_InitializeFromConfig(&config);
+  }
+  PyConfig_Clear(&config);
+
+  if (PyStatus_Exception(status)) {
+    fprintf(stderr, "Failed to initialize Python: %s\n", status.err_msg ? status.err_msg : "unknown error");
+    return READ_ERR;
+  }
+  return SUCCESS;
+}
+
+int worker_init_python(int startup) {
+  // The PAM host runs Python itself (it embeds it or uses mode=inprocess).
+  // Tearing its interpreter down is slow and not safe, keep using it.
+  if (!Py_IsInitialized() && start_interpreter(startup, 1) != SUCCESS) {
+    return READ_ERR;
+  }
+
+  PyObject *module = PyImport_ImportModule("pam_python.pam_python");
+  if (module == NULL) {
+    PyErr_Print();
+    return READ_ERR;
+  }
+
+  Py_DECREF(module);
+  return SUCCESS;
+}
+
+int worker_preload_module(const char *module_path) {
+  // A failed import returns -1 with the exception set
+  if (python_preload_module(module_path) != 0) {
+    PyErr_Print();
+    return READ_ERR;
+  }
+  return SUCCESS;
+}
+
+int worker_serve(struct ipc_pipe p, int max_requests) {
+  int status = python_serve(p, max_requests);
+  if (PyErr_Occurred()) {
+    PyErr_Print();
+    return READ_ERR;
+  }
+  return status;
+}
+
+void worker_run(struct ipc_pipe child, const char *module_path, int startup, int max_requests) {
+  // Pipes of other workers must not be kept open or they would never see EOF
+  worker_close_fds(child.read_end, child.write_end);
+
+  if (worker_init_python(startup) != SUCCESS) {
+    _exit(EXIT_FAILURE);
+  }
+  if (max_requests == 0) {
+    // Import errors are reported again (through pam_syslog) when a request comes in
+    worker_preload_module(module_path);
+  }
+
+  int status = worker_serve(child, max_requests);
+  _exit(status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void worker_exec_main(const char *module_path, int startup, int max_requests, int transport) {
+  struct ipc_pipe child = {.read_end = WORKER_READ_FD, .write_end = WORKER_WRITE_FD};
+
+  if (transport != PAM_PYTHON_TRANSPORT_PIPE) {
+    child = (struct ipc_pipe){.read_end = WORKER_SOCKET_FD, .write_end = WORKER_SOCKET_FD, .packet = true};
+  }
+  if (transport == PAM_PYTHON_TRANSPORT_SHM) {
+    child.shm = shm_attach(WORKER_SHM_FD);
+    close(WORKER_SHM_FD);
+    if (!child.shm) {
+      fprintf(stderr, "Descriptor %d is not a pam_python shared memory region\n", WORKER_SHM_FD);
+      _exit(EXIT_FAILURE);
+    }
+  }
+  worker_run(child, module_path, startup, max_requests);
+}
+
+// Room for the extensions appended to the base path of a zygote
+#define ZYGOTE_PATH_MAX (PATH_MAX + 8)
+
+static void redirect_stdio(void) {
+  int fd = open("/dev/null", O_RDWR);
+  if (fd < 0) return;
+
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  if (fd > STDERR_FILENO) close(fd);
+}
+
+static void notify_ready(int ready_fd) {
+  char c = 1;
+  while (write(ready_fd, &c, 1) < 0 && errno == EINTR) {
+  }
+  close(ready_fd);
+}
+
+void zygote_exec_main(const char *base_path, const char *module_path, int startup, int idle_timeout) {
+  char sock_path[ZYGOTE_PATH_MAX], lock_path[ZYGOTE_PATH_MAX];
+
+  snprintf(sock_path, sizeof(sock_path), "%s.sock", base_path);
+  snprintf(lock_path, sizeof(lock_path), "%s.lock", base_path);
+
+  signal(SIGPIPE, SIG_IGN);
+  umask(077);
+  worker_close_fds(WORKER_READY_FD, WORKER_READY_FD);
+  redirect_stdio();
+
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd < 0) {
+    _exit(EXIT_FAILURE);
+  }
+
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    // Another zygote for the same module won the race, use that one
+    notify_ready(WORKER_READY_FD);
+    _exit(EXIT_SUCCESS);
+  }
+
+  unlink(sock_path);
+  int listen_fd = listen_socket(sock_path);
+  if (listen_fd < 0) {
+    _exit(EXIT_FAILURE);
+  }
+
+  // On failure the host sees the pipe closing and falls back to forking,
+  // where the error is reported through pam_syslog
+  if (worker_init_python(startup) != SUCCESS || worker_preload_module(module_path) != SUCCESS) {
+    unlink(sock_path);
+    _exit(EXIT_FAILURE);
+  }
+
+  notify_ready(WORKER_READY_FD);
+  worker_serve_listener(listen_fd, sock_path, idle_timeout);
+  _exit(EXIT_SUCCESS);
+}
+
+static bool is_trusted_peer(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    return false;
+  }
+  // Only processes running as the same user (or root) may ask us to run the module
+  return cred.uid == 0 || cred.uid == geteuid();
+}
+
+static void fork_connection(int listen_fd, int conn) {
+  if (!is_trusted_peer(conn)) {
+    close(conn);
+    return;
+  }
+
+  PyOS_BeforeFork();
+  pid_t pid = fork();
+  if (pid == 0) {
+    PyOS_AfterFork_Child();
+    signal(SIGCHLD, SIG_DFL);
+    close(listen_fd);
+
+    // With reuse=transaction the host sends several requests over the connection
+    struct ipc_pipe p = {.read_end = conn, .write_end = conn};
+    int status = worker_serve(p, 0);
+    _exit(status == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  PyOS_AfterFork_Parent();
+  close(conn);
+}
+
+void worker_serve_listener(int listen_fd, const char *path, int idle_timeout) {
+  struct pollfd pfd = {listen_fd, POLLIN, 0};
+
+  // Children are never waited for, let the kernel reap them
+  signal(SIGCHLD, SIG_IGN);
+
+  while (true) {
+    int ready = poll(&pfd, 1, idle_timeout > 0 ? idle_timeout * 1000 : -1);
+    if (ready == 0) {
+      break;
+    } else if (ready < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    fork_connection(listen_fd, conn);
+  }
+
+  // Nobody can connect once the socket is gone, serve whoever got in before that
+  unlink(path);
+  fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+  int conn;
+  while ((conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    fork_connection(listen_fd, conn);
+  }
+  close(listen_fd);
+}
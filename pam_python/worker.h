@@ -0,0 +1,81 @@
+#ifndef _PAM_PYTHON_WORKER_H
+#define _PAM_PYTHON_WORKER_H
+
+#include <Python.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <security/pam_modules.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "pipe.h"
+
+// Code running on the Python side of the pipe, i.e. in the forked child, in
+// pam-python-worker or in a zygote
+
+// Executable installed next to the PAM module, see worker_main.c
+#define WORKER_EXECUTABLE "pam-python-worker"
+
+// Descriptors pam-python-worker gets its pipe (transport=pipe) or its socket and,
+// with transport=shm, the memfd of the shared region on
+#define WORKER_READ_FD   3
+#define WORKER_WRITE_FD  4
+#define WORKER_SOCKET_FD 3
+#define WORKER_SHM_FD    5
+
+// Descriptor pam-python-worker --zygote reports on once it accepts connections
+#define WORKER_READY_FD 3
+
+// Close every descriptor inherited from the PAM host except for stdio and the two given ones
+void worker_close_fds(int keep_a, int keep_b);
+
+// Held by the thread of the PAM host which initializes the interpreter (mode=inprocess)
+// or forks it, a multithreaded host must not do both at once
+extern pthread_mutex_t python_lock;
+
+// fork() which keeps the interpreter of the PAM host (if any) usable in the child
+pid_t worker_fork(void);
+
+// Initialize the interpreter of this process with the given startup profile
+// (PAM_PYTHON_STARTUP_*), pam_python.pam_python is registered as a builtin module
+int start_interpreter(int startup, int install_signal_handlers);
+
+// Initialize the interpreter unless the process already has one and import pam_python
+int worker_init_python(int startup);
+
+int worker_preload_module(const char *module_path);
+
+// Serve requests sent by the PAM host until it closes the pipe
+// or until max_requests requests have been handled (0 means no limit)
+int worker_serve(struct ipc_pipe p, int max_requests);
+
+// Set up Python and serve the PAM host over child, never returns
+void worker_run(struct ipc_pipe child, const char *module_path, int startup, int max_requests);
+
+// Entry point of pam-python-worker, which gets the descriptors of the
+// PAM_PYTHON_TRANSPORT_* transport as described above
+void worker_exec_main(const char *module_path, int startup, int max_requests, int transport);
+
+// Entry point of pam-python-worker --zygote: listen on <base_path>.sock, import
+// the module and write a byte to WORKER_READY_FD, then serve connections (see
+// zygote.h). Reports ready right away when another zygote holds <base_path>.lock.
+void zygote_exec_main(const char *base_path, const char *module_path, int startup, int idle_timeout);
+
+// Accept connections on listen_fd and fork a child from the current
+// (already initialized) interpreter for each of them. Returns after
+// idle_timeout seconds without a connection once path has been removed.
+void worker_serve_listener(int listen_fd, const char *path, int idle_timeout);
+
+#endif
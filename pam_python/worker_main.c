@@ -0,0 +1,62 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// pam-python-worker, started by the PAM module instead of forking the PAM host:
+//
+//   pam-python-worker <libpython> <extension module> <startup> <max requests> <transport> <python module>
+//   pam-python-worker --zygote <libpython> <extension module> <startup> <idle timeout> <python module> <base path>
+//
+// The Python side lives in the extension module, we only load it.
+// The socket to the PAM host is on descriptor 3 (with transport=pipe, the
+// pipe is on descriptors 3 and 4), the shared memory region of transport=shm
+// on descriptor 5. A zygote reports that it is ready on descriptor 3.
+
+// Load libpython and the extension module, returns the named entry point of the latter
+static void *load_entry(const char *libpython, const char *extension, const char *name) {
+  // Global so that extension modules resolve the C API symbols
+  if (!dlopen(libpython, RTLD_NOW | RTLD_GLOBAL)) {
+    fprintf(stderr, "%s\n", dlerror());
+    return NULL;
+  }
+
+  void *module = dlopen(extension, RTLD_NOW);
+  if (!module) {
+    fprintf(stderr, "%s\n", dlerror());
+    return NULL;
+  }
+
+  void *entry = dlsym(module, name);
+  if (!entry) {
+    fprintf(stderr, "%s\n", dlerror());
+  }
+  return entry;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 8 && strcmp(argv[1], "--zygote") == 0) {
+    void (*zygote_exec_main)(const char *, const char *, int, int) =
+        (void (*)(const char *, const char *, int, int))load_entry(argv[2], argv[3], "zygote_exec_main");
+    if (zygote_exec_main) {
+      zygote_exec_main(argv[7], argv[6], atoi(argv[4]), atoi(argv[5]));
+    }
+    return EXIT_FAILURE;
+  }
+
+  if (argc != 7) {
+    fprintf(stderr, "usage: %s <libpython> <extension module> <startup> <max requests> <transport> <python module>\n",
+            argv[0]);
+    fprintf(stderr,
+            "       %s --zygote <libpython> <extension module> <startup> <idle timeout> <python module> <base path>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  void (*worker_exec_main)(const char *, int, int, int) =
+      (void (*)(const char *, int, int, int))load_entry(argv[1], argv[2], "worker_exec_main");
+  if (worker_exec_main) {
+    worker_exec_main(argv[6], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  return EXIT_FAILURE;
+}
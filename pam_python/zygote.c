@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include "zygote.h"
+
+#include <patchlevel.h>
+
+#include "module.h"
+#include "worker.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// Room for the extensions appended to the path of a zygote
+#define ZYGOTE_PATH_MAX (PATH_MAX + 8)
+
+// Build the path (without extension) identifying the zygote for this module
+static int zygote_base_path(pam_handle_t *pamh, const char *module_path, int startup, char *path, size_t size) {
+  char real_path[PATH_MAX];
+  struct stat st;
+
+  if (!realpath(module_path, real_path) || stat(real_path, &st) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to resolve %s: %m", module_path);
+    return -1;
+  }
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  hash = fnv1a(hash, real_path, strlen(real_path) + 1);
+  hash = fnv1a(hash, PY_VERSION, strlen(PY_VERSION) + 1);
+  hash = fnv1a(hash, &startup, sizeof(startup));
+  // A modified module gets a new zygote, the old one exits once it becomes idle
+  hash = fnv1a(hash, &st.st_dev, sizeof(st.st_dev));
+  hash = fnv1a(hash, &st.st_ino, sizeof(st.st_ino));
+  hash = fnv1a(hash, &st.st_size, sizeof(st.st_size));
+  hash = fnv1a(hash, &st.st_mtim, sizeof(st.st_mtim));
+
+  snprintf(path, size, "%s/zygote-%u-%016llx", PAM_PYTHON_RUNTIME_DIR, (unsigned)geteuid(),
+           (unsigned long long)hash);
+  return 0;
+}
+
+// The zygote outlives the PAM host which started it and serves every later
+// session, it must not see the environment of whoever happened to be first
+static char *zygote_environ[] = {"PATH=/usr/sbin:/usr/bin:/sbin:/bin", NULL};
+
+// Start the zygote from pam-python-worker rather than forking the PAM host, so
+// that it keeps nothing of the host (its memory, the pam handle, its environment)
+// for the sessions it serves later on
+static int zygote_spawn(pam_handle_t *pamh, const struct pam_python_options *opts, const char *base_path) {
+  char extension[PATH_MAX];
+  char executable[PATH_MAX];
+  char startup_str[16];
+  char idle_str[16];
+  int ready[2];
+
+  if (module_sibling(PAM_PYTHON_EXTENSION, extension, sizeof(extension)) != 0 ||
+      module_sibling(WORKER_EXECUTABLE, executable, sizeof(executable)) != 0) {
+    return -1;
+  }
+  if (access(executable, X_OK) != 0) {
+    pam_syslog(pamh, LOG_WARNING, "%s not available, can't start a zygote", executable);
+    return -1;
+  }
+  snprintf(startup_str, sizeof(startup_str), "%d", opts->startup);
+  snprintf(idle_str, sizeof(idle_str), "%d", opts->zygote_idle);
+
+  if (pipe2(ready, O_CLOEXEC) != 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to create pipe: %m");
+    return -1;
+  }
+  // The descriptor must not already be the one the zygote expects it on
+  int ready_fd = ready[1] > WORKER_READY_FD ? ready[1] : fcntl(ready[1], F_DUPFD_CLOEXEC, WORKER_READY_FD + 1);
+  if (ready_fd < 0) {
+    pam_syslog(pamh, LOG_ERR, "Failed to duplicate descriptor: %m");
+    close(ready[0]);
+    close(ready[1]);
+    return -1;
+  }
+
+  // Everything is set up before forking, the child of a possibly multithreaded
+  // host only calls setsid() and posix_spawn()
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, ready_fd, WORKER_READY_FD);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigfillset(&signals);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+
+  char *argv[] = {executable, "--zygote",          LIBPYTHON_SO, extension, startup_str, idle_str,
+                  (char *)opts->argv[0], (char *)base_path, NULL};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Double fork so that the zygote is not a child of the PAM host
+    pid_t zygote;
+    _exit(setsid() >= 0 && posix_spawn(&zygote, executable, &actions, &attr, argv, zygote_environ) == 0
+              ? EXIT_SUCCESS
+              : EXIT_FAILURE);
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (ready_fd != ready[1]) close(ready_fd);
+  close(ready[1]);
+  if (pid == -1) {
+    pam_syslog(pamh, LOG_ERR, "Failed to fork: %m");
+    close(ready[0]);
+    return -1;
+  }
+  waitpid(pid, NULL, 0);
+
+  // Closed without a byte when the zygote failed to start
+  char c;
+  ssize_t r;
+  do {
+    r = read(ready[0], &c, 1);
+  } while (r < 0 && errno == EINTR);
+  close(ready[0]);
+
+  return r == 1 ? 0 : -1;
+}
+
+int zygote_connect(pam_handle_t *pamh, const struct pam_python_options *opts) {
+  char base_path[PATH_MAX], sock_path[ZYGOTE_PATH_MAX];
+
+  if (!runtime_dir_ok(pamh) || zygote_base_path(pamh, opts->argv[0], opts->startup, base_path, sizeof(base_path)) != 0) {
+    return -1;
+  }
+  snprintf(sock_path, sizeof(sock_path), "%s.sock", base_path);
+
+  int fd = connect_socket(sock_path);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  if (zygote_spawn(pamh, opts, base_path) != 0) {
+    return -1;
+  }
+  return connect_socket(sock_path);
+}
@@ -0,0 +1,40 @@
+#ifndef _PAM_PYTHON_ZYGOTE_H
+#define _PAM_PYTHON_ZYGOTE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "pipe.h"
+#include "sock.h"
+
+// A zygote is a long-lived process with the interpreter initialized and the
+// user module imported. Each request forks a child off of it, so the cost of
+// Py_Initialize() and of executing the module is only paid once.
+//
+// The zygote is a fresh pam-python-worker (see worker_main.c) with a minimal
+// environment, never a fork of the PAM host which happened to start it. Without
+// the executable there is no zygote and requests fall back to mode=fork.
+//
+// Zygotes are keyed by the module file (path and identity), the Python
+// version and the startup profile so different stack entries never share state.
+//
+// Returns a socket connected to a fresh child of the zygote (spawning the zygote
+// if needed) or -1 if the zygote is not available.
+int zygote_connect(pam_handle_t *pamh, const struct pam_python_options *opts);
+
+#endif
@@ -1,25 +1,60 @@
-import distutils
+import sysconfig
+from pathlib import Path
 
 from Cython.Build import cythonize
 from setuptools import Extension, setup
+from setuptools.command.build_ext import build_ext
 
 
-# AAARGHHH
-# WHY ISNT LIBPYTHON INCLUDED BY DEFAULT???
-libpython_so = distutils.sysconfig.get_config_var('INSTSONAME')
-python_ldversion = distutils.sysconfig.get_config_var('LDVERSION')
+# libpython is not linked, the PAM module dlopen()s it on first use
+libpython_so = sysconfig.get_config_var('INSTSONAME')
+extension_so = "pam_python" + sysconfig.get_config_var('EXT_SUFFIX')
+
+# The PAM module (pam_python.so) is loaded by every process using the PAM stack,
+# it only talks to Python processes and loads the extension module when needed
+pam_module_sources = ["pam_python/admission.c", "pam_python/daemon.c", "pam_python/entrypoint.c", "pam_python/manifest.c",
+                      "pam_python/module.c",
+                      "pam_python/options.c", "pam_python/pam.c", "pam_python/pipe.c", "pam_python/pool.c",
+                      "pam_python/runtime.c", "pam_python/shm.c", "pam_python/sock.c", "pam_python/spawn.c",
+                      "pam_python/transaction.c", "pam_python/watch.c", "pam_python/zygote.c"]
+pam_module_macros = [('LIBPYTHON_SO', '"' + libpython_so + '"'), ('PAM_PYTHON_EXTENSION', '"' + extension_so + '"')]
+
+# Module search path of startup=minimal, which does not look for the stdlib at runtime
+stdlib_macros = [('PYTHON_STDLIB_DIR', '"' + sysconfig.get_path('stdlib') + '"'),
+                 ('PYTHON_DYNLOAD_DIR', '"' + sysconfig.get_config_var('DESTSHARED') + '"')]
 
 # https://stackoverflow.com/a/75753567/3911147
 extensions = [
     Extension("pam_python.pam_python",  # controls in which directory the .so file will be generated
-              ["pam_python/entrypoint.c", "pam_python/pipe.c", "pam_python/pam_python.pyx"],  # Required files
-              define_macros=[('LIBPYTHON_SO','"'+libpython_so+'"')],
-              # define_macros=[('LIBPYTHON_SO','"'+libpython_so+'"'), ('CYTHON_PEP489_MULTI_PHASE_INIT', '0')],
-              libraries=["pam", "python"+python_ldversion],  # libpam
+              ["pam_python/inprocess.c", "pam_python/pam.c", "pam_python/pipe.c", "pam_python/shm.c",
+               "pam_python/sock.c", "pam_python/worker.c", "pam_python/pam_python.pyx"],  # Required files
+              # Module state and heap types are required to load the module into subinterpreters
+              # with their own GIL (mode=inprocess)
+              define_macros=[('CYTHON_USE_MODULE_STATE', '1'), ('CYTHON_USE_TYPE_SPECS', '1')] + stdlib_macros,
+              libraries=["pam"],  # libpam
               compiler_directives={"language_level": "3"})  # Compile as Python3
 ]
 
+
+class build_ext_with_pam_module(build_ext):
+    """Also build the PAM module and the pam-python-worker executable next to the extension"""
+
+    def run(self):
+        super().run()
+        module_dir = Path(self.get_ext_fullpath("pam_python.pam_python")).parent
+
+        objects = self.compiler.compile(pam_module_sources, output_dir=self.build_temp,
+                                        macros=pam_module_macros, include_dirs=self.include_dirs)
+        self.compiler.link_shared_object(objects, "pam_python.so", output_dir=str(module_dir),
+                                         libraries=["pam", "dl", "pthread"],
+                                         extra_postargs=["-Wl,--no-undefined"])
+
+        objects = self.compiler.compile(["pam_python/worker_main.c"], output_dir=self.build_temp)
+        self.compiler.link_executable(objects, "pam-python-worker", output_dir=str(module_dir), libraries=["dl"])
+
+
 setup(
     name="pam_python",
     ext_modules=cythonize(extensions),
+    cmdclass={"build_ext": build_ext_with_pam_module},
 )
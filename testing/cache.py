@@ -0,0 +1,141 @@
+"""Check the bytecode cache (pam_python/cache.py) in a scratch directory
+
+Entries are only written and trusted by root, run as root with the
+extension installed:
+
+    python cache.py
+"""
+
+import marshal
+import os
+import shutil
+import sys
+import tempfile
+
+from pam_python import cache
+
+failures = 0
+
+
+def check(what, actual, expected):
+    global failures
+    if actual != expected:
+        failures += 1
+        print(f"FAIL {what}: {actual!r} != {expected!r}")
+    else:
+        print(f"ok   {what}")
+
+
+class Compiles:
+    """Counts the modules cache.py compiles"""
+
+    def __init__(self):
+        self.count = 0
+        self.compile = cache._compile
+        cache._compile = self
+
+    def __call__(self, file_path):
+        self.count += 1
+        return self.compile(file_path)
+
+    def take(self):
+        count, self.count = self.count, 0
+        return count
+
+
+def header(entry):
+    with open(entry, "rb") as f:
+        return cache._HEADER.unpack(f.read(cache._HEADER.size))
+
+
+def run(code):
+    namespace = {}
+    exec(code, namespace)
+    return namespace["value"]
+
+
+def main():
+    if os.geteuid() != 0:
+        print("Only root writes and trusts cache entries, run as root")
+        return 1
+
+    scratch = tempfile.mkdtemp()
+    cache.CACHE_DIR = os.path.join(scratch, "cache")
+    module = os.path.join(scratch, "module.py")
+    with open(module, "w") as f:
+        f.write("value = 1\n")
+    compiles = Compiles()
+    entry = cache._entry_path(module)
+
+    # The directory must exist, belong to root and be writable by nobody else
+    check("missing directory", cache.load_code(module), None)
+    os.mkdir(cache.CACHE_DIR, 0o777)
+    os.chmod(cache.CACHE_DIR, 0o777)
+    check("directory writable by others", cache.load_code(module), None)
+    os.chmod(cache.CACHE_DIR, 0o700)
+    os.chown(cache.CACHE_DIR, 65534, -1)
+    check("directory of another user", cache.load_code(module), None)
+    check("no entry written to an untrusted directory", os.listdir(cache.CACHE_DIR), [])
+    os.chown(cache.CACHE_DIR, 0, -1)
+
+    check("first load", run(cache.load_code(module)), 1)
+    check("first load compiles", compiles.take(), 1)
+    check("second load", run(cache.load_code(module)), 1)
+    check("second load uses the entry", compiles.take(), 0)
+
+    # An entry others could have written is not used
+    os.chmod(entry, 0o666)
+    cache.load_code(module)
+    check("entry writable by others is replaced", compiles.take(), 1)
+    check("replaced entry is private", os.stat(entry).st_mode & 0o777, 0o600)
+
+    # A touched module keeps its entry, the header gets the new mtime
+    st = os.stat(module)
+    os.utime(module, ns=(st.st_atime_ns, st.st_mtime_ns + 10**9))
+    check("touched module", run(cache.load_code(module)), 1)
+    check("touched module is not compiled", compiles.take(), 0)
+    check("header has the new mtime", header(entry)[1], os.stat(module).st_mtime_ns)
+    cache.load_code(module)
+    check("rewritten header matches", compiles.take(), 0)
+
+    # Same size and a new mtime, but another content
+    with open(module, "w") as f:
+        f.write("value = 2\n")
+    check("changed module", run(cache.load_code(module)), 2)
+    check("changed module is compiled", compiles.take(), 1)
+
+    # Bytecode of another Python version
+    with open(entry, "r+b") as f:
+        f.write(b"\0\0\0\0")
+    check("magic mismatch", run(cache.load_code(module)), 2)
+    check("magic mismatch is compiled", compiles.take(), 1)
+    check("entry gets the right magic", header(entry)[0], cache.importlib.util.MAGIC_NUMBER)
+
+    # A truncated entry
+    with open(entry, "r+b") as f:
+        f.truncate(cache._HEADER.size + 2)
+    check("truncated entry", run(cache.load_code(module)), 2)
+    check("truncated entry is compiled", compiles.take(), 1)
+    with open(entry, "rb") as f:
+        check("entry is whole again", run(marshal.loads(f.read()[cache._HEADER.size:])), 2)
+
+    # The manifest is only rewritten when it changes
+    identity = (1, 2, 3, 4)
+    manifest = cache._cache_name(module) + ".handlers"
+    cache.store_manifest(module, identity, ["pam_sm_authenticate"])
+    with open(manifest) as f:
+        check("manifest", f.read(), "1 2 3 4\npam_sm_authenticate\n")
+    inode = os.stat(manifest).st_ino
+    cache.store_manifest(module, identity, ["pam_sm_authenticate"])
+    check("unchanged manifest is kept", os.stat(manifest).st_ino, inode)
+    cache.store_manifest(module, identity, ["pam_sm_authenticate", "pam_sm_setcred"])
+    with open(manifest) as f:
+        check("changed manifest", f.read(), "1 2 3 4\npam_sm_authenticate pam_sm_setcred\n")
+
+    shutil.rmtree(scratch)
+    print(f"{failures} failures")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,299 @@
+// PAM host side of codec.py. Starts with a REQUEST, then decodes every call
+// codec.py sends with the generated C decoders, prints what it decoded (or the
+// error) on stdout and answers with the generated C encoders. A few arguments
+// ask for a malformed reply instead, see malformed_reply().
+//
+// Usage: ./codec <socket descriptor>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pam_python/pam.h"
+
+#define REQUEST_ID 42
+
+static struct ipc_pipe host;
+
+static void print_bytes(const char *data, int length) {
+    for (int i = 0; i < length; i++) {
+        printf("%02x", (unsigned char)data[i]);
+    }
+}
+
+static void print_value(int type, const struct ipc_xauth *xauth, const char *string) {
+    if (type == PAM_XAUTHDATA) {
+        printf(" xauth '%s' ", xauth->name);
+        print_bytes(xauth->data.data, xauth->data.length);
+    } else {
+        printf(" '%s'", string);
+    }
+}
+
+static void reply(int opcode, struct ipc_message *m) {
+    if (ipc_write_frame(host, opcode, REQUEST_ID, m) != SUCCESS) {
+        fprintf(stderr, "codec: failed to write a frame\n");
+        exit(EXIT_FAILURE);
+    }
+    ipc_message_free(m);
+}
+
+// GET_ITEM -1, FAIL_DELAY -1 and STRERROR -1 are answered with payloads the
+// Python side must refuse: an item cut short, a List claiming more elements
+// than the frame holds and a string longer than the frame
+static bool malformed_reply(int opcode, int arg) {
+    struct ipc_message m;
+
+    if (arg != -1) {
+        return false;
+    }
+    ipc_message_init(&m);
+    if (opcode == PAM_PYTHON_GET_ITEM) {
+        ipc_put_int(&m, PAM_SUCCESS);
+        ipc_put_int(&m, PAM_USER);
+        ipc_put_int(&m, 1);
+    } else if (opcode == PAM_PYTHON_FAIL_DELAY) {
+        ipc_put_int(&m, PAM_SUCCESS);
+        ipc_put_int(&m, 1 << 20);
+        ipc_put_int(&m, PAM_SUCCESS);
+    } else {
+        ipc_put_int(&m, 1000);
+        ipc_put_data(&m, "short", 5);
+    }
+    reply(opcode, &m);
+    return true;
+}
+
+static void send_request(void) {
+    struct ipc_message m;
+    const char *args[] = {"mod.py", "a=b"};
+    struct ipc_item items[] = {
+        {.item_type = PAM_USER, .has_value = true, .value.string = "alice"},
+        {.item_type = PAM_TTY, .has_value = false},
+        {.item_type = PAM_XAUTHDATA, .has_value = true, .value.xauth = {"MIT-MAGIC", {"\0\1\2", 3}}},
+    };
+    struct ipc_request_to_python r = {"pam_sm_authenticate", 3, LOG_INFO, 2, args, 3, items};
+
+    ipc_message_init(&m);
+    ipc_encode_request(&m, &r);
+    if (m.length != ipc_request_size(&r)) {
+        printf("REQUEST size %zu, encoded %zu\n", ipc_request_size(&r), m.length);
+    }
+    reply(PAM_PYTHON_REQUEST, &m);
+}
+
+static void get_item(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_get_item_to_host call;
+    struct ipc_message m;
+    int status = ipc_decode_get_item(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("GET_ITEM error %d\n", status);
+        return;
+    }
+    printf("GET_ITEM %d\n", call.item_type);
+    if (malformed_reply(frame->opcode, call.item_type)) {
+        return;
+    }
+
+    // The TTY is never set, the other items are made up from their type
+    char value[32];
+    snprintf(value, sizeof(value), "item-%d", call.item_type);
+    struct ipc_get_item_to_python r = {
+        .retval = PAM_SUCCESS, .item = {.item_type = call.item_type, .has_value = call.item_type != PAM_TTY}};
+    if (call.item_type == PAM_XAUTHDATA) {
+        r.item.value.xauth = (struct ipc_xauth){"MIT-MAGIC", {"\0\377", 2}};
+    } else {
+        r.item.value.string = value;
+    }
+    ipc_message_init(&m);
+    ipc_encode_get_item(&m, &r);
+    reply(frame->opcode, &m);
+}
+
+static void set_item(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_set_item_to_host call;
+    int status = ipc_decode_set_item(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("SET_ITEM error %d\n", status);
+        return;
+    }
+    printf("SET_ITEM %d", call.items_count);
+    for (int i = 0; i < call.items_count; i++) {
+        printf(" [%d", call.items[i].item_type);
+        print_value(call.items[i].item_type, &call.items[i].value.xauth, call.items[i].value.string);
+        printf("]");
+    }
+    printf("\n");
+}
+
+static void get_user(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_get_user_to_host call;
+    struct ipc_message m;
+    int status = ipc_decode_get_user(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("GET_USER error %d\n", status);
+        return;
+    }
+    if (call.has_prompt) {
+        printf("GET_USER '%s'\n", call.prompt);
+    } else {
+        printf("GET_USER -\n");
+    }
+
+    // A user is only returned to a call which had a prompt
+    struct ipc_get_user_to_python r = {PAM_SUCCESS, call.has_prompt, "bob"};
+    ipc_message_init(&m);
+    ipc_encode_get_user(&m, &r);
+    reply(frame->opcode, &m);
+}
+
+static void converse(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_converse_to_host call;
+    struct ipc_message m;
+    int status = ipc_decode_converse(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("CONVERSE error %d\n", status);
+        return;
+    }
+
+    // Every prompt is answered with itself, except for PAM_TEXT_INFO which gets no response
+    struct ipc_response responses[16];
+    printf("CONVERSE %d", call.msgs_count);
+    for (int i = 0; i < call.msgs_count && i < 16; i++) {
+        struct ipc_prompt *msg = &call.msgs[i];
+        responses[i] = (struct ipc_response){.resp_retcode = i, .has_resp = msg->msg_style != PAM_TEXT_INFO};
+        if (msg->msg_style == PAM_BINARY_PROMPT) {
+            printf(" [%d ", msg->msg_style);
+            print_bytes(msg->msg.bytes.data, msg->msg.bytes.length);
+            printf("]");
+            responses[i].resp = msg->msg.bytes;
+        } else {
+            printf(" [%d '%s']", msg->msg_style, msg->msg.string);
+            responses[i].resp = (struct ipc_bytes){msg->msg.string, (int)strlen(msg->msg.string)};
+        }
+    }
+    printf("\n");
+
+    struct ipc_converse_to_python r = {PAM_SUCCESS, call.msgs_count < 16 ? call.msgs_count : 16, responses};
+    ipc_message_init(&m);
+    ipc_encode_converse(&m, &r);
+    reply(frame->opcode, &m);
+}
+
+static void fail_delay(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_fail_delay_to_host call;
+    struct ipc_message m;
+    int status = ipc_decode_fail_delay(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("FAIL_DELAY error %d\n", status);
+        return;
+    }
+    printf("FAIL_DELAY %d\n", call.usec);
+    if (malformed_reply(frame->opcode, call.usec)) {
+        return;
+    }
+
+    struct ipc_fail_delay_to_python r = {call.usec};
+    ipc_message_init(&m);
+    ipc_encode_fail_delay(&m, &r);
+    reply(frame->opcode, &m);
+}
+
+static void strerror_call(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_strerror_to_host call;
+    struct ipc_message m;
+    int status = ipc_decode_strerror(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("STRERROR error %d\n", status);
+        return;
+    }
+    printf("STRERROR %d\n", call.err_num);
+    if (malformed_reply(frame->opcode, call.err_num)) {
+        return;
+    }
+
+    char description[32];
+    snprintf(description, sizeof(description), "error %d", call.err_num);
+    struct ipc_strerror_to_python r = {description};
+    ipc_message_init(&m);
+    ipc_encode_strerror(&m, &r);
+    reply(frame->opcode, &m);
+}
+
+static void syslog_call(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_syslog_to_host call;
+    int status = ipc_decode_syslog(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("SYSLOG error %d\n", status);
+        return;
+    }
+    printf("SYSLOG %d", call.records_count);
+    for (int i = 0; i < call.records_count; i++) {
+        printf(" [%d ", call.records[i].priority);
+        print_bytes(call.records[i].msg.data, call.records[i].msg.length);
+        printf("]");
+    }
+    printf("\n");
+}
+
+static void return_call(struct ipc_frame *frame, struct ipc_arena *arena) {
+    struct ipc_return_to_host call;
+    int status = ipc_decode_return(frame, arena, &call);
+    if (status != SUCCESS) {
+        printf("RETURN error %d\n", status);
+        return;
+    }
+    printf("RETURN %d\n", call.retval);
+}
+
+int main(int argc, char **argv) {
+    struct ipc_reader reader;
+    struct ipc_arena arena;
+    struct ipc_frame frame;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <socket descriptor>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    host = (struct ipc_pipe){.read_end = atoi(argv[1]), .write_end = atoi(argv[1])};
+    ipc_reader_init(&reader, host, false);
+    ipc_arena_init(&arena, false);
+
+    send_request();
+    while (ipc_read_frame(&reader, &frame) == SUCCESS) {
+        switch (frame.opcode) {
+        case PAM_PYTHON_GET_ITEM:
+            get_item(&frame, &arena);
+            break;
+        case PAM_PYTHON_SET_ITEM:
+            set_item(&frame, &arena);
+            break;
+        case PAM_PYTHON_GET_USER:
+            get_user(&frame, &arena);
+            break;
+        case PAM_PYTHON_CONVERSE:
+            converse(&frame, &arena);
+            break;
+        case PAM_PYTHON_FAIL_DELAY:
+            fail_delay(&frame, &arena);
+            break;
+        case PAM_PYTHON_STRERROR:
+            strerror_call(&frame, &arena);
+            break;
+        case PAM_PYTHON_SYSLOG:
+            syslog_call(&frame, &arena);
+            break;
+        case PAM_PYTHON_RETURN:
+            return_call(&frame, &arena);
+            break;
+        default:
+            printf("unknown opcode %d\n", frame.opcode);
+        }
+        ipc_arena_reset(&arena);
+    }
+
+    ipc_arena_free(&arena);
+    ipc_reader_free(&reader);
+    return EXIT_SUCCESS;
+}
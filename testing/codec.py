@@ -0,0 +1,160 @@
+"""Check the generated codecs of the Python side against those of the C side
+
+Calls are encoded by the Python encoders and decoded by ./codec (see codec.c),
+which prints what it got. Its replies, encoded in C, are decoded here. Both
+sides must also refuse truncated frames and Lists claiming more elements than
+the frame holds.
+
+Build ./codec (see Makefile) and install the extension, then run
+
+    python codec.py
+"""
+
+import os
+import socket
+import subprocess
+import sys
+
+from pam_python import pam_python
+from pam_python.pam_python import Message, PamHandle, Payload, XAuthData
+
+# Opcodes as listed in make.py
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from make import OPCODES  # noqa: E402
+
+OPCODE = {name: opcode for name, opcode, *_ in OPCODES}
+READ_ERR = 2
+
+failures = 0
+
+
+def check(what, actual, expected):
+    global failures
+    if actual != expected:
+        failures += 1
+        print(f"FAIL {what}: {actual!r} != {expected!r}")
+    else:
+        print(f"ok   {what}")
+
+
+class Peer:
+    def __init__(self):
+        ours, theirs = socket.socketpair()
+        self.sock = ours
+        self.process = subprocess.Popen([os.path.join(os.path.dirname(os.path.abspath(__file__)), "codec"),
+                                         str(theirs.fileno())],
+                                        pass_fds=[theirs.fileno()], stdout=subprocess.PIPE, text=True)
+        theirs.close()
+        self.transport = pam_python.stream_transport(ours.fileno())
+        self.request_id = None
+
+    def send(self, name, payload):
+        """Send a call, returns the line ./codec printed for it"""
+        self.transport.queue(OPCODE[name], self.request_id, payload)
+        self.transport.flush()
+        return self.process.stdout.readline().rstrip("\n")
+
+    def reply(self, name, decode):
+        opcode, request_id, reader = self.transport.read_frame()
+        if opcode != OPCODE[name] or request_id != self.request_id:
+            raise IOError(f"Unexpected reply {opcode} {request_id}")
+        return decode(reader)
+
+    def refused(self, name, decode):
+        """Whether the Python decoder refuses the reply"""
+        try:
+            self.reply(name, decode)
+        except EOFError:
+            return True
+        return False
+
+    def close(self):
+        self.sock.close()
+        return self.process.wait()
+
+
+def raw(*ints, data=None):
+    payload = Payload()
+    for n in ints:
+        payload.put_int(n)
+    if data is not None:
+        payload.put_bytes(data)
+    return payload
+
+
+def main():
+    peer = Peer()
+    P = PamHandle
+
+    # REQUEST: Lists of strings and of items, an unset item and a Variant
+    opcode, peer.request_id, reader = peer.transport.read_frame()
+    check("REQUEST", (opcode, pam_python.decode_request(reader)),
+          (OPCODE["REQUEST"], ("pam_sm_authenticate", 3, 6, ["mod.py", "a=b"],
+                               [(P.PAM_USER, "alice"), (P.PAM_TTY, None),
+                                (P.PAM_XAUTHDATA, XAuthData("MIT-MAGIC", b"\0\1\2"))])))
+
+    # GET_ITEM: Optional of a Variant
+    for item_type, value in [(P.PAM_USER, f"item-{P.PAM_USER}"), (P.PAM_TTY, None),
+                             (P.PAM_XAUTHDATA, XAuthData("MIT-MAGIC", b"\0\xff"))]:
+        check(f"GET_ITEM {item_type} call", peer.send("GET_ITEM", pam_python.encode_get_item(item_type)),
+              f"GET_ITEM {item_type}")
+        check(f"GET_ITEM {item_type} reply", peer.reply("GET_ITEM", pam_python.decode_get_item),
+              (P.PAM_SUCCESS, (item_type, value)))
+
+    # SET_ITEM: List of a Variant, empty or not
+    check("SET_ITEM", peer.send("SET_ITEM", pam_python.encode_set_item(
+        [(P.PAM_RUSER, "carol"), (P.PAM_XAUTHDATA, XAuthData("N", b"\0\1"))])),
+          f"SET_ITEM 2 [{P.PAM_RUSER} 'carol'] [{P.PAM_XAUTHDATA} xauth 'N' 0001]")
+    check("SET_ITEM empty", peer.send("SET_ITEM", pam_python.encode_set_item([])), "SET_ITEM 0")
+
+    # GET_USER: Optional both ways
+    check("GET_USER call", peer.send("GET_USER", pam_python.encode_get_user("Who? ")), "GET_USER 'Who? '")
+    check("GET_USER reply", peer.reply("GET_USER", pam_python.decode_get_user), (P.PAM_SUCCESS, "bob"))
+    check("GET_USER call without prompt", peer.send("GET_USER", pam_python.encode_get_user(None)), "GET_USER -")
+    check("GET_USER reply without user", peer.reply("GET_USER", pam_python.decode_get_user), (P.PAM_SUCCESS, None))
+
+    # CONVERSE: List of a Variant, replied with a List of Optional
+    binary = b"\0\0\0\x07\x01hi"
+    msgs = [Message(P.PAM_PROMPT_ECHO_OFF, "Password: "), Message(P.PAM_BINARY_PROMPT, binary),
+            Message(P.PAM_TEXT_INFO, "Hello")]
+    check("CONVERSE call", peer.send("CONVERSE", pam_python.encode_converse(msgs)),
+          f"CONVERSE 3 [{P.PAM_PROMPT_ECHO_OFF} 'Password: '] [{P.PAM_BINARY_PROMPT} {binary.hex()}]"
+          f" [{P.PAM_TEXT_INFO} 'Hello']")
+    check("CONVERSE reply", peer.reply("CONVERSE", pam_python.decode_converse),
+          (P.PAM_SUCCESS, [(0, b"Password: "), (1, binary), (2, None)]))
+
+    check("FAIL_DELAY call", peer.send("FAIL_DELAY", pam_python.encode_fail_delay(123)), "FAIL_DELAY 123")
+    check("FAIL_DELAY reply", peer.reply("FAIL_DELAY", pam_python.decode_fail_delay), 123)
+    check("STRERROR call", peer.send("STRERROR", pam_python.encode_strerror(7)), "STRERROR 7")
+    check("STRERROR reply", peer.reply("STRERROR", pam_python.decode_strerror), "error 7")
+    check("SYSLOG", peer.send("SYSLOG", pam_python.encode_syslog([(3, b"x"), (6, b"")])), "SYSLOG 2 [3 78] [6 ]")
+
+    # Truncated frames and Lists larger than their frame, refused by the C decoders
+    check("GET_ITEM empty", peer.send("GET_ITEM", raw()), f"GET_ITEM error {READ_ERR}")
+    check("GET_USER prompt missing", peer.send("GET_USER", raw(1)), f"GET_USER error {READ_ERR}")
+    check("GET_USER prompt cut short", peer.send("GET_USER", raw(1, 10, data=b"abc")), f"GET_USER error {READ_ERR}")
+    check("SET_ITEM count beyond the frame", peer.send("SET_ITEM", raw(1000, P.PAM_USER, data=b"x")),
+          f"SET_ITEM error {READ_ERR}")
+    check("SET_ITEM negative count", peer.send("SET_ITEM", raw(-1)), f"SET_ITEM error {READ_ERR}")
+    check("CONVERSE count beyond the frame", peer.send("CONVERSE", raw(1 << 30)), f"CONVERSE error {READ_ERR}")
+    check("CONVERSE element cut short", peer.send("CONVERSE", raw(1, P.PAM_PROMPT_ECHO_ON, 50)),
+          f"CONVERSE error {READ_ERR}")
+    check("SYSLOG record cut short", peer.send("SYSLOG", raw(1, 3, 100)), f"SYSLOG error {READ_ERR}")
+
+    # Malformed replies (see malformed_reply() in codec.c), refused by the Python decoders
+    peer.send("GET_ITEM", pam_python.encode_get_item(-1))
+    check("GET_ITEM reply cut short", peer.refused("GET_ITEM", pam_python.decode_get_item), True)
+    peer.send("FAIL_DELAY", pam_python.encode_fail_delay(-1))
+    check("CONVERSE reply count beyond the frame", peer.refused("FAIL_DELAY", pam_python.decode_converse), True)
+    peer.send("STRERROR", pam_python.encode_strerror(-1))
+    check("STRERROR reply longer than the frame", peer.refused("STRERROR", pam_python.decode_strerror), True)
+
+    check("RETURN", peer.send("RETURN", pam_python.encode_return(5)), "RETURN 5")
+    check("codec exit status", peer.close(), 0)
+
+    print(f"{failures} failures")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,85 @@
+// Authenticate from many threads of one process at once, like a gateway
+// calling pam_authenticate() from a thread pool. Each PAM handle gets its own
+// user, stress.py prefixes it with "ok-" so that a reply which ended up on the
+// wrong handle is noticed.
+//
+// /etc/pam.d/pam-python-stress:
+//   auth required pam_python.so mode=pool workers=8 /path/to/testing/stress.py
+//
+// Usage: ./stress [service] [threads] [rounds]
+
+#include <pthread.h>
+#include <security/pam_appl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS 1024
+
+static const char *service = "pam-python-stress";
+static int rounds = 100;
+
+static int conv(int n, const struct pam_message **msg, struct pam_response **resp, void *data) {
+    return PAM_CONV_ERR;
+}
+
+static void *run(void *arg) {
+    struct pam_conv c = {conv, NULL};
+    long thread = (long)arg;
+    long failures = 0;
+
+    for (int i = 0; i < rounds; i++) {
+        char user[64], expected[68];
+        const char *seen = NULL;
+        pam_handle_t *pamh;
+
+        snprintf(user, sizeof(user), "stress-%ld-%d", thread, i);
+        snprintf(expected, sizeof(expected), "ok-%s", user);
+        if (pam_start(service, user, &c, &pamh) != PAM_SUCCESS) {
+            failures++;
+            continue;
+        }
+
+        int retval = pam_authenticate(pamh, 0);
+        pam_get_item(pamh, PAM_USER, (const void **)&seen);
+        if (retval != PAM_SUCCESS || !seen || strcmp(seen, expected) != 0) {
+            fprintf(stderr, "%s: %s (user=%s)\n", user, pam_strerror(pamh, retval), seen ? seen : "NULL");
+            failures++;
+        }
+        pam_end(pamh, retval);
+    }
+    return (void *)failures;
+}
+
+int main(int argc, char **argv) {
+    int threads = 64;
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+    long failures = 0;
+
+    if (argc > 1) service = argv[1];
+    if (argc > 2) threads = atoi(argv[2]);
+    if (argc > 3) rounds = atoi(argv[3]);
+    if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, run, (void *)i);
+    }
+    for (int i = 0; i < threads; i++) {
+        void *result;
+        pthread_join(tids[i], &result);
+        failures += (long)result;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long total = (long)threads * rounds;
+    printf("%ld requests from %d threads in %.2fs (%.0f/s), %ld failures\n", total, threads, seconds,
+           total / seconds, failures);
+    return failures != 0;
+}
@@ -0,0 +1,6 @@
+"""Handler for stress.c, marks the user of the request as seen"""
+
+
+def pam_sm_authenticate(pamh, flags, argv):
+    pamh.user = "ok-" + pamh.user
+    return pamh.PAM_SUCCESS